@@ -0,0 +1,44 @@
+# Command encoding benchmark for call and queue with mixed arguments.
+#
+# Run it with `rake bench` against a local redis-server. Arguments are
+# encoded into a per connection scratch buffer, so the object count per
+# command should stay at the reply alone.
+
+COMMANDS = 100_000
+
+def measure(name, commands)
+  GC.start
+  GC.disable
+  before = ObjectSpace.count_objects
+  started = Time.now
+  commands.times { |i| yield i }
+  elapsed = Time.now - started
+  after = ObjectSpace.count_objects
+  GC.enable
+
+  allocated = (after[:TOTAL] - after[:FREE]) - (before[:TOTAL] - before[:FREE])
+  puts "#{name}: #{(commands / elapsed).round} ops/sec, #{(allocated.to_f / commands).round(2)} objects/command"
+end
+
+hiredis = Hiredis.new
+key = "mruby-hiredis-bench:argv"
+fields = {"a" => 1, "b" => 2.5, "c" => "three"}
+
+measure("call(:set, key, Integer)", COMMANDS) { |i| hiredis.call(:set, key, i) }
+measure("call(:hset, key, Hash)", COMMANDS) { |i| hiredis.call(:hset, key + ":hash", fields) }
+measure("queue(:incrbyfloat, key, Float)", COMMANDS) do |i|
+  hiredis.queue(:incrbyfloat, key + ":float", 0.5)
+  hiredis.bulk_reply if i % 1000 == 999
+end
+
+
+set = hiredis.prepare(:set, key, :_)
+measure("prepared set, Integer", COMMANDS) { |i| set.call(i) }
+measure("call_formatted(Command, Integer)", COMMANDS) { |i| hiredis.call_formatted(set.command, i) }
+get = Hiredis.format_command(:get, key)
+measure("queue_formatted(String)", COMMANDS) do |i|
+  hiredis.queue_formatted(get)
+  hiredis.bulk_reply if i % 1000 == 999
+end
+
+hiredis.call(:del, key, key + ":hash", key + ":float")
@@ -0,0 +1,37 @@
+# Single connection Hiredis::Async throughput.
+#
+# Run it with `rake bench` against a local redis-server. Compares the native
+# readiness adapter with the Ruby Callbacks lambdas, each round queues one
+# command and runs the loop until its reply arrived, so every command pays
+# for one write and one read toggle. Hiredis::FiberClient runs the same
+# number of commands from 100 fibers, which share the writes.
+
+COMMANDS = 100_000
+
+def measure(name, async)
+  key = "mruby-hiredis-bench:async"
+  done = false
+  started = Time.now
+  COMMANDS.times do
+    done = false
+    async.queue(:incr, key) { |reply| done = true }
+    async.evloop.run_once until done
+  end
+  elapsed = Time.now - started
+  puts "#{name}: #{(COMMANDS / elapsed).round} ops/sec"
+  async.queue(:del, key) { |reply| async.disconnect }
+  async.evloop.run
+end
+
+measure("native adapter", Hiredis::Async.new)
+measure("Ruby Callbacks", Hiredis::Async.new(Hiredis::Async::Callbacks.new))
+
+client = Hiredis::FiberClient.new
+started = Time.now
+100.times do
+  client.spawn { |redis| (COMMANDS / 100).times { redis.incr("mruby-hiredis-bench:async") } }
+end
+client.run
+puts "FiberClient, 100 fibers: #{(COMMANDS / (Time.now - started)).round} ops/sec"
+client.del("mruby-hiredis-bench:async")
+client.close
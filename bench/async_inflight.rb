@@ -0,0 +1,28 @@
+# In-flight callback benchmark for Hiredis::Async.
+#
+# Run it with `rake bench` against a local redis-server. Each round queues
+# depth commands with a block before pumping the event loop, so the time
+# per reply should stay flat as the number of pending callbacks grows.
+
+ROUNDS = 200_000
+
+async = Hiredis::Async.new
+key = "mruby-hiredis-bench:inflight"
+
+[1, 10, 100, 1_000, 10_000, 100_000].each do |depth|
+  rounds = ROUNDS / depth
+  rounds = 1 if rounds < 1
+  done = 0
+  started = Time.now
+  rounds.times do
+    depth.times { async.queue(:incr, key) { |reply| done += 1 } }
+    async.evloop.run_once while done < depth
+    done = 0
+  end
+  elapsed = Time.now - started
+  replies = rounds * depth
+  puts "depth #{depth}: #{(replies / elapsed).round} replies/sec, #{(elapsed * 1_000_000 / replies).round(3)} usec/reply"
+end
+
+async.queue(:del, key) { |reply| async.disconnect }
+async.evloop.run
@@ -0,0 +1,127 @@
+# Client side benchmark suite against Hiredis::MockServer.
+#
+# Run it with `rake bench_mock`, no redis-server needed. The mock server
+# runs on its own thread inside the benchmark process and answers every
+# command with a canned reply, so the numbers only move when the client
+# side changes. Pass scenario names to run a subset:
+#
+#   mruby/build/bench/host/bin/mruby bench/mock/suite.rb pipeline bulk
+
+SMALL    = "x" * 16
+BULK     = "x" * (1024 * 1024)
+ELEMENTS = 100_000
+
+server = Hiredis::MockServer.new
+server.reply(:get, SMALL)
+server.reply(:incr, 1)
+
+def measure(name, ops_per_round, rounds, client)
+  # allocations are counted on one round with the GC off, timing runs with it on
+  GC.start
+  GC.disable
+  before = ObjectSpace.count_objects
+  yield
+  after = ObjectSpace.count_objects
+  GC.enable
+  allocated = (after[:TOTAL] - after[:FREE]) - (before[:TOTAL] - before[:FREE])
+
+  client.reset_stats
+  started = Time.now
+  rounds.times { yield }
+  elapsed = Time.now - started
+
+  ops = ops_per_round * rounds
+  line = "#{name}: #{(ops / elapsed).round} ops/sec, #{(allocated.to_f / ops_per_round).round(2)} objects/op"
+  latency = client.stats[:latency].values.first
+  if latency
+    line << ", p50 #{(latency[:p50] * 1_000_000).round(1)} usec, p99 #{(latency[:p99] * 1_000_000).round(1)} usec"
+  end
+  puts line
+end
+
+scenarios = {}
+
+scenarios["small"] = lambda do
+  hiredis = Hiredis.new("127.0.0.1", server.port)
+  measure("GET 16 bytes", 1, 100_000, hiredis) { hiredis.call(:get, "key") }
+  measure("SET 16 bytes", 1, 100_000, hiredis) { hiredis.call(:set, "key", SMALL) }
+  hiredis.close
+end
+
+scenarios["pipeline"] = lambda do
+  hiredis = Hiredis.new("127.0.0.1", server.port)
+  [10, 100, 1_000, 10_000].each do |depth|
+    measure("pipeline depth #{depth}", depth, 1_000_000 / depth, hiredis) do
+      depth.times { hiredis.queue(:get, "key") }
+      hiredis.bulk_reply
+    end
+  end
+  hiredis.close
+end
+
+scenarios["bulk"] = lambda do
+  server.reply(:get, BULK)
+  hiredis = Hiredis.new("127.0.0.1", server.port)
+  measure("GET 1MB", 1, 1_000, hiredis) { hiredis.call(:get, "key") }
+  measure("SET 1MB", 1, 1_000, hiredis) { hiredis.call(:set, "key", BULK) }
+  hiredis.close
+  server.reply(:get, SMALL)
+end
+
+scenarios["aggregate"] = lambda do
+  list = []
+  hash = {}
+  ELEMENTS.times do |i|
+    list << "element-#{i}"
+    hash["field-#{i}"] = "value-#{i}"
+  end
+  server.reply(:lrange, list)
+  server.reply(:hgetall, hash)
+  list = hash = nil
+  hiredis = Hiredis.new("127.0.0.1", server.port)
+  measure("LRANGE #{ELEMENTS} array", 1, 20, hiredis) { hiredis.call(:lrange, "list", "0", "-1") }
+  measure("HGETALL #{ELEMENTS} map", 1, 20, hiredis) { hiredis.call(:hgetall, "hash") }
+  hiredis.close
+end
+
+scenarios["async"] = lambda do
+  [1, 16].each do |connections|
+    evloop = RedisAe.new
+    clients = Array.new(connections) { Hiredis::Async.new(nil, evloop, "127.0.0.1", server.port) }
+    depth = 1_000
+    done = 0
+    measure("async fan-in #{connections} connections", depth * connections, 100, clients.first) do
+      clients.each do |async|
+        depth.times { async.queue(:incr, "key") { |reply| done += 1 } }
+      end
+      evloop.run_once while done < depth * connections
+      done = 0
+    end
+    clients.each(&:disconnect)
+    evloop.run_once
+  end
+
+  evloop = RedisAe.new
+  async = Hiredis::Async.new(nil, evloop, "127.0.0.1", server.port)
+  depth = 1_000
+  done = 0
+  measure("async corked depth #{depth}", depth, 100, async) do
+    async.cork do
+      depth.times { async.queue(:incr, "key") { |reply| done += 1 } }
+    end
+    evloop.run_once while done < depth
+    done = 0
+  end
+  puts "  #{async.stats[:writes]} writes for #{async.stats[:commands]} commands"
+  async.disconnect
+  evloop.run_once
+end
+
+selected = ARGV.empty? ? scenarios.keys : ARGV
+selected.each do |name|
+  scenario = scenarios[name]
+  raise ArgumentError, "unknown scenario #{name}, pick from #{scenarios.keys.join(', ')}" unless scenario
+  scenario.call
+end
+
+server.close
@@ -0,0 +1,30 @@
+# Hiredis::Reader throughput on a canned buffer.
+#
+# Doesn't need a redis-server. Feeds the same RESP stream of small replies
+# and one large array in chunks of 16KB and counts how fast replies come
+# out of gets.
+
+REPLIES = 100_000
+CHUNK   = 16 * 1024
+
+small = "*3\r\n$3\r\nfoo\r\n:42\r\n+OK\r\n" * REPLIES
+large = "*#{REPLIES}\r\n" + ("$7\r\nelement\r\n" * REPLIES)
+
+def measure(name, buffer, replies)
+  reader = Hiredis::Reader.new
+  started = Time.now
+  offset = 0
+  got = 0
+  while offset < buffer.bytesize
+    reader.feed(buffer.byteslice(offset, CHUNK))
+    offset += CHUNK
+    got += 1 while reader.gets != false
+  end
+  elapsed = Time.now - started
+  raise "expected #{replies} replies, got #{got}" unless got == replies
+  puts "#{name}: #{(buffer.bytesize / elapsed / 1024 / 1024).round(1)} MB/sec, #{(replies / elapsed).round} replies/sec"
+  reader.close
+end
+
+measure("#{REPLIES} small arrays", small, REPLIES)
+measure("one #{REPLIES} element array", large, 1)
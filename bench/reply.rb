@@ -0,0 +1,43 @@
+# Reply conversion benchmark for large LRANGE and HGETALL replies.
+#
+# Run it with `rake bench` against a local redis-server. Replies are built
+# as mruby values while hiredis parses them, so compare the numbers with a
+# build from before that change to see the time saved; the mruby object
+# counts stay the same, the redisReply tree that used to sit in between
+# never shows up in them.
+
+ELEMENTS = 100_000
+ROUNDS   = 20
+
+def measure(name, rounds)
+  GC.start
+  GC.disable
+  before = ObjectSpace.count_objects
+  yield
+  after = ObjectSpace.count_objects
+  GC.enable
+
+  allocated = (after[:TOTAL] - after[:FREE]) - (before[:TOTAL] - before[:FREE])
+
+  started = Time.now
+  rounds.times { yield }
+  elapsed = Time.now - started
+
+  puts "#{name}: #{(elapsed * 1000 / rounds).round(2)} ms/reply, #{allocated} objects/reply"
+end
+
+hiredis = Hiredis.new
+list = "mruby-hiredis-bench:list"
+hash = "mruby-hiredis-bench:hash"
+hiredis.call(:del, list, hash)
+
+ELEMENTS.times do |i|
+  hiredis.queue(:rpush, list, "element-#{i}")
+  hiredis.queue(:hset, hash, "field-#{i}", "value-#{i}")
+end
+hiredis.bulk_reply
+
+measure("LRANGE #{ELEMENTS}", ROUNDS) { hiredis.call(:lrange, list, "0", "-1") }
+measure("HGETALL #{ELEMENTS}", ROUNDS) { hiredis.call(:hgetall, hash) }
+
+hiredis.call(:del, list, hash)
@@ -0,0 +1,35 @@
+# Hiredis against Hiredis::Threaded when there is Ruby work between sending
+# a pipeline and reading its replies.
+#
+# Run it with `rake bench` against a local redis-server. Every round queues
+# DEPTH GETs of a 4KB value, does some Ruby work and then takes the replies.
+# Hiredis only reads the replies inside bulk_reply, the I/O thread of
+# Hiredis::Threaded reads and parses them while the Ruby work runs.
+
+DEPTH  = 1_000
+ROUNDS = 200
+
+def work
+  sum = 0
+  20_000.times { |i| sum += i * i }
+  sum
+end
+
+def measure(name, client)
+  key = "mruby-hiredis-bench:threaded"
+  client.call(:set, key, "x" * 4096)
+  started = Time.now
+  ROUNDS.times do
+    DEPTH.times { client.queue(:get, key) }
+    client.flush
+    work
+    client.bulk_reply
+  end
+  elapsed = Time.now - started
+  puts "#{name}: #{(DEPTH * ROUNDS / elapsed).round} ops/sec"
+  client.call(:del, key)
+  client.close
+end
+
+measure("Hiredis", Hiredis.new)
+measure("Hiredis::Threaded", Hiredis::Threaded.new)
@@ -0,0 +1,7 @@
+MRuby::Build.new('host', "#{MRUBY_ROOT}/build/bench") do |conf|
+  toolchain :gcc
+  conf.cc.flags << '-O3'
+  conf.cc.defines << 'MRB_HIREDIS_BENCH'
+  conf.gembox 'full-core'
+  conf.gem File.expand_path(File.dirname(__FILE__))
+end
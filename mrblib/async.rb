@@ -2,5 +2,19 @@ class Hiredis
   class Async
     attr_reader :callbacks
     attr_reader :evloop
+
+    # Commands queued while corked stay in the output buffer and leave in
+    # one write on uncork or flush, once max_bytes are buffered, or
+    # max_delay seconds after the first one was held back. With a block the
+    # connection is uncorked when it returns.
+    def cork(max_bytes: 64 * 1024, max_delay: nil)
+      setup_cork(max_bytes, max_delay.to_f)
+      return self unless block_given?
+      begin
+        yield self
+      ensure
+        uncork if corked?
+      end
+    end
   end
 end
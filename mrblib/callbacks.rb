@@ -50,6 +50,11 @@ class Hiredis
         end
       end
 
+      def scheduleTimer(&block)
+        raise ArgumentError, "no block given" unless block_given?
+        @scheduleTimer = block
+      end
+
       def disconnect(&block)
         raise ArgumentError, "no block given" unless block_given?
         @disconnect = block
@@ -0,0 +1,259 @@
+class Hiredis
+  class Cluster
+    class Pipeline
+      attr_reader :cluster
+
+      def initialize(cluster)
+        @cluster = cluster
+        @commands = []
+      end
+
+      def queue(*command)
+        @commands << command
+        self
+      end
+      alias :call :queue
+
+      def method_missing(name, *args, &block)
+        return super unless Hiredis.command_method?(name, block)
+        queue(name, *args)
+      end
+
+      def flush
+        commands, @commands = @commands, []
+        commands.empty? ? [] : @cluster.run_pipeline(commands)
+      end
+    end
+
+    # commands without a key, they go to the owner of slot 0
+    KEYLESS = {}
+    %w(
+      acl asking auth bgrewriteaof bgsave client cluster command config dbsize
+      debug discard echo exec failover flushall flushdb function hello info
+      keys lastsave latency lolwut module monitor multi ping psubscribe psync
+      publish pubsub punsubscribe quit randomkey readonly readwrite replicaof
+      reset role save scan script select shutdown slaveof slowlog subscribe
+      swapdb sync time unsubscribe unwatch wait waitaof
+    ).each { |name| KEYLESS[name] = true }
+
+    attr_reader :max_redirects, :options
+
+    def initialize(nodes = [["localhost", 7000]], max_redirects: 5, options: {})
+      @seeds = nodes.map { |node| node.is_a?(String) ? split_addr(node) : node }
+      @max_redirects = max_redirects
+      @options = options
+      @nodes = {}
+      @slots = Array.new(SLOTS)
+      refresh_slots
+    end
+
+    def method_missing(name, *args, &block)
+      return super unless Hiredis.command_method?(name, block)
+      call(name, *args)
+    end
+
+    def call(command, *args)
+      addr = addr_for(key_for(command, args))
+      redirects = 0
+      asking = false
+      loop do
+        node = connection(addr)
+        reply = begin
+          if asking
+            node.queue(:asking)
+            node.queue(command, *args)
+            node.bulk_reply.last
+          else
+            node.call(command, *args)
+          end
+        rescue IOError, SystemCallError => e
+          drop(addr)
+          refresh_slots
+          raise e
+        end
+        kind, slot, target = redirect_for(reply, addr)
+        return reply unless kind && redirects < @max_redirects
+        redirects += 1
+        # a resharding moves slot by slot, each one is fixed up when it's hit
+        @slots[slot] = target if kind == "MOVED"
+        asking = kind == "ASK"
+        addr = target
+      end
+    end
+
+    def pipelined
+      raise ArgumentError, "no block given" unless block_given?
+      pipeline = Pipeline.new(self)
+      yield pipeline
+      pipeline.flush
+    end
+
+    # Commands are split by node, every node gets its whole batch written
+    # before any replies are read, so all nodes work on them at once.
+    def run_pipeline(commands)
+      batches = {}
+      commands.each_with_index do |command, i|
+        addr = addr_for(key_for(command[0], command[1..-1]))
+        (batches[addr] ||= []) << i
+      end
+
+      replies = Array.new(commands.size)
+      begin
+        batches.each do |addr, indices|
+          node = connection(addr)
+          indices.each { |i| node.queue(*commands[i]) }
+          node.flush
+        end
+        batches.each do |addr, indices|
+          node_replies = connection(addr).bulk_reply
+          indices.each_with_index { |i, j| replies[i] = node_replies[j] }
+        end
+      ensure
+        @nodes.each_value do |node|
+          begin
+            node.bulk_reply if node.pending > 0
+          rescue IOError, SystemCallError, Hiredis::Error
+          end
+        end
+      end
+
+      replies.each_with_index do |reply, i|
+        replies[i] = call(*commands[i]) if redirect_for(reply, nil)
+      end
+      replies
+    end
+
+    def refresh_slots
+      errors = []
+      candidates = @nodes.keys
+      @seeds.each do |host, port|
+        seed = "#{host}:#{port}"
+        candidates << seed unless candidates.include?(seed)
+      end
+      candidates.each do |addr|
+        begin
+          @slots = load_slots(addr)
+          return self
+        rescue IOError, SystemCallError, Hiredis::Error => e
+          drop(addr)
+          errors << "#{addr}: #{e.message}"
+        end
+      end
+      raise Error, "cannot load the cluster slot map (#{errors.join(", ")})"
+    end
+
+    def node_for(key)
+      connection(addr_for(key))
+    end
+
+    def nodes
+      @nodes.keys
+    end
+
+    def close
+      @nodes.each_value { |node| node.close }
+      @nodes.clear
+      self
+    end
+
+    def [](key)
+      call(:get, key)
+    end
+
+    def []=(key, value)
+      call(:set, key, value)
+    end
+
+    private
+
+    def key_for(command, args)
+      name = command.to_s.downcase
+      return if KEYLESS[name]
+      key = case name
+      when "eval", "evalsha", "eval_ro", "evalsha_ro", "fcall", "fcall_ro"
+        args[1].to_i > 0 ? args[2] : nil
+      when "xread", "xreadgroup"
+        i = 0
+        i += 1 while i < args.size && args[i].to_s.downcase != "streams"
+        args[i + 1]
+      else
+        args.first
+      end
+      key = key.first while key.is_a?(Array)
+      key = key.keys.first if key.is_a?(Hash)
+      key
+    end
+
+    def addr_for(key)
+      addr = @slots[key.nil? ? 0 : Cluster.key_slot(key)]
+      addr || @slots.find { |slot_addr| slot_addr } || raise(Error, "no node serves any slot")
+    end
+
+    def connection(addr)
+      @nodes[addr] ||= Hiredis.new(*split_addr(addr), @options)
+    end
+
+    def drop(addr)
+      node = @nodes.delete(addr)
+      node.close if node
+    rescue IOError
+    end
+
+    def split_addr(addr)
+      i = addr.rindex(":")
+      [addr[0, i], addr[i + 1..-1].to_i]
+    end
+
+    def redirect_for(reply, addr)
+      return unless reply.is_a?(ReplyError)
+      kind, slot, target = reply.message.split(" ")
+      return unless kind == "MOVED" || kind == "ASK"
+      if target[0] == ":" && addr
+        target = split_addr(addr)[0] + target
+      end
+      [kind, slot.to_i, target]
+    end
+
+    def load_slots(addr)
+      node = connection(addr)
+      host = split_addr(addr)[0]
+      slots = Array.new(SLOTS)
+
+      shards = node.call(:cluster, :shards)
+      if shards.is_a?(ReplyError)
+        ranges = node.call(:cluster, :slots)
+        raise ranges if ranges.is_a?(ReplyError)
+        ranges.each do |range|
+          master = range[2]
+          master_host = master[0].nil? || master[0].empty? || master[0] == "?" ? host : master[0]
+          fill_slots(slots, range[0], range[1], "#{master_host}:#{master[1]}")
+        end
+      else
+        shards.each do |shard|
+          master = shard["nodes"].find { |shard_node| shard_node["role"] == "master" }
+          next unless master
+          master_host = master["endpoint"]
+          master_host = master["ip"] if master_host.nil? || master_host.empty? || master_host == "?"
+          master_host = host if master_host.nil? || master_host.empty?
+          master_addr = "#{master_host}:#{master["port"] || master["tls-port"]}"
+          ranges = shard["slots"]
+          i = 0
+          while i < ranges.size
+            fill_slots(slots, ranges[i], ranges[i + 1], master_addr)
+            i += 2
+          end
+        end
+      end
+
+      slots
+    end
+
+    def fill_slots(slots, first, last, addr)
+      slot = first
+      while slot <= last
+        slots[slot] = addr
+        slot += 1
+      end
+    end
+  end
+end
@@ -0,0 +1,48 @@
+class Hiredis
+  # RESP for a whole command, send it with call_formatted or queue_formatted
+  def self.format_command(*args)
+    Command.new(*args).format
+  end
+
+  # encodes the constant parts of a command once, :_ marks the arguments
+  # which are passed to call or queue
+  def prepare(*args)
+    Prepared.new(self, Command.new(*args))
+  end
+
+  class Prepared
+    attr_reader :command
+
+    def initialize(connection, command)
+      @connection = connection
+      @command = command
+    end
+
+    def call(*values)
+      @connection.call_formatted(@command, *values)
+    end
+
+    def queue(*values)
+      @connection.queue_formatted(@command, *values)
+    end
+  end
+
+  class Async
+    def prepare(*args)
+      Prepared.new(self, Command.new(*args))
+    end
+
+    class Prepared
+      attr_reader :command
+
+      def initialize(connection, command)
+        @connection = connection
+        @command = command
+      end
+
+      def queue(*values, &block)
+        @connection.queue_formatted(@command, *values, &block)
+      end
+    end
+  end
+end
@@ -0,0 +1,78 @@
+class Hiredis
+  # Blocking style commands for many fibers over one Hiredis::Async
+  # connection. A fiber which sends a command is suspended until its reply
+  # arrives, commands queued in the same loop tick leave in one write.
+  class FiberClient
+    attr_reader :async, :evloop
+
+    def initialize(host_or_path = "localhost", port = 6379, evloop: nil, options: {})
+      @async = Async.new(nil, evloop, host_or_path, port, options)
+      @evloop = @async.evloop
+      @fibers = {}
+      @ready = []
+    end
+
+    # the block starts running right away, until its first command
+    def spawn(*args, &block)
+      raise ArgumentError, "no block given" unless block
+      fiber = Fiber.new do
+        begin
+          block.call(self, *args)
+        ensure
+          @fibers.delete(fiber)
+        end
+      end
+      @fibers[fiber] = true
+      fiber.resume
+      fiber
+    end
+
+    # outside of spawned fibers the loop runs until the reply is there
+    def call(*command)
+      fiber = Fiber.current
+      if @fibers[fiber]
+        @async.queue(*command) { |reply| @ready << [fiber, reply] }
+        Fiber.yield
+      else
+        done = false
+        result = nil
+        @async.queue(*command) do |reply|
+          result = reply
+          done = true
+        end
+        tick until done
+        result
+      end
+    end
+
+    def method_missing(name, *args, &block)
+      return super unless Hiredis.command_method?(name, block)
+      call(name, *args)
+    end
+
+    # runs the loop until every spawned fiber finished
+    def run
+      tick until @fibers.empty?
+      self
+    end
+
+    # fibers are resumed after the loop returns, not from inside reply blocks
+    def tick
+      @evloop.run_once
+      until @ready.empty?
+        fiber, reply = @ready.shift
+        fiber.resume(reply)
+      end
+      self
+    end
+
+    def running
+      @fibers.size
+    end
+
+    def close
+      @async.disconnect
+      self
+    end
+  end
+end
@@ -1,40 +1,153 @@
 class Hiredis
   class << self
-    attr_accessor :created_shortcuts
-
     def new(*args)
       instance = super(*args)
-      unless self.created_shortcuts
-        create_shortcuts(instance)
-        self.created_shortcuts = true
-      end
       instance.call(:hello, "3")
       instance
     end
 
+    # Every command redis ships with is already a method, this adds those a
+    # server knows on top of them, like the ones of loaded modules.
     def create_shortcuts(hiredis)
       hiredis.call(:command).each do |command|
         command = command.first.to_sym
+        next if method_defined?(command)
         define_method(command) do |*args|
           call(command, *args)
         end
+        [Pipeline, Cluster::Pipeline].each do |pipeline|
+          pipeline.send(:define_method, command) do |*args|
+            queue(command, *args)
+          end
+        end
+        Cluster.send(:define_method, command) do |*args|
+          call(command, *args)
+        end
       end
       self
     end
+
+    def command_method?(name, block)
+      !block && !"=?!".include?(name.to_s[-1])
+    end
   end #class << self
 
+  if method_defined?(:reconnect)
+    alias_method :reconnect_socket, :reconnect
+    private :reconnect_socket
+
+    # the new connection speaks RESP2 until it gets the same HELLO as in new
+    def reconnect
+      connected = reconnect_socket
+      call(:hello, "3") if connected
+      connected
+    end
+  end
+
+  # commands missing from the built in table are sent as they are named
+  def method_missing(name, *args, &block)
+    return super unless Hiredis.command_method?(name, block)
+    call(name, *args)
+  end
+
+  # A command can be [script, keys, args]. A NOSCRIPT inside MULTI can't be
+  # retried and the server may have lost a script since it was last run, so
+  # every script is loaded ahead of MULTI, in the same round trip.
   def transaction(*commands)
+    loads = {}
+    commands.each do |script, *|
+      if script.is_a?(Script) && !loads[script.sha]
+        queue(:script, :load, script.source)
+        script_loaded(script)
+        loads[script.sha] = true
+      end
+    end
     queue(:multi)
     commands.each do |command|
-      queue(*command)
+      if command.first.is_a?(Script)
+        script, keys, args = command
+        keys ||= []
+        queue(:evalsha, script.sha, keys.size, keys, args || [])
+      else
+        queue(*command)
+      end
     end
     queue(:exec)
-    bulk_reply
+    replies = bulk_reply
+    replies = replies[loads.size..-1] unless loads.empty?
+    if replies.last.is_a?(Array)
+      replies.last.each_with_index do |reply, i|
+        script = commands[i].first
+        script_flushed(script) if script.is_a?(Script) && Script.noscript?(reply)
+      end
+    end
+    replies
   rescue => e
     call(:discard)
     raise e
   end
 
+  def pipelined
+    raise ArgumentError, "no block given" unless block_given?
+    raise Error, "#{pending} replies pending" if pending > 0
+    pipeline = Pipeline.new(self)
+    begin
+      yield pipeline
+      pipeline.flush
+    rescue => e
+      bulk_reply if pending > 0
+      raise e
+    end
+  end
+
+  # replies of read commands are kept locally until redis invalidates their
+  # keys, the socket is checked for invalidations at most every max_staleness
+  # seconds. Only this synchronous client has a cache, Async doesn't.
+  def enable_cache(max_bytes = 64 * 1024 * 1024, max_staleness: 0.001)
+    raise Error, "#{pending} replies pending" if pending > 0
+    call(:client, :tracking, :on)
+    setup_cache(max_bytes, max_staleness.to_f)
+  end
+
+  def disable_cache
+    teardown_cache
+    call(:client, :tracking, :off)
+    self
+  end
+
+  def scan_each(*args, &block)
+    scan_pages(:scan, [], args, &block)
+  end
+
+  def hscan_each(key, *args, &block)
+    scan_pages(:hscan, [key], args, &block)
+  end
+
+  def sscan_each(key, *args, &block)
+    scan_pages(:sscan, [key], args, &block)
+  end
+
+  def zscan_each(key, *args, &block)
+    scan_pages(:zscan, [key], args, &block)
+  end
+
+  # the value is written to io, or yielded, in chunks of at most buffer
+  # bytes, returns the number of bytes or nil when the key doesn't exist
+  def get_to(key, io = nil, buffer: 64 * 1024, &block)
+    sink = io || block
+    raise ArgumentError, "no io or block given" unless sink
+    reply = stream_get(key, sink, buffer)
+    raise reply if reply.is_a?(ReplyError)
+    reply
+  end
+
+  # length bytes are read from io, buffer bytes at a time, and sent as the value
+  def set_from(key, io, length, buffer: 64 * 1024)
+    reply = stream_set(key, io, length, buffer)
+    raise reply if reply.is_a?(ReplyError)
+    reply
+  end
+
   def [](key)
     call(:get, key)
   end
@@ -42,4 +155,43 @@ class Hiredis
   def []=(key, value)
     call(:set, key, value)
   end
+
+  private :busy
+
+  private
+
+  # the next page is requested before the current one is yielded, so the
+  # block can't send commands on this connection while it runs
+  def scan_pages(command, key, args)
+    raise ArgumentError, "no block given" unless block_given?
+    raise Error, "#{pending} replies pending" if pending > 0
+    pairs = command == :hscan || command == :zscan
+    queue(command, *key, "0", *args)
+    begin
+      loop do
+        page = reply
+        raise page if page.is_a?(ReplyError)
+        cursor, elements = page
+        unless cursor == "0"
+          queue(command, *key, cursor, *args)
+          flush
+        end
+        busy do
+          if pairs
+            i = 0
+            while i < elements.size
+              yield elements[i], elements[i + 1]
+              i += 2
+            end
+          else
+            elements.each { |element| yield element }
+          end
+        end
+        break if cursor == "0"
+      end
+    ensure
+      bulk_reply if pending > 0
+    end
+    self
+  end
 end
@@ -0,0 +1,24 @@
+class Hiredis
+  class Pipeline
+    attr_reader :hiredis
+
+    def initialize(hiredis)
+      @hiredis = hiredis
+    end
+
+    def queue(*command)
+      @hiredis.queue(*command)
+      self
+    end
+    alias :call :queue
+
+    def method_missing(name, *args, &block)
+      return super unless Hiredis.command_method?(name, block)
+      queue(name, *args)
+    end
+
+    def flush
+      @hiredis.pending > 0 ? @hiredis.bulk_reply : []
+    end
+  end
+end
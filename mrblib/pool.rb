@@ -0,0 +1,149 @@
+class Hiredis
+  class Pool
+    class TimeoutError < Error; end
+
+    attr_reader :size, :idle_timeout, :timeout, :options
+
+    # wait is called with the seconds left while all connections are checked
+    # out, it has to let whoever holds one run, e.g. by resuming other fibers
+    def initialize(host_or_path = "localhost", port = 6379, size: 5, idle_timeout: 60, timeout: 5, wait: nil, options: {})
+      raise ArgumentError, "size must be positive" unless size > 0
+      raise ArgumentError, "wait must respond to call" if wait && !wait.respond_to?(:call)
+      @host_or_path, @port, @options = host_or_path, port, options
+      @size, @idle_timeout, @timeout, @wait = size, idle_timeout, timeout, wait
+      @idle = []
+      @created = 0
+      reset_stats
+    end
+
+    def with
+      raise ArgumentError, "no block given" unless block_given?
+      hiredis = checkout
+      broken = false
+      begin
+        yield hiredis
+      rescue IOError, SystemCallError, ProtocolError, OOMError => e
+        broken = true
+        raise e
+      ensure
+        broken ? repair(hiredis) : checkin(hiredis)
+      end
+    end
+
+    def checkout
+      started = nil
+      loop do
+        evict_idle
+        if (entry = @idle.pop)
+          return checked_out(entry[0], started)
+        end
+        if @created < @size
+          @created += 1
+          begin
+            hiredis = Hiredis.new(@host_or_path, @port, @options)
+          rescue => e
+            @created -= 1
+            raise e
+          end
+          @stats[:connects] += 1
+          return checked_out(hiredis, started)
+        end
+        unless started
+          started = Time.now.to_f
+          @stats[:waits] += 1
+        end
+        wait(started)
+      end
+    end
+
+    # closed connections and ones with replies left unread aren't reused
+    def checkin(hiredis)
+      if hiredis.closed?
+        @created -= 1
+      elsif hiredis.pending > 0
+        discard(hiredis)
+      else
+        @idle.push([hiredis, Time.now.to_f])
+      end
+      self
+    end
+
+    def available
+      @idle.size + (@size - @created)
+    end
+
+    def stats
+      @stats.merge(size: @size, created: @created, idle: @idle.size)
+    end
+
+    def reset_stats
+      @stats = {
+        checkouts: 0, waits: 0, wait_time: 0.0, max_wait_time: 0.0,
+        connects: 0, reconnects: 0, evictions: 0
+      }
+      self
+    end
+
+    def close
+      @idle.each { |entry| entry[0].close }
+      @created -= @idle.size
+      @idle.clear
+      self
+    end
+
+    private
+
+    def checked_out(hiredis, started)
+      @stats[:checkouts] += 1
+      if started
+        waited = Time.now.to_f - started
+        @stats[:wait_time] += waited
+        @stats[:max_wait_time] = waited if waited > @stats[:max_wait_time]
+      end
+      hiredis
+    end
+
+    # after an I/O error in with, the error itself is already on its way up
+    def repair(hiredis)
+      if hiredis.closed?
+        @created -= 1
+        return
+      end
+      begin
+        hiredis.reconnect
+      rescue IOError, SystemCallError, Hiredis::Error
+        discard(hiredis)
+        return
+      end
+      @stats[:reconnects] += 1
+      @idle.push([hiredis, Time.now.to_f])
+    end
+
+    def discard(hiredis)
+      begin
+        hiredis.close
+      rescue IOError
+      end
+      @created -= 1
+    end
+
+    def evict_idle
+      deadline = Time.now.to_f - @idle_timeout
+      while (entry = @idle.first) && entry[1] < deadline
+        @idle.shift
+        discard(entry[0])
+        @stats[:evictions] += 1
+      end
+    end
+
+    # without a wait hook nothing could return a connection in the meantime
+    def wait(started)
+      raise TimeoutError, "all #{@size} connections are checked out" unless @wait
+      remaining = @timeout - (Time.now.to_f - started)
+      if remaining <= 0
+        raise TimeoutError, "no connection available after #{@timeout} seconds"
+      end
+      @wait.call(remaining)
+    end
+  end
+end
@@ -0,0 +1,5 @@
+class Hiredis
+  class Reply
+    include Enumerable
+  end
+end
@@ -0,0 +1,118 @@
+class Hiredis
+  # A Lua script known to redis by its SHA1, the source is only sent when the
+  # connection runs it the first time or the server answers NOSCRIPT.
+  class Script
+    attr_reader :connection, :source, :sha
+
+    def self.noscript?(reply)
+      reply.is_a?(ReplyError) && reply.message[0, 8] == "NOSCRIPT"
+    end
+
+    def initialize(connection, source)
+      @connection = connection
+      @source = source.to_s
+      @sha = Script.digest(@source)
+    end
+
+    # EVAL runs the script and loads it in the same round trip
+    def call(keys = [], args = [])
+      reply = @connection.call(:evalsha, @sha, keys.size, keys, args)
+      if Script.noscript?(reply)
+        reply = @connection.call(:eval, @source, keys.size, keys, args)
+      end
+      @connection.script_loaded(self)
+      reply
+    end
+
+    def queue(keys = [], args = [])
+      @connection.queue_script(self, keys, args)
+      self
+    end
+  end
+
+  # the script is loaded again after reconnect
+  def script(source)
+    script = Script.new(self, source)
+    (@scripts ||= {})[script.sha] = script
+    script
+  end
+
+  # registers the scripts and loads them with one round trip
+  def load_scripts(*sources)
+    scripts = sources.map { |source| script(source) }
+    preload_scripts(scripts)
+    scripts
+  end
+
+  def preload_scripts(scripts)
+    raise Error, "#{pending} replies pending" if pending > 0
+    return self if scripts.empty?
+    scripts.each { |script| queue(:script, :load, script.source) }
+    bulk_reply_without_scripts.each_with_index do |reply, i|
+      raise reply if reply.is_a?(ReplyError)
+      script_loaded(scripts[i])
+    end
+    self
+  end
+
+  def script_loaded(script)
+    (@loaded_scripts ||= {})[script.sha] = true
+  end
+
+  def script_loaded?(script)
+    @loaded_scripts && @loaded_scripts[script.sha]
+  end
+
+  def script_flushed(script)
+    @loaded_scripts.delete(script.sha) if @loaded_scripts
+  end
+
+  # the first EVALSHA a connection sends for a script would fail, EVAL goes
+  # out instead, later ones are remembered so bulk_reply can retry them
+  def queue_script(script, keys, args)
+    @queued_scripts = nil if pending == 0
+    if script_loaded?(script)
+      (@queued_scripts ||= []) << [pending, script, keys, args]
+      queue(:evalsha, script.sha, keys.size, keys, args)
+    else
+      script_loaded(script)
+      queue(:eval, script.source, keys.size, keys, args)
+    end
+  end
+
+  alias_method :bulk_reply_without_scripts, :bulk_reply
+
+  def bulk_reply
+    replies = bulk_reply_without_scripts
+    if @queued_scripts
+      queued, @queued_scripts = @queued_scripts, nil
+      retry_scripts(replies, queued)
+    end
+    replies
+  end
+
+  # scripts the server lost, after SCRIPT FLUSH or a restart, run again with
+  # their source in one more round trip, after the rest of the pipeline
+  def retry_scripts(replies, queued)
+    missing = queued.select { |index, *| Script.noscript?(replies[index]) }
+    return replies if missing.empty?
+    missing.each do |index, script, keys, args|
+      queue(:eval, script.source, keys.size, keys, args)
+    end
+    bulk_reply_without_scripts.each_with_index do |reply, i|
+      replies[missing[i][0]] = reply
+    end
+    replies
+  end
+
+  if method_defined?(:reconnect)
+    alias_method :reconnect_without_scripts, :reconnect
+
+    def reconnect
+      connected = reconnect_without_scripts
+      @loaded_scripts = @queued_scripts = nil
+      preload_scripts(@scripts.values) if connected && @scripts
+      connected
+    end
+  end
+end
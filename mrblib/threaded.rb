@@ -0,0 +1,14 @@
+class Hiredis
+  class Threaded
+    def self.new(*args)
+      instance = super(*args)
+      instance.call(:hello, "3")
+      instance
+    end
+
+    def method_missing(name, *args, &block)
+      return super unless Hiredis.command_method?(name, block)
+      call(name, *args)
+    end
+  end
+end
@@ -1,9 +1,14 @@
 #include "mruby/hiredis.h"
 #include "mrb_hiredis.h"
+#include "mrb_hiredis_commands.h"
 
 static void
 mrb_hiredis_check_error(mrb_state *mrb, const redisContext *context)
 {
+  mrb_hiredis_stats *stats = mrb_hiredis_stats_of(context);
+  if (stats) {
+    stats->io_errors++;
+  }
   switch (context->err) {
   case REDIS_ERR_IO:
     mrb_sys_fail(mrb, context->errstr);
@@ -22,26 +27,323 @@ mrb_hiredis_check_error(mrb_state *mrb, const redisContext *context)
   }
 }
 
+MRB_INLINE void
+mrb_hiredis_check_streaming(mrb_state *mrb, const redisContext *context)
+{
+  if (unlikely(((mrb_hiredis_context *) context->privdata)->stream)) {
+    mrb_raise(mrb, E_HIREDIS_ERROR, "connection is busy streaming a reply");
+  }
+}
+
+/* Reply builder: hiredis calls these while it parses, so every reply turns
+ * into mruby values directly instead of going through a redisReply tree.
+ * Aggregates are handed back to hiredis as their RBasic pointer, the root
+ * as the connection's mrb_hiredis_reply, which keeps the value alive in the
+ * GC arena until the caller takes it. */
+static void *
+mrb_hiredis_reader_attach(const redisReadTask *task, mrb_value value, int ai)
+{
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) task->privdata;
+  mrb_state *mrb = mrb_context->mrb;
+
+  if (task->parent) {
+    const redisReadTask *parent = task->parent;
+    mrb_value container = parent->parent ? mrb_obj_value(parent->obj) : mrb_context->root.value;
+    if (mrb_array_p(container) && (parent->type == REDIS_REPLY_MAP || parent->type == REDIS_REPLY_ATTR)) {
+      mrb_ary_push(mrb, container, value);
+    } else if (parent->type == REDIS_REPLY_MAP || parent->type == REDIS_REPLY_ATTR) {
+      if (task->idx % 2 == 0) {
+        mrb_ary_push(mrb, mrb_context->pending_keys, value);
+      } else {
+        mrb_hash_set(mrb, container, mrb_ary_pop(mrb, mrb_context->pending_keys), value);
+      }
+    } else {
+      mrb_ary_push(mrb, container, value);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+    if (mrb_array_p(value) || mrb_hash_p(value)) {
+      return mrb_ptr(value);
+    } else {
+      return mrb_context;
+    }
+  } else {
+    mrb_gc_arena_restore(mrb, ai);
+    mrb_gc_protect(mrb, value);
+    if (RARRAY_LEN(mrb_context->pending_keys) > 0) {
+      mrb_ary_clear(mrb, mrb_context->pending_keys);
+    }
+    mrb_context->root.type = task->type;
+    mrb_context->root.value = value;
+    mrb_context->stats.replies++;
+    return &mrb_context->root;
+  }
+}
+
+static void *
+mrb_hiredis_createString(const redisReadTask *task, char *str, size_t len)
+{
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) task->privdata;
+  mrb_state *mrb = mrb_context->mrb;
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_value value;
+  mrb_bool key = task->parent && task->idx % 2 == 0 &&
+    (task->parent->type == REDIS_REPLY_MAP || task->parent->type == REDIS_REPLY_ATTR);
+
+  switch (task->type) {
+    case REDIS_REPLY_ERROR:
+      value = mrb_exc_new_str(mrb, mrb_context->reply_error_class, mrb_str_new(mrb, str, len));
+      mrb_context->stats.errors++;
+      break;
+    case REDIS_REPLY_VERB: {
+      if (unlikely(len < 4)) {
+        mrb_gc_arena_restore(mrb, ai);
+        return NULL;
+      }
+      mrb_value argv[] = {
+        mrb_str_new(mrb, str + 4, len - 4),
+        mrb_str_new(mrb, str, 3)
+      };
+      value = mrb_obj_new(mrb, mrb_context->verb_class, 2, argv);
+    } break;
+    case REDIS_REPLY_STATUS:
+      value = key ? mrb_hiredis_intern_key(mrb, &mrb_context->intern, str, len) : mrb_hiredis_intern_str(mrb, &mrb_context->intern, str, len);
+      break;
+    default:
+      value = key ? mrb_hiredis_intern_key(mrb, &mrb_context->intern, str, len) : mrb_str_new(mrb, str, len);
+  }
+
+  return mrb_hiredis_reader_attach(task, value, ai);
+}
+
+static void *
+mrb_hiredis_createArray(const redisReadTask *task, size_t elements)
+{
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) task->privdata;
+  mrb_state *mrb = mrb_context->mrb;
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_value value;
+
+  if (!task->parent && mrb_context->stream) {
+    /* call_each collects finished elements here and yields them between reads */
+    value = mrb_ary_new(mrb);
+  } else if (task->type == REDIS_REPLY_MAP || task->type == REDIS_REPLY_ATTR) {
+    value = mrb_hash_new_capa(mrb, elements / 2);
+  } else {
+    value = mrb_ary_new_capa(mrb, elements);
+  }
+
+  return mrb_hiredis_reader_attach(task, value, ai);
+}
+
+static void *
+mrb_hiredis_createInteger(const redisReadTask *task, long long integer)
+{
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) task->privdata;
+  mrb_state *mrb = mrb_context->mrb;
+  int ai = mrb_gc_arena_save(mrb);
+  return mrb_hiredis_reader_attach(task, mrb_int_value(mrb, integer), ai);
+}
+
+static void *
+mrb_hiredis_createDouble(const redisReadTask *task, double dval, char *str, size_t len)
+{
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) task->privdata;
+  mrb_state *mrb = mrb_context->mrb;
+  int ai = mrb_gc_arena_save(mrb);
+  return mrb_hiredis_reader_attach(task, mrb_float_value(mrb, dval), ai);
+}
+
+static void *
+mrb_hiredis_createNil(const redisReadTask *task)
+{
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) task->privdata;
+  return mrb_hiredis_reader_attach(task, mrb_nil_value(), mrb_gc_arena_save(mrb_context->mrb));
+}
+
+static void *
+mrb_hiredis_createBool(const redisReadTask *task, int bval)
+{
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) task->privdata;
+  return mrb_hiredis_reader_attach(task, mrb_bool_value(bval), mrb_gc_arena_save(mrb_context->mrb));
+}
+
+static void
+mrb_hiredis_freeObject(void *reply)
+{
+  ((mrb_hiredis_reply *) reply)->value = mrb_nil_value();
+}
+
+static redisReplyObjectFunctions mrb_hiredis_reply_functions = {
+  .createString  = mrb_hiredis_createString,
+  .createArray   = mrb_hiredis_createArray,
+  .createInteger = mrb_hiredis_createInteger,
+  .createDouble  = mrb_hiredis_createDouble,
+  .createNil     = mrb_hiredis_createNil,
+  .createBool    = mrb_hiredis_createBool,
+  .freeObject    = mrb_hiredis_freeObject
+};
+
+MRB_INLINE mrb_value
+mrb_hiredis_take_reply(void *reply)
+{
+  mrb_value reply_val = ((mrb_hiredis_reply *) reply)->value;
+  mrb_hiredis_freeObject(reply);
+  return reply_val;
+}
+
+static mrb_value
+mrb_hiredis_get_reply(redisReply *reply, mrb_state *mrb, mrb_hiredis_intern *intern);
+
+/* RESP3 pushes which arrive while a command reads its reply. Cache
+ * invalidations are applied right away, pub/sub messages of a subscribed
+ * connection wait in pushes until dispatch hands them to their handlers. */
+static void
+mrb_hiredis_push_cb(void *privdata, void *reply)
+{
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) privdata;
+  mrb_state *mrb = mrb_context->mrb;
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_value push;
+  if (mrb_context->context->reader->fn == &mrb_hiredis_reply_functions) {
+    push = mrb_hiredis_take_reply(reply);
+  } else {
+    /* call_lazy swapped in the default reader */
+    push = mrb_hiredis_get_reply((redisReply *) reply, mrb, &mrb_context->intern);
+    mrb_context->context->reader->fn->freeObject(reply);
+  }
+  if (!mrb_hiredis_cache_push(mrb, &mrb_context->cache, push) &&
+    mrb_hiredis_pubsub_active(mrb, mrb_context->subscriptions)) {
+    mrb_ary_push(mrb, mrb_context->pushes, push);
+  }
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+/* Applies invalidations which already reached the reader or the socket. One
+ * still in flight isn't seen, so a hit can be stale by the network latency,
+ * plus sync_interval as the socket is only polled once per interval. Only
+ * called without pending replies, anything buffered has to be a push. */
+static void
+mrb_hiredis_cache_sync(mrb_state *mrb, redisContext *context)
+{
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+  mrb_hiredis_cache *cache = &mrb_context->cache;
+  uint64_t now = mrb_hiredis_now();
+  mrb_bool due = now - cache->synced >= cache->sync_interval;
+  if (due) {
+    cache->synced = now;
+  }
+  struct pollfd pfd;
+  pfd.fd = context->fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  do {
+    void *reply = NULL;
+    do {
+      if (unlikely(redisGetReplyFromReader(context, &reply) != REDIS_OK)) {
+        mrb_hiredis_check_error(mrb, context);
+      }
+      if (reply) {
+        int type = context->reader->fn == &mrb_hiredis_reply_functions ? mrb_context->root.type : ((redisReply *) reply)->type;
+        if (unlikely(type != REDIS_REPLY_PUSH)) {
+          context->reader->fn->freeObject(reply);
+          context->err = REDIS_ERR_PROTOCOL;
+          strcpy(context->errstr, "reply without a pending command");
+          mrb_hiredis_check_error(mrb, context);
+        }
+        mrb_hiredis_push_cb(mrb_context, reply);
+      }
+    } while (reply);
+
+    if (!due || poll(&pfd, 1, 0) != 1) {
+      break;
+    }
+    errno = 0;
+    if (unlikely(redisBufferRead(context) != REDIS_OK)) {
+      mrb_hiredis_check_error(mrb, context);
+    }
+  } while (TRUE);
+}
+
+MRB_INLINE void
+mrb_hiredis_setup_reader(redisContext *context)
+{
+  if (unlikely(!context->reader)) {
+    return;
+  }
+  ((mrb_hiredis_context *) context->privdata)->default_functions = context->reader->fn;
+  context->reader->fn = &mrb_hiredis_reply_functions;
+  context->reader->privdata = context->privdata;
+}
+
+MRB_INLINE mrb_value
+mrb_hiredis_setup_context(mrb_state *mrb, mrb_value self, redisContext *context, const mrb_hiredis_socket_options *sockopts, mrb_bool symbol_keys)
+{
+  mrb_value pending_keys = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "pending_keys"), pending_keys);
+
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) mrb_malloc(mrb, sizeof(mrb_hiredis_context));
+  mrb_context->root.type = REDIS_REPLY_NIL;
+  mrb_context->root.value = mrb_nil_value();
+  mrb_context->mrb = mrb;
+  mrb_context->pending_keys = pending_keys;
+  mrb_context->reply_error_class = E_HIREDIS_REPLY_ERROR;
+  mrb_context->verb_class = mrb_class_get_under(mrb, mrb_class_get(mrb, "Hiredis"), "Verb");
+  mrb_context->argv.argv = NULL;
+  mrb_context->argv.argvlen = NULL;
+  mrb_context->argv.numbuf = NULL;
+  mrb_context->argv.capa = 0;
+  mrb_context->pending = 0;
+  mrb_context->context = context;
+  mrb_context->default_functions = NULL;
+  mrb_context->stream = FALSE;
+  memset(&mrb_context->iov, 0, sizeof(mrb_hiredis_iov));
+  mrb_hiredis_pubsub_init(mrb, self, mrb_context->subscriptions);
+  mrb_context->pushes = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "pushes"), mrb_context->pushes);
+  mrb_hiredis_cache_init(&mrb_context->cache);
+  mrb_context->sockopts = *sockopts;
+  mrb_hiredis_stats_init(&mrb_context->stats);
+  mrb_hiredis_stats_install(&mrb_context->stats, context);
+  mrb_hiredis_intern_init(mrb, self, &mrb_context->intern, symbol_keys);
+
+  context->privdata = mrb_context;
+  context->free_privdata = mrb_hiredis_context_free;
+  mrb_hiredis_setup_reader(context);
+  redisSetPushCallback(context, mrb_hiredis_push_cb);
+  mrb_hiredis_apply_socket_options(mrb, context, sockopts);
+
+  return self;
+}
+
 static mrb_value
 mrb_redisConnect(mrb_state *mrb, mrb_value self)
 {
   char *host_or_path = (char *) "localhost";
   mrb_int port = 6379;
+  mrb_value options = mrb_nil_value();
 
-  mrb_get_args(mrb, "|zi", &host_or_path, &port);
+  mrb_get_args(mrb, "|ziH", &host_or_path, &port, &options);
   mrb_assert(port >= INT_MIN && port <= INT_MAX);
 
-  redisContext *context = NULL;
-  errno = 0;
+  redisOptions opts = {0};
+  struct timeval connect_timeout, command_timeout;
+  mrb_hiredis_socket_options sockopts;
   if (port == -1) {
-    context = redisConnectUnix(host_or_path);
+    REDIS_OPTIONS_SET_UNIX(&opts, host_or_path);
   } else {
-    context = redisConnect(host_or_path, port);
+    REDIS_OPTIONS_SET_TCP(&opts, host_or_path, (int) port);
   }
+  mrb_hiredis_parse_options(mrb, options, &opts, &connect_timeout, &command_timeout, &sockopts);
+
+  redisContext *context = NULL;
+  errno = 0;
+  context = redisConnectWithOptions(&opts);
   if (likely(context != NULL)) {
     mrb_data_init(self, context, &mrb_redisContext_type);
     if (likely(context->err == 0)) {
-      return self;
+      mrb_hiredis_finish_connect(mrb, context);
+      return mrb_hiredis_setup_context(mrb, self, context, &sockopts, mrb_hiredis_option_symbol_keys(mrb, options));
     } else {
       mrb_hiredis_check_error(mrb, context);
       return mrb_false_value();
@@ -57,6 +359,7 @@ mrb_redisFree(mrb_state *mrb, mrb_value self)
 {
   redisContext *context = (redisContext *) DATA_PTR(self);
   if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
     redisFree(context);
     mrb_data_init(self, NULL, NULL);
     return mrb_nil_value();
@@ -67,29 +370,31 @@ mrb_redisFree(mrb_state *mrb, mrb_value self)
 }
 
 MRB_INLINE mrb_value
-mrb_hiredis_get_ary_reply(redisReply *reply, mrb_state *mrb);
+mrb_hiredis_get_ary_reply(redisReply *reply, mrb_state *mrb, mrb_hiredis_intern *intern);
 
 MRB_INLINE mrb_value
-mrb_hiredis_get_map_reply(redisReply *reply, mrb_state *mrb);
+mrb_hiredis_get_map_reply(redisReply *reply, mrb_state *mrb, mrb_hiredis_intern *intern);
 
 static mrb_value
-mrb_hiredis_get_reply(redisReply *reply, mrb_state *mrb)
+mrb_hiredis_get_reply(redisReply *reply, mrb_state *mrb, mrb_hiredis_intern *intern)
 {
   if (likely(reply)) {
     switch (reply->type) {
       case REDIS_REPLY_STRING:
-      case REDIS_REPLY_STATUS:
       case REDIS_REPLY_BIGNUM:
         return mrb_str_new(mrb, reply->str, reply->len);
         break;
+      case REDIS_REPLY_STATUS:
+        return mrb_hiredis_intern_str(mrb, intern, reply->str, reply->len);
+        break;
       case REDIS_REPLY_ARRAY:
       case REDIS_REPLY_SET:
       case REDIS_REPLY_PUSH:
-        return mrb_hiredis_get_ary_reply(reply, mrb);
+        return mrb_hiredis_get_ary_reply(reply, mrb, intern);
         break;
       case REDIS_REPLY_MAP:
       case REDIS_REPLY_ATTR:
-        return mrb_hiredis_get_map_reply(reply, mrb);
+        return mrb_hiredis_get_map_reply(reply, mrb, intern);
         break;
       case REDIS_REPLY_INTEGER:
         return mrb_int_value(mrb, reply->integer);
@@ -122,72 +427,116 @@ mrb_hiredis_get_reply(redisReply *reply, mrb_state *mrb)
 }
 
 MRB_INLINE mrb_value
-mrb_hiredis_get_ary_reply(redisReply *reply, mrb_state *mrb)
+mrb_hiredis_get_ary_reply(redisReply *reply, mrb_state *mrb, mrb_hiredis_intern *intern)
 {
   mrb_value ary = mrb_ary_new_capa(mrb, reply->elements);
   int ai = mrb_gc_arena_save(mrb);
 
   size_t element_couter;
   for (element_couter = 0; element_couter < reply->elements; element_couter++) {
-    mrb_ary_push(mrb, ary, mrb_hiredis_get_reply(reply->element[element_couter], mrb));
+    mrb_ary_push(mrb, ary, mrb_hiredis_get_reply(reply->element[element_couter], mrb, intern));
     mrb_gc_arena_restore(mrb, ai);
   }
   return ary;
 }
 
 MRB_INLINE mrb_value
-mrb_hiredis_get_map_reply(redisReply *reply, mrb_state *mrb)
+mrb_hiredis_get_map_reply(redisReply *reply, mrb_state *mrb, mrb_hiredis_intern *intern)
 {
   mrb_value map = mrb_hash_new_capa(mrb, reply->elements / 2);
   int ai = mrb_gc_arena_save(mrb);
 
   size_t element_couter;
   for (element_couter = 0; element_couter < reply->elements; element_couter++) {
-    mrb_value key = mrb_hiredis_get_reply(reply->element[element_couter], mrb);
+    redisReply *element = reply->element[element_couter];
+    mrb_value key;
+    if (element && (element->type == REDIS_REPLY_STRING || element->type == REDIS_REPLY_STATUS)) {
+      key = mrb_hiredis_intern_key(mrb, intern, element->str, element->len);
+    } else {
+      key = mrb_hiredis_get_reply(element, mrb, intern);
+    }
     element_couter++;
-    mrb_value value = mrb_hiredis_get_reply(reply->element[element_couter], mrb);
+    mrb_value value = mrb_hiredis_get_reply(reply->element[element_couter], mrb, intern);
     mrb_hash_set(mrb, map, key, value);
     mrb_gc_arena_restore(mrb, ai);
   }
   return map;
 }
 
-MRB_INLINE mrb_value
-mrb_redisCommandArgv_cb(mrb_state *mrb, mrb_value reply)
+MRB_INLINE mrb_bool
+mrb_hiredis_writev_wanted(const redisContext *context, mrb_int argc, const mrb_hiredis_argv *argv)
 {
-  return mrb_hiredis_get_reply(mrb_cptr(reply), mrb);
+  return (context->flags & REDIS_BLOCK) && mrb_hiredis_iov_wanted(argc, argv->argvlen);
 }
 
-MRB_INLINE mrb_value
-mrb_redisCommandArgv_ensure(mrb_state *mrb, mrb_value reply)
+/* Writes what is queued and the command right away, large arguments straight
+ * from their Strings, so nothing has to be kept alive afterwards. */
+static void
+mrb_hiredis_writev_command(mrb_state *mrb, redisContext *context, mrb_hiredis_context *mrb_context, mrb_int argc, const mrb_hiredis_argv *argv)
 {
-  freeReplyObject(mrb_cptr(reply));
-  return mrb_nil_value();
+  mrb_hiredis_iov *iov = &mrb_context->iov;
+  mrb_hiredis_iov_reset(iov);
+  sds buf = mrb_hiredis_iov_prepare(mrb, iov, mrb_nil_value(), 0, argc, argv->argv, argv->argvlen);
+  mrb_hiredis_iov_push(iov, context->obuf, sdslen(context->obuf));
+  mrb_hiredis_iov_encode(iov, buf, mrb_nil_value(), 0, argc, argv->argv, argv->argvlen);
+  errno = 0;
+  mrb_hiredis_iov_write(iov, context->fd, &mrb_context->stats);
+  mrb_bool written = !mrb_hiredis_iov_pending(iov);
+  mrb_hiredis_iov_reset(iov);
+  if (unlikely(!written)) {
+    /* the socket blocks, this is a timeout or a lost connection and part of the command may be out */
+    context->err = REDIS_ERR_IO;
+    snprintf(context->errstr, sizeof(context->errstr), "%s", strerror(errno));
+    mrb_hiredis_check_error(mrb, context);
+  }
+  sdsclear(context->obuf);
 }
 
 static mrb_value
-mrb_redisCommandArgv(mrb_state *mrb, mrb_value self)
+mrb_hiredis_call(mrb_state *mrb, mrb_value self, mrb_sym command, const mrb_value *mrb_argv, mrb_int argc)
 {
   redisContext *context = (redisContext *) DATA_PTR(self);
   if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
     if (likely(context->err == 0)) {
-      mrb_sym command;
-      mrb_value *mrb_argv = NULL;
-      mrb_int argc = 0;
-
-      mrb_get_args(mrb, "n*", &command, &mrb_argv, &argc);
-
-      const char **argv = NULL;
-      size_t *argvlen = NULL;
-      mrb_hiredis_generate_argv_argc_array(mrb, command, mrb_argv, &argc, &argv, &argvlen);
+      mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+      mrb_hiredis_argv *argv = &mrb_context->argv;
+      argc = mrb_hiredis_generate_argv(mrb, argv, command, mrb_argv, argc);
+
+      mrb_value cache_key = mrb_nil_value();
+      int keys = -1;
+      if (mrb_context->cache.enabled && mrb_context->pending == 0 && argc > 1 &&
+        (keys = mrb_hiredis_cacheable(argv->argv[0], argv->argvlen[0])) != -1) {
+        mrb_hiredis_cache_sync(mrb, context);
+        cache_key = mrb_hiredis_cache_key(mrb, argv, argc);
+        mrb_value cached;
+        if (mrb_hiredis_cache_fetch(mrb, &mrb_context->cache, cache_key, &cached)) {
+          mrb_context->cache.hits++;
+          return cached;
+        }
+        mrb_context->cache.misses++;
+      }
 
+      mrb_hiredis_stats *stats = &mrb_context->stats;
+      mrb_int histogram = mrb_hiredis_stats_histogram(mrb, stats, argv->argv[0], argv->argvlen[0]);
+      stats->commands++;
+      uint64_t start = mrb_hiredis_now();
       errno = 0;
-      redisReply *reply = redisCommandArgv(context, argc, argv, argvlen);
-      mrb_free(mrb, argv);
-      mrb_free(mrb, argvlen);
+      void *reply = NULL;
+      if (unlikely(mrb_hiredis_writev_wanted(context, argc, argv))) {
+        mrb_hiredis_writev_command(mrb, context, mrb_context, argc, argv);
+        redisGetReply(context, &reply);
+      } else {
+        reply = redisCommandArgv(context, argc, argv->argv, argv->argvlen);
+      }
       if (likely(reply != NULL)) {
-        mrb_value reply_cptr_value = mrb_cptr_value(mrb, reply);
-        return mrb_ensure(mrb, mrb_redisCommandArgv_cb, reply_cptr_value, mrb_redisCommandArgv_ensure, reply_cptr_value);
+        mrb_hiredis_histogram_record(stats->histograms[histogram], mrb_hiredis_now() - start);
+        mrb_value reply_val = mrb_hiredis_take_reply(reply);
+        if (!mrb_nil_p(cache_key) && mrb_context->cache.enabled &&
+          !mrb_obj_is_kind_of(mrb, reply_val, mrb_context->reply_error_class)) {
+          mrb_hiredis_cache_store(mrb, &mrb_context->cache, cache_key, keys, argv, argc, reply_val);
+        }
+        return reply_val;
       } else {
         mrb_hiredis_check_error(mrb, context);
         return mrb_false_value();
@@ -202,11 +551,67 @@ mrb_redisCommandArgv(mrb_state *mrb, mrb_value self)
   }
 }
 
+static mrb_value
+mrb_redisCommandArgv(mrb_state *mrb, mrb_value self)
+{
+  mrb_sym command;
+  mrb_value *mrb_argv = NULL;
+  mrb_int argc = 0;
+
+  mrb_get_args(mrb, "n*", &command, &mrb_argv, &argc);
+
+  return mrb_hiredis_call(mrb, self, command, mrb_argv, argc);
+}
+
+/* Methods of the command table in mrb_hiredis_commands.h, the name they were
+ * called by is the command. */
+static mrb_value
+mrb_hiredis_command_method(mrb_state *mrb, mrb_value self)
+{
+  mrb_value *mrb_argv = NULL;
+  mrb_int argc = 0;
+
+  mrb_get_args(mrb, "*", &mrb_argv, &argc);
+
+  return mrb_hiredis_call(mrb, self, mrb_get_mid(mrb), mrb_argv, argc);
+}
+
+static mrb_value
+mrb_hiredis_forward_command(mrb_state *mrb, mrb_value self, const char *method)
+{
+  mrb_value *mrb_argv = NULL;
+  mrb_int argc = 0;
+
+  mrb_get_args(mrb, "*", &mrb_argv, &argc);
+
+  mrb_value args = mrb_ary_new_capa(mrb, argc + 1);
+  mrb_ary_push(mrb, args, mrb_symbol_value(mrb_get_mid(mrb)));
+  mrb_int i;
+  for (i = 0; i < argc; i++) {
+    mrb_ary_push(mrb, args, mrb_argv[i]);
+  }
+
+  return mrb_funcall_argv(mrb, self, mrb_intern_cstr(mrb, method), RARRAY_LEN(args), RARRAY_PTR(args));
+}
+
+static mrb_value
+mrb_hiredis_forward_call(mrb_state *mrb, mrb_value self)
+{
+  return mrb_hiredis_forward_command(mrb, self, "call");
+}
+
+static mrb_value
+mrb_hiredis_forward_queue(mrb_state *mrb, mrb_value self)
+{
+  return mrb_hiredis_forward_command(mrb, self, "queue");
+}
+
 static mrb_value
 mrb_redisAppendCommandArgv(mrb_state *mrb, mrb_value self)
 {
   redisContext *context = (redisContext *) DATA_PTR(self);
   if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
     if (likely(context->err == 0)) {
       mrb_sym command;
       mrb_value *mrb_argv = NULL;
@@ -214,27 +619,31 @@ mrb_redisAppendCommandArgv(mrb_state *mrb, mrb_value self)
 
       mrb_get_args(mrb, "n*", &command, &mrb_argv, &argc);
 
-      mrb_sym queue_counter_sym = mrb_intern_lit(mrb, "queue_counter");
-
-      mrb_value queue_counter_val = mrb_iv_get(mrb, self, queue_counter_sym);
-      mrb_int queue_counter = 1;
-      if (mrb_integer_p(queue_counter_val)) {
-        queue_counter = mrb_integer(queue_counter_val);
-        if (unlikely(mrb_int_add_overflow(queue_counter, 1, &queue_counter))) {
-          mrb_raise(mrb, E_RUNTIME_ERROR, "integer addition would overflow");
-        }
+      mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+      mrb_int pending;
+      if (unlikely(mrb_int_add_overflow(mrb_context->pending, 1, &pending))) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "integer addition would overflow");
       }
 
-      const char **argv = NULL;
-      size_t *argvlen = NULL;
-      mrb_hiredis_generate_argv_argc_array(mrb, command, mrb_argv, &argc, &argv, &argvlen);
+      mrb_hiredis_argv *argv = &mrb_context->argv;
+      argc = mrb_hiredis_generate_argv(mrb, argv, command, mrb_argv, argc);
 
       errno = 0;
-      int rc = redisAppendCommandArgv(context, argc, argv, argvlen);
-      mrb_free(mrb, argv);
-      mrb_free(mrb, argvlen);
+      int rc = REDIS_OK;
+      /* a large command goes out right away instead of being copied into the output buffer */
+      if (unlikely(mrb_hiredis_writev_wanted(context, argc, argv))) {
+        mrb_hiredis_writev_command(mrb, context, mrb_context, argc, argv);
+      } else {
+        rc = redisAppendCommandArgv(context, argc, argv->argv, argv->argvlen);
+      }
       if (likely(rc == REDIS_OK)) {
-        mrb_iv_set(mrb, self, queue_counter_sym, mrb_int_value(mrb, queue_counter));
+        mrb_hiredis_stats *stats = &mrb_context->stats;
+        mrb_hiredis_stats_push(mrb, stats, mrb_hiredis_stats_histogram(mrb, stats, argv->argv[0], argv->argvlen[0]), mrb_hiredis_now());
+        stats->commands++;
+        mrb_context->pending = pending;
+        if (pending > stats->max_pending) {
+          stats->max_pending = pending;
+        }
         return self;
       } else {
         mrb_hiredis_check_error(mrb, context);
@@ -250,52 +659,80 @@ mrb_redisAppendCommandArgv(mrb_state *mrb, mrb_value self)
   }
 }
 
-MRB_INLINE mrb_value
-mrb_redisGetReply_cb(mrb_state *mrb, mrb_value self_reply)
+static mrb_value
+mrb_hiredis_call_formatted(mrb_state *mrb, mrb_value self)
 {
-  mrb_redisGetReply_cb_data *cb_data = (mrb_redisGetReply_cb_data *)mrb_cptr(self_reply);
-  mrb_value self = cb_data->self;
-  mrb_sym queue_counter_sym = mrb_intern_lit(mrb, "queue_counter");
-  mrb_value queue_counter_val = mrb_iv_get(mrb, self, queue_counter_sym);
-  mrb_int queue_counter = -1;
-  if (mrb_integer_p(queue_counter_val)) {
-    queue_counter = mrb_integer(queue_counter_val);
-  }
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
+    if (likely(context->err == 0)) {
+      mrb_value command;
+      mrb_value *values = NULL;
+      mrb_int valuesc = 0;
+
+      mrb_get_args(mrb, "o*", &command, &values, &valuesc);
+
+      size_t len, name_len;
+      const char *name;
+      const char *resp = mrb_hiredis_formatted(mrb, command, values, valuesc, &len, &name, &name_len);
 
-  mrb_value reply_val = mrb_hiredis_get_reply(cb_data->reply, mrb);
-  if (queue_counter > 1) {
-    mrb_iv_set(mrb, self, queue_counter_sym, mrb_int_value(mrb, --queue_counter));
+      mrb_hiredis_stats *stats = &((mrb_hiredis_context *) context->privdata)->stats;
+      mrb_int histogram = mrb_hiredis_stats_histogram(mrb, stats, name, name_len);
+      stats->commands++;
+      uint64_t start = mrb_hiredis_now();
+      errno = 0;
+      void *reply = NULL;
+      if (likely(redisAppendFormattedCommand(context, resp, len) == REDIS_OK &&
+        redisGetReply(context, &reply) == REDIS_OK)) {
+        mrb_hiredis_histogram_record(stats->histograms[histogram], mrb_hiredis_now() - start);
+        return reply ? mrb_hiredis_take_reply(reply) : mrb_nil_value();
+      } else {
+        mrb_hiredis_check_error(mrb, context);
+        return mrb_false_value();
+      }
+    } else {
+      mrb_hiredis_check_error(mrb, context);
+      return mrb_false_value();
+    }
   } else {
-    mrb_iv_remove(mrb, self, queue_counter_sym);
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
   }
-  return reply_val;
-}
-
-MRB_INLINE mrb_value
-mrb_redisGetReply_ensure(mrb_state *mrb, mrb_value self_reply)
-{
-  mrb_redisGetReply_cb_data *cb_data = (mrb_redisGetReply_cb_data *)mrb_cptr(self_reply);
-  freeReplyObject(cb_data->reply);
-  return mrb_nil_value();
 }
 
 static mrb_value
-mrb_redisGetReply(mrb_state *mrb, mrb_value self)
+mrb_hiredis_queue_formatted(mrb_state *mrb, mrb_value self)
 {
   redisContext *context = (redisContext *) DATA_PTR(self);
   if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
     if (likely(context->err == 0)) {
-      redisReply *reply = NULL;
+      mrb_value command;
+      mrb_value *values = NULL;
+      mrb_int valuesc = 0;
+
+      mrb_get_args(mrb, "o*", &command, &values, &valuesc);
+
+      mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+      mrb_int pending;
+      if (unlikely(mrb_int_add_overflow(mrb_context->pending, 1, &pending))) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "integer addition would overflow");
+      }
+
+      size_t len, name_len;
+      const char *name;
+      const char *resp = mrb_hiredis_formatted(mrb, command, values, valuesc, &len, &name, &name_len);
+
       errno = 0;
-      int rc = redisGetReply(context, (void **) &reply);
-      if (likely(rc == REDIS_OK)) {
-        if (likely(reply != NULL)) {
-          mrb_redisGetReply_cb_data cb_data = { self, reply };
-          mrb_value cb_data_val = mrb_cptr_value(mrb, &cb_data);
-          return mrb_ensure(mrb, mrb_redisGetReply_cb, cb_data_val, mrb_redisGetReply_ensure, cb_data_val);
-        } else {
-          return mrb_nil_value();
+      if (likely(redisAppendFormattedCommand(context, resp, len) == REDIS_OK)) {
+        mrb_hiredis_stats *stats = &mrb_context->stats;
+        mrb_hiredis_stats_push(mrb, stats, mrb_hiredis_stats_histogram(mrb, stats, name, name_len), mrb_hiredis_now());
+        stats->commands++;
+        mrb_context->pending = pending;
+        if (pending > stats->max_pending) {
+          stats->max_pending = pending;
         }
+        return self;
       } else {
         mrb_hiredis_check_error(mrb, context);
         return mrb_false_value();
@@ -310,38 +747,71 @@ mrb_redisGetReply(mrb_state *mrb, mrb_value self)
   }
 }
 
-static mrb_value
-mrb_redisGetBulkReply(mrb_state *mrb, mrb_value self)
+MRB_INLINE mrb_value
+mrb_hiredis_read_reply(mrb_state *mrb, redisContext *context)
 {
-  mrb_value queue_counter_val = mrb_iv_get(mrb, self, mrb_intern_lit(mrb, "queue_counter"));
-
-  if (likely(mrb_integer_p(queue_counter_val))) {
-    mrb_int queue_counter = mrb_integer(queue_counter_val);
-
-    mrb_value bulk_reply = mrb_ary_new_capa(mrb, queue_counter);
-    int ai = mrb_gc_arena_save(mrb);
-
-    do {
-      mrb_ary_push(mrb, bulk_reply, mrb_redisGetReply(mrb, self));
-      mrb_gc_arena_restore(mrb, ai);
-    } while (--queue_counter > 0);
+  void *reply = NULL;
+  errno = 0;
+  int rc = redisGetReply(context, &reply);
+  if (likely(rc == REDIS_OK)) {
+    mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+    if (mrb_context->pending > 0) {
+      mrb_context->pending--;
+      mrb_hiredis_stats_pop(&mrb_context->stats, mrb_hiredis_now());
+    }
+    if (likely(reply != NULL)) {
+      return mrb_hiredis_take_reply(reply);
+    } else {
+      return mrb_nil_value();
+    }
+  } else {
+    mrb_hiredis_check_error(mrb, context);
+    return mrb_false_value();
+  }
+}
 
-    return bulk_reply;
+static mrb_value
+mrb_redisGetReply(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
+    if (likely(context->err == 0)) {
+      return mrb_hiredis_read_reply(mrb, context);
+    } else {
+      mrb_hiredis_check_error(mrb, context);
+      return mrb_false_value();
+    }
   } else {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "nothing queued yet");
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
     return mrb_false_value();
   }
 }
 
-#if ((HIREDIS_MAJOR == 0) && (HIREDIS_MINOR >= 13) || (HIREDIS_MAJOR > 0))
 static mrb_value
-mrb_redisReconnect(mrb_state *mrb, mrb_value self)
+mrb_redisGetBulkReply(mrb_state *mrb, mrb_value self)
 {
   redisContext *context = (redisContext *) DATA_PTR(self);
   if (likely(context)) {
-    int rc = redisReconnect(context);
-    if (likely(rc == REDIS_OK)) {
-      return self;
+    mrb_hiredis_check_streaming(mrb, context);
+    if (likely(context->err == 0)) {
+      mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+      mrb_int pending = mrb_context->pending;
+      if (likely(pending > 0)) {
+        mrb_value bulk_reply = mrb_ary_new_capa(mrb, pending);
+        int ai = mrb_gc_arena_save(mrb);
+
+        mrb_int i;
+        for (i = 0; i < pending; i++) {
+          mrb_ary_push(mrb, bulk_reply, mrb_hiredis_read_reply(mrb, context));
+          mrb_gc_arena_restore(mrb, ai);
+        }
+
+        return bulk_reply;
+      } else {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "nothing queued yet");
+        return mrb_false_value();
+      }
     } else {
       mrb_hiredis_check_error(mrb, context);
       return mrb_false_value();
@@ -351,371 +821,2703 @@ mrb_redisReconnect(mrb_state *mrb, mrb_value self)
     return mrb_false_value();
   }
 }
-#endif
 
-MRB_INLINE void
-mrb_hiredis_dataCleanup(void *privdata)
+static void
+mrb_hiredis_lazy_reply_release(mrb_hiredis_lazy_reply *lazy_reply)
 {
-  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
-  mrb_data_init(mrb_async_context->self, NULL, NULL);
-  mrb_free(mrb_async_context->mrb, privdata);
+  if (lazy_reply->reply) {
+    freeReplyObject(lazy_reply->reply);
+    lazy_reply->reply = NULL;
+  }
 }
 
-MRB_INLINE void
-mrb_hiredis_addRead(void *privdata)
+static mrb_value
+mrb_redisCommandArgvLazy(mrb_state *mrb, mrb_value self)
 {
-  mrb_assert(privdata);
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
+    if (likely(context->err == 0)) {
+      mrb_sym command;
+      mrb_value *mrb_argv = NULL;
+      mrb_int argc = 0;
 
-  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
-  mrb_state *mrb = mrb_async_context->mrb;
-  mrb_assert(mrb);
-  int ai = mrb_gc_arena_save(mrb);
+      mrb_get_args(mrb, "n*", &command, &mrb_argv, &argc);
+
+      mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+      argc = mrb_hiredis_generate_argv(mrb, &mrb_context->argv, command, mrb_argv, argc);
+
+      struct RData *data = mrb_data_object_alloc(mrb, mrb_class_get_under(mrb, mrb_class_get(mrb, "Hiredis"), "Reply"), NULL, &mrb_hiredis_lazy_reply_type);
+      mrb_hiredis_lazy_reply *lazy_reply = (mrb_hiredis_lazy_reply *) mrb_malloc(mrb, sizeof(mrb_hiredis_lazy_reply));
+      lazy_reply->reply = NULL;
+      lazy_reply->size = 0;
+      data->data = lazy_reply;
+
+      mrb_hiredis_stats *stats = &mrb_context->stats;
+      mrb_int histogram = mrb_hiredis_stats_histogram(mrb, stats, mrb_context->argv.argv[0], mrb_context->argv.argvlen[0]);
+      stats->commands++;
+      uint64_t start = mrb_hiredis_now();
+
+      /* hiredis' own functions keep the reply as a redisReply tree */
+      context->reader->fn = mrb_context->default_functions;
+      errno = 0;
+      lazy_reply->reply = (redisReply *) redisCommandArgv(context, argc, mrb_context->argv.argv, mrb_context->argv.argvlen);
+      if (likely(context->reader)) {
+        context->reader->fn = &mrb_hiredis_reply_functions;
+      }
+
+      if (likely(lazy_reply->reply != NULL)) {
+        uint64_t now = mrb_hiredis_now();
+        mrb_hiredis_histogram_record(stats->histograms[histogram], now - start);
+        stats->replies++;
+        if (lazy_reply->reply->type == REDIS_REPLY_ERROR) {
+          stats->errors++;
+        }
+        switch (lazy_reply->reply->type) {
+          case REDIS_REPLY_ARRAY:
+          case REDIS_REPLY_SET:
+          case REDIS_REPLY_PUSH:
+            lazy_reply->size = lazy_reply->reply->elements;
+            return mrb_obj_value(data);
+            break;
+          case REDIS_REPLY_MAP:
+          case REDIS_REPLY_ATTR:
+            lazy_reply->size = lazy_reply->reply->elements / 2;
+            return mrb_obj_value(data);
+            break;
+          default: {
+            mrb_value reply_val = mrb_hiredis_get_reply(lazy_reply->reply, mrb, &mrb_context->intern);
+            stats->convert_ns += mrb_hiredis_now() - now;
+            mrb_hiredis_lazy_reply_release(lazy_reply);
+            return reply_val;
+          }
+        }
+      } else {
+        mrb_hiredis_check_error(mrb, context);
+        return mrb_false_value();
+      }
+    } else {
+      mrb_hiredis_check_error(mrb, context);
+      return mrb_false_value();
+    }
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+MRB_INLINE mrb_hiredis_lazy_reply *
+mrb_hiredis_lazy_reply_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_lazy_reply *lazy_reply = (mrb_hiredis_lazy_reply *) mrb_data_get_ptr(mrb, self, &mrb_hiredis_lazy_reply_type);
+  if (likely(lazy_reply && lazy_reply->reply)) {
+    return lazy_reply;
+  } else {
+    mrb_raise(mrb, E_HIREDIS_ERROR, "reply already consumed");
+    return NULL;
+  }
+}
+
+/* Reply objects can outlive their connection, so their elements don't go
+ * through its intern cache */
+MRB_INLINE mrb_value
+mrb_hiredis_lazy_reply_element(mrb_state *mrb, redisReply *reply, mrb_int index)
+{
+  if (reply->type == REDIS_REPLY_MAP || reply->type == REDIS_REPLY_ATTR) {
+    mrb_value pair[] = {
+      mrb_hiredis_get_reply(reply->element[index * 2], mrb, NULL),
+      mrb_hiredis_get_reply(reply->element[index * 2 + 1], mrb, NULL)
+    };
+    return mrb_ary_new_from_values(mrb, 2, pair);
+  } else {
+    return mrb_hiredis_get_reply(reply->element[index], mrb, NULL);
+  }
+}
+
+static mrb_value
+mrb_hiredis_lazy_reply_size(mrb_state *mrb, mrb_value self)
+{
+  return mrb_int_value(mrb, mrb_hiredis_lazy_reply_get(mrb, self)->size);
+}
+
+static mrb_value
+mrb_hiredis_lazy_reply_aref(mrb_state *mrb, mrb_value self)
+{
+  mrb_int index;
+  mrb_get_args(mrb, "i", &index);
+
+  mrb_hiredis_lazy_reply *lazy_reply = mrb_hiredis_lazy_reply_get(mrb, self);
+  if (index < 0) {
+    index += lazy_reply->size;
+  }
+  if (index >= 0 && index < lazy_reply->size) {
+    return mrb_hiredis_lazy_reply_element(mrb, lazy_reply->reply, index);
+  } else {
+    return mrb_nil_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_lazy_reply_each(mrb_state *mrb, mrb_value self)
+{
+  mrb_value block = mrb_nil_value();
+  mrb_get_args(mrb, "&", &block);
+  if (unlikely(mrb_type(block) != MRB_TT_PROC)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+  }
+
+  mrb_hiredis_lazy_reply *lazy_reply = mrb_hiredis_lazy_reply_get(mrb, self);
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb_int i;
+  for (i = 0; i < lazy_reply->size; i++) {
+    mrb_yield(mrb, block, mrb_hiredis_lazy_reply_element(mrb, lazy_reply->reply, i));
+    mrb_gc_arena_restore(mrb, ai);
+    lazy_reply = mrb_hiredis_lazy_reply_get(mrb, self);
+  }
+
+  return self;
+}
+
+static mrb_value
+mrb_hiredis_lazy_reply_to_a(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_lazy_reply *lazy_reply = mrb_hiredis_lazy_reply_get(mrb, self);
+  mrb_value ary = mrb_ary_new_capa(mrb, lazy_reply->size);
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb_int i;
+  for (i = 0; i < lazy_reply->size; i++) {
+    mrb_ary_push(mrb, ary, mrb_hiredis_lazy_reply_element(mrb, lazy_reply->reply, i));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return ary;
+}
+
+static mrb_value
+mrb_hiredis_lazy_reply_free_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_lazy_reply *lazy_reply = (mrb_hiredis_lazy_reply *) mrb_data_get_ptr(mrb, self, &mrb_hiredis_lazy_reply_type);
+  if (likely(lazy_reply)) {
+    mrb_hiredis_lazy_reply_release(lazy_reply);
+  }
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_hiredis_lazy_reply_consumed(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_lazy_reply *lazy_reply = (mrb_hiredis_lazy_reply *) mrb_data_get_ptr(mrb, self, &mrb_hiredis_lazy_reply_type);
+  return mrb_bool_value(!lazy_reply || !lazy_reply->reply);
+}
+
+typedef struct {
+  redisContext *context;
+  mrb_hiredis_context *mrb_context;
+  mrb_value block;
+  mrb_value reply;
+  mrb_int yielded;
+  mrb_bool aggregate;
+  mrb_bool done;
+} mrb_hiredis_stream_data;
+
+/* Parses what the reader has buffered and yields the finished top level
+ * elements collected so far; an aggregate hiredis is still filling stays
+ * behind for the next round. */
+static void
+mrb_hiredis_stream_read(mrb_state *mrb, mrb_hiredis_stream_data *stream_data, mrb_bool yield)
+{
+  redisContext *context = stream_data->context;
+  mrb_hiredis_context *mrb_context = stream_data->mrb_context;
+  void *reply = NULL;
+
+  do {
+    if (unlikely(redisGetReplyFromReader(context, &reply) == REDIS_ERR)) {
+      mrb_context->stream = FALSE;
+      mrb_hiredis_check_error(mrb, context);
+    }
+    if (reply && mrb_context->root.type == REDIS_REPLY_PUSH && context->push_cb) {
+      context->push_cb(context->privdata, reply);
+      reply = NULL;
+      continue;
+    }
+    break;
+  } while (TRUE);
+
+  mrb_value stream = mrb_context->root.value;
+  int root_type = mrb_context->root.type;
+  if (reply) {
+    stream_data->done = TRUE;
+    mrb_hiredis_take_reply(reply);
+  }
+
+  if (mrb_array_p(stream) && (root_type == REDIS_REPLY_ARRAY || root_type == REDIS_REPLY_SET ||
+    root_type == REDIS_REPLY_MAP || root_type == REDIS_REPLY_ATTR)) {
+    mrb_bool map = root_type == REDIS_REPLY_MAP || root_type == REDIS_REPLY_ATTR;
+    mrb_int len = RARRAY_LEN(stream);
+    mrb_int ready = len;
+    if (!stream_data->done && context->reader->ridx > 1) {
+      ready--;
+    }
+    if (map) {
+      ready -= ready % 2;
+    }
+
+    stream_data->aggregate = TRUE;
+    int ai = mrb_gc_arena_save(mrb);
+    if (yield) {
+      mrb_int i;
+      for (i = 0; i < ready; i += map ? 2 : 1) {
+        if (map) {
+          mrb_value pair[] = { RARRAY_PTR(stream)[i], RARRAY_PTR(stream)[i + 1] };
+          mrb_yield(mrb, stream_data->block, mrb_ary_new_from_values(mrb, 2, pair));
+        } else {
+          mrb_yield(mrb, stream_data->block, RARRAY_PTR(stream)[i]);
+        }
+        stream_data->yielded++;
+        mrb_gc_arena_restore(mrb, ai);
+      }
+    }
+
+    if (ready == len) {
+      mrb_ary_clear(mrb, stream);
+    } else if (ready > 0) {
+      mrb_ary_replace(mrb, stream, mrb_ary_new_from_values(mrb, len - ready, RARRAY_PTR(stream) + ready));
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  } else if (stream_data->done) {
+    stream_data->reply = stream;
+  }
+}
+
+static mrb_value
+mrb_hiredis_stream_body(mrb_state *mrb, mrb_value data)
+{
+  mrb_hiredis_stream_data *stream_data = (mrb_hiredis_stream_data *) mrb_cptr(data);
+  redisContext *context = stream_data->context;
+
+  int wdone = 0;
+  do {
+    if (unlikely(redisBufferWrite(context, &wdone) == REDIS_ERR)) {
+      stream_data->mrb_context->stream = FALSE;
+      mrb_hiredis_check_error(mrb, context);
+    }
+  } while (!wdone);
+
+  mrb_hiredis_stream_read(mrb, stream_data, TRUE);
+  while (!stream_data->done) {
+    if (unlikely(redisBufferRead(context) == REDIS_ERR)) {
+      stream_data->mrb_context->stream = FALSE;
+      mrb_hiredis_check_error(mrb, context);
+    }
+    mrb_hiredis_stream_read(mrb, stream_data, TRUE);
+  }
+
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_hiredis_stream_drain(mrb_state *mrb, mrb_value data)
+{
+  mrb_hiredis_stream_data *stream_data = (mrb_hiredis_stream_data *) mrb_cptr(data);
+  redisContext *context = stream_data->context;
+
+  while (!stream_data->done && stream_data->mrb_context->stream && context->err == 0) {
+    if (unlikely(redisBufferRead(context) == REDIS_ERR)) {
+      break;
+    }
+    mrb_hiredis_stream_read(mrb, stream_data, FALSE);
+  }
+
+  return mrb_nil_value();
+}
+
+/* drains whatever is left of the reply when the block raised or broke out,
+ * an error while doing so must not replace the exception being propagated */
+static mrb_value
+mrb_hiredis_stream_ensure(mrb_state *mrb, mrb_value data)
+{
+  mrb_hiredis_stream_data *stream_data = (mrb_hiredis_stream_data *) mrb_cptr(data);
+  redisContext *context = stream_data->context;
+
+  mrb_bool failed = FALSE;
+  mrb_protect(mrb, mrb_hiredis_stream_drain, data, &failed);
+  if (unlikely(failed && context->err == 0)) {
+    context->err = REDIS_ERR_EOF;
+    strncpy(context->errstr, "call_each was interrupted, reconnect before using the connection again", sizeof(context->errstr) - 1);
+  }
+  stream_data->mrb_context->stream = FALSE;
+
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_redisCommandArgvEach(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
+    if (likely(context->err == 0)) {
+      mrb_sym command;
+      mrb_value *mrb_argv = NULL;
+      mrb_int argc = 0;
+      mrb_value block = mrb_nil_value();
+
+      mrb_get_args(mrb, "n*&", &command, &mrb_argv, &argc, &block);
+      if (unlikely(mrb_type(block) != MRB_TT_PROC)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+      }
+
+      mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+      if (unlikely(mrb_context->pending > 0)) {
+        mrb_raise(mrb, E_HIREDIS_ERROR, "replies pending");
+      }
+      argc = mrb_hiredis_generate_argv(mrb, &mrb_context->argv, command, mrb_argv, argc);
+
+      mrb_hiredis_stats *stats = &mrb_context->stats;
+      mrb_int histogram = mrb_hiredis_stats_histogram(mrb, stats, mrb_context->argv.argv[0], mrb_context->argv.argvlen[0]);
+      stats->commands++;
+      uint64_t start = mrb_hiredis_now();
+      errno = 0;
+      if (unlikely(redisAppendCommandArgv(context, argc, mrb_context->argv.argv, mrb_context->argv.argvlen) != REDIS_OK)) {
+        mrb_hiredis_check_error(mrb, context);
+      }
+
+      mrb_hiredis_stream_data stream_data = { context, mrb_context, block, mrb_nil_value(), 0, FALSE, FALSE };
+      mrb_value stream_data_val = mrb_cptr_value(mrb, &stream_data);
+      mrb_context->stream = TRUE;
+      mrb_ensure(mrb, mrb_hiredis_stream_body, stream_data_val, mrb_hiredis_stream_ensure, stream_data_val);
+      mrb_hiredis_histogram_record(stats->histograms[histogram], mrb_hiredis_now() - start);
+
+      if (stream_data.aggregate) {
+        return mrb_int_value(mrb, stream_data.yielded);
+      } else {
+        return stream_data.reply;
+      }
+    } else {
+      mrb_hiredis_check_error(mrb, context);
+      return mrb_false_value();
+    }
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_busy_body(mrb_state *mrb, mrb_value block)
+{
+  return mrb_yield_argv(mrb, block, 0, NULL);
+}
+
+static mrb_value
+mrb_hiredis_busy_ensure(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (context) {
+    ((mrb_hiredis_context *) context->privdata)->stream = FALSE;
+  }
+  return mrb_nil_value();
+}
+
+/* commands sent from the block would read replies which are still in flight */
+static mrb_value
+mrb_hiredis_busy(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
+    mrb_value block = mrb_nil_value();
+
+    mrb_get_args(mrb, "&", &block);
+    if (unlikely(mrb_type(block) != MRB_TT_PROC)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+    }
+
+    ((mrb_hiredis_context *) context->privdata)->stream = TRUE;
+    return mrb_ensure(mrb, mrb_hiredis_busy_body, block, mrb_hiredis_busy_ensure, self);
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+typedef struct {
+  redisContext *context;
+  mrb_hiredis_context *mrb_context;
+  mrb_value sink;
+  mrb_value buffer;
+  mrb_int buffer_size;
+  /* payload bytes of the bulk string still on the wire, then its CRLF */
+  mrb_int payload_left;
+  mrb_int crlf_left;
+  mrb_int streamed;
+  mrb_value reply;
+} mrb_hiredis_get_to_data;
+
+/* reads until the reader has at least n unparsed bytes buffered */
+static void
+mrb_hiredis_reader_fill(mrb_state *mrb, mrb_hiredis_context *mrb_context, size_t n)
+{
+  redisContext *context = mrb_context->context;
+  while (context->reader->len - context->reader->pos < n) {
+    errno = 0;
+    if (unlikely(redisBufferRead(context) != REDIS_OK)) {
+      mrb_context->stream = FALSE;
+      mrb_hiredis_check_error(mrb, context);
+    }
+  }
+}
+
+/* Fills the reused chunk String with up to buffer_size bytes of the
+ * payload, first from what the reader already buffered, then straight from
+ * the socket, never past the end of the payload. */
+static mrb_int
+mrb_hiredis_get_to_chunk(mrb_state *mrb, mrb_hiredis_get_to_data *data)
+{
+  redisContext *context = data->context;
+  redisReader *reader = context->reader;
+  mrb_int want = data->payload_left < data->buffer_size ? data->payload_left : data->buffer_size;
+  mrb_str_resize(mrb, data->buffer, want);
+  size_t buffered = reader->len - reader->pos;
+  mrb_int got;
+  if (buffered > 0) {
+    got = (mrb_int) buffered < want ? (mrb_int) buffered : want;
+    memcpy(RSTRING_PTR(data->buffer), reader->buf + reader->pos, got);
+    reader->pos += got;
+  } else {
+    errno = 0;
+    ssize_t nread = context->funcs->read(context, RSTRING_PTR(data->buffer), want);
+    if (unlikely(nread < 0)) {
+      data->mrb_context->stream = FALSE;
+      mrb_hiredis_check_error(mrb, context);
+    }
+    got = (mrb_int) nread;
+  }
+  mrb_str_resize(mrb, data->buffer, got);
+  data->payload_left -= got;
+  return got;
+}
+
+static void
+mrb_hiredis_get_to_crlf(mrb_state *mrb, mrb_hiredis_get_to_data *data)
+{
+  redisReader *reader = data->context->reader;
+  mrb_hiredis_reader_fill(mrb, data->mrb_context, 2);
+  reader->pos += 2;
+  data->crlf_left = 0;
+  if (reader->pos == reader->len) {
+    sdsclear(reader->buf);
+    reader->pos = reader->len = 0;
+  }
+}
+
+static void
+mrb_hiredis_get_to_emit(mrb_state *mrb, mrb_hiredis_get_to_data *data, mrb_value chunk)
+{
+  if (mrb_type(data->sink) == MRB_TT_PROC) {
+    mrb_yield(mrb, data->sink, chunk);
+  } else {
+    mrb_funcall(mrb, data->sink, "write", 1, chunk);
+  }
+  data->streamed += RSTRING_LEN(chunk);
+}
+
+static mrb_value
+mrb_hiredis_get_to_body(mrb_state *mrb, mrb_value data_val)
+{
+  mrb_hiredis_get_to_data *data = (mrb_hiredis_get_to_data *) mrb_cptr(data_val);
+  redisContext *context = data->context;
+  redisReader *reader = context->reader;
+
+  int wdone = 0;
+  do {
+    if (unlikely(redisBufferWrite(context, &wdone) == REDIS_ERR)) {
+      data->mrb_context->stream = FALSE;
+      mrb_hiredis_check_error(mrb, context);
+    }
+  } while (!wdone);
+
+  /* only a bulk string is streamed, nil, errors and whatever comes after a push take the regular path */
+  mrb_hiredis_reader_fill(mrb, data->mrb_context, 1);
+  if (reader->buf[reader->pos] != '$') {
+    mrb_value reply = mrb_hiredis_read_reply(mrb, context);
+    if (mrb_string_p(reply)) {
+      mrb_hiredis_get_to_emit(mrb, data, reply);
+      data->reply = mrb_int_value(mrb, data->streamed);
+    } else {
+      data->reply = reply;
+    }
+    return mrb_nil_value();
+  }
+
+  char *newline;
+  while (!(newline = (char *) memchr(reader->buf + reader->pos, '\n', reader->len - reader->pos))) {
+    mrb_hiredis_reader_fill(mrb, data->mrb_context, reader->len - reader->pos + 1);
+  }
+  long long len = strtoll(reader->buf + reader->pos + 1, NULL, 10);
+  reader->pos = (size_t) (newline - reader->buf) + 1;
+  if (len < 0) {
+    data->reply = mrb_nil_value();
+    return mrb_nil_value();
+  }
+  data->payload_left = (mrb_int) len;
+  data->crlf_left = 2;
+
+  int ai = mrb_gc_arena_save(mrb);
+  while (data->payload_left > 0) {
+    if (mrb_hiredis_get_to_chunk(mrb, data) > 0) {
+      mrb_hiredis_get_to_emit(mrb, data, data->buffer);
+      mrb_gc_arena_restore(mrb, ai);
+    }
+  }
+  mrb_hiredis_get_to_crlf(mrb, data);
+  data->reply = mrb_int_value(mrb, data->streamed);
+
+  return mrb_nil_value();
+}
+
+/* skips the rest of the value when the block raised or broke out */
+static mrb_value
+mrb_hiredis_get_to_drain(mrb_state *mrb, mrb_value data_val)
+{
+  mrb_hiredis_get_to_data *data = (mrb_hiredis_get_to_data *) mrb_cptr(data_val);
+  while (data->mrb_context->stream && data->context->err == 0 && (data->payload_left > 0 || data->crlf_left > 0)) {
+    if (data->payload_left > 0) {
+      mrb_hiredis_get_to_chunk(mrb, data);
+    } else {
+      mrb_hiredis_get_to_crlf(mrb, data);
+    }
+  }
+
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_hiredis_get_to_ensure(mrb_state *mrb, mrb_value data_val)
+{
+  mrb_hiredis_get_to_data *data = (mrb_hiredis_get_to_data *) mrb_cptr(data_val);
+  mrb_bool failed = FALSE;
+  mrb_protect(mrb, mrb_hiredis_get_to_drain, data_val, &failed);
+  if (unlikely(failed && data->context->err == 0)) {
+    data->context->err = REDIS_ERR_EOF;
+    strncpy(data->context->errstr, "get_to was interrupted, reconnect before using the connection again", sizeof(data->context->errstr) - 1);
+  }
+  data->mrb_context->stream = FALSE;
+
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_hiredis_stream_get(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
+    if (likely(context->err == 0)) {
+      mrb_value key, sink;
+      mrb_int buffer_size;
+
+      mrb_get_args(mrb, "ooi", &key, &sink, &buffer_size);
+      if (unlikely(buffer_size <= 0)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "buffer must be positive");
+      }
+
+      mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+      if (unlikely(mrb_context->pending > 0)) {
+        mrb_raise(mrb, E_HIREDIS_ERROR, "replies pending");
+      }
+      if (unlikely(mrb_array_p(key) || mrb_hash_p(key))) {
+        mrb_raise(mrb, E_TYPE_ERROR, "key must be a single value");
+      }
+      mrb_hiredis_argv *argv = &mrb_context->argv;
+      mrb_hiredis_generate_argv(mrb, argv, mrb_intern_lit(mrb, "get"), &key, 1);
+
+      mrb_hiredis_stats *stats = &mrb_context->stats;
+      mrb_int histogram = mrb_hiredis_stats_histogram(mrb, stats, argv->argv[0], argv->argvlen[0]);
+      stats->commands++;
+      uint64_t start = mrb_hiredis_now();
+      errno = 0;
+      if (unlikely(redisAppendCommandArgv(context, 2, argv->argv, argv->argvlen) != REDIS_OK)) {
+        mrb_hiredis_check_error(mrb, context);
+      }
+
+      mrb_hiredis_get_to_data data = {
+        context, mrb_context, sink, mrb_str_new_capa(mrb, buffer_size), buffer_size, 0, 0, 0, mrb_nil_value()
+      };
+      mrb_value data_val = mrb_cptr_value(mrb, &data);
+      mrb_context->stream = TRUE;
+      mrb_ensure(mrb, mrb_hiredis_get_to_body, data_val, mrb_hiredis_get_to_ensure, data_val);
+      mrb_hiredis_histogram_record(stats->histograms[histogram], mrb_hiredis_now() - start);
+
+      return data.reply;
+    } else {
+      mrb_hiredis_check_error(mrb, context);
+      return mrb_false_value();
+    }
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static void
+mrb_hiredis_set_from_write(mrb_state *mrb, redisContext *context, mrb_hiredis_context *mrb_context, const char *buf, size_t len)
+{
+  sds obuf = sdscatlen(context->obuf, buf, len);
+  if (unlikely(!obuf)) {
+    mrb_context->stream = FALSE;
+    mrb_raise(mrb, E_HIREDIS_ERR_OOM, "Out of memory");
+  }
+  context->obuf = obuf;
+  int wdone = 0;
+  do {
+    errno = 0;
+    if (unlikely(redisBufferWrite(context, &wdone) == REDIS_ERR)) {
+      mrb_context->stream = FALSE;
+      mrb_hiredis_check_error(mrb, context);
+    }
+  } while (!wdone);
+}
+
+typedef struct {
+  redisContext *context;
+  mrb_hiredis_context *mrb_context;
+  mrb_value io;
+  mrb_int left;
+  mrb_int buffer_size;
+} mrb_hiredis_set_from_data;
+
+static mrb_value
+mrb_hiredis_set_from_body(mrb_state *mrb, mrb_value data_val)
+{
+  mrb_hiredis_set_from_data *data = (mrb_hiredis_set_from_data *) mrb_cptr(data_val);
+  mrb_value read_size = mrb_int_value(mrb, data->buffer_size);
+  int ai = mrb_gc_arena_save(mrb);
+  while (data->left > 0) {
+    if (data->left < data->buffer_size) {
+      read_size = mrb_int_value(mrb, data->left);
+    }
+    mrb_value chunk = mrb_funcall(mrb, data->io, "read", 1, read_size);
+    if (unlikely(!mrb_string_p(chunk) || RSTRING_LEN(chunk) == 0 || RSTRING_LEN(chunk) > data->left)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "io didn't return the announced length");
+    }
+    mrb_hiredis_set_from_write(mrb, data->context, data->mrb_context, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+    data->left -= RSTRING_LEN(chunk);
+    /* the garbage collector doesn't count string bytes, so the chunk is given back right away */
+    if (!MRB_FROZEN_P(mrb_str_ptr(chunk))) {
+      mrb_str_resize(mrb, chunk, 0);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+  }
+
+  return mrb_nil_value();
+}
+
+/* the command is already partly on the wire, the connection can't be used anymore */
+static mrb_value
+mrb_hiredis_set_from_ensure(mrb_state *mrb, mrb_value data_val)
+{
+  mrb_hiredis_set_from_data *data = (mrb_hiredis_set_from_data *) mrb_cptr(data_val);
+  if (unlikely(data->left > 0 && data->context->err == 0)) {
+    data->context->err = REDIS_ERR_EOF;
+    strncpy(data->context->errstr, "set_from was interrupted, reconnect before using the connection again", sizeof(data->context->errstr) - 1);
+  }
+  data->mrb_context->stream = FALSE;
+
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_hiredis_stream_set(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
+    if (likely(context->err == 0)) {
+      mrb_value key, io;
+      mrb_int length, buffer_size;
+
+      mrb_get_args(mrb, "ooii", &key, &io, &length, &buffer_size);
+      if (unlikely(mrb_array_p(key) || mrb_hash_p(key))) {
+        mrb_raise(mrb, E_TYPE_ERROR, "key must be a single value");
+      }
+      if (unlikely(length < 0)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "negative length");
+      }
+      if (unlikely(buffer_size <= 0)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "buffer must be positive");
+      }
+
+      mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+      if (unlikely(mrb_context->pending > 0)) {
+        mrb_raise(mrb, E_HIREDIS_ERROR, "replies pending");
+      }
+
+      mrb_hiredis_stats *stats = &mrb_context->stats;
+      mrb_int histogram = mrb_hiredis_stats_histogram(mrb, stats, "set", 3);
+      stats->commands++;
+      uint64_t start = mrb_hiredis_now();
+
+      /* Symbols and numbers are encoded the way call does it */
+      char numbuf[MRB_HIREDIS_NUMBUF_SIZE];
+      const char *key_ptr;
+      size_t key_len;
+      mrb_hiredis_argv one = { &key_ptr, &key_len, numbuf, 1 };
+      mrb_hiredis_argv_set(mrb, &one, 0, key);
+
+      /* everything up to the value goes out in one piece, the value in chunks read from io */
+      char head[64];
+      int head_len = snprintf(head, sizeof(head), "*3\r\n$3\r\nset\r\n$%zu\r\n", key_len);
+      mrb_context->stream = TRUE;
+      mrb_hiredis_set_from_write(mrb, context, mrb_context, head, (size_t) head_len);
+      mrb_hiredis_set_from_write(mrb, context, mrb_context, key_ptr, key_len);
+      head_len = snprintf(head, sizeof(head), "\r\n$%" MRB_PRId "\r\n", length);
+      mrb_hiredis_set_from_write(mrb, context, mrb_context, head, (size_t) head_len);
+
+      mrb_hiredis_set_from_data data = { context, mrb_context, io, length, buffer_size };
+      mrb_value data_val = mrb_cptr_value(mrb, &data);
+      mrb_ensure(mrb, mrb_hiredis_set_from_body, data_val, mrb_hiredis_set_from_ensure, data_val);
+      mrb_hiredis_set_from_write(mrb, context, mrb_context, "\r\n", 2);
+
+      mrb_value reply = mrb_hiredis_read_reply(mrb, context);
+      mrb_hiredis_histogram_record(stats->histograms[histogram], mrb_hiredis_now() - start);
+      return reply;
+    } else {
+      mrb_hiredis_check_error(mrb, context);
+      return mrb_false_value();
+    }
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_redisBufferWrite(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
+    if (likely(context->err == 0)) {
+      int wdone = 0;
+      errno = 0;
+      do {
+        if (unlikely(redisBufferWrite(context, &wdone) == REDIS_ERR)) {
+          mrb_hiredis_check_error(mrb, context);
+        }
+      } while (!wdone);
+      return self;
+    } else {
+      mrb_hiredis_check_error(mrb, context);
+      return mrb_false_value();
+    }
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_pending(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    return mrb_int_value(mrb, ((mrb_hiredis_context *) context->privdata)->pending);
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_closed_p(mrb_state *mrb, mrb_value self)
+{
+  return mrb_bool_value(DATA_PTR(self) == NULL);
+}
+
+static mrb_value
+mrb_hiredis_setup_cache(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_int max_bytes;
+    mrb_float max_staleness;
+    mrb_get_args(mrb, "if", &max_bytes, &max_staleness);
+    if (unlikely(max_bytes <= 0)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "max_bytes must be positive");
+    }
+    if (unlikely(!(max_staleness >= 0 && max_staleness <= 60))) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "max_staleness must be between 0 and 60 seconds");
+    }
+
+    mrb_hiredis_cache *cache = &((mrb_hiredis_context *) context->privdata)->cache;
+    if (mrb_nil_p(cache->index)) {
+      cache->index = mrb_hash_new(mrb);
+      mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "cache_index"), cache->index);
+      cache->keys = mrb_ary_new(mrb);
+      mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "cache_keys"), cache->keys);
+      cache->values = mrb_ary_new(mrb);
+      mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "cache_values"), cache->values);
+      cache->sources = mrb_ary_new(mrb);
+      mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "cache_sources"), cache->sources);
+      cache->dependents = mrb_hash_new(mrb);
+      mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "cache_dependents"), cache->dependents);
+    }
+    cache->max_bytes = max_bytes;
+    cache->sync_interval = (uint64_t) (max_staleness * 1e9);
+    cache->synced = 0;
+    mrb_hiredis_cache_evict(mrb, cache, max_bytes);
+    cache->enabled = TRUE;
+
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_teardown_cache(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_cache *cache = &((mrb_hiredis_context *) context->privdata)->cache;
+    mrb_hiredis_cache_clear(mrb, cache);
+    cache->enabled = FALSE;
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_cache_stats(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_cache *cache = &((mrb_hiredis_context *) context->privdata)->cache;
+    mrb_value stats = mrb_hash_new_capa(mrb, 9);
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "enabled")), mrb_bool_value(cache->enabled));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "hits")), mrb_int_value(mrb, cache->hits));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "misses")), mrb_int_value(mrb, cache->misses));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "invalidations")), mrb_int_value(mrb, cache->invalidations));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "evictions")), mrb_int_value(mrb, cache->evictions));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "entries")), mrb_int_value(mrb, cache->entries));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "bytes")), mrb_int_value(mrb, cache->bytes));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "max_bytes")), mrb_int_value(mrb, cache->max_bytes));
+    mrb_hash_set(mrb, stats, mrb_symbol_value(mrb_intern_lit(mrb, "max_staleness")), mrb_float_value(mrb, (mrb_float) cache->sync_interval / 1e9));
+    return stats;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_reset_cache_stats(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_cache *cache = &((mrb_hiredis_context *) context->privdata)->cache;
+    cache->hits = cache->misses = cache->invalidations = cache->evictions = 0;
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_stats_m(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    return mrb_hiredis_stats_to_hash(mrb, &((mrb_hiredis_context *) context->privdata)->stats);
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_reset_stats(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_stats_reset(&((mrb_hiredis_context *) context->privdata)->stats);
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_listen(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
+    if (likely(context->err == 0)) {
+      mrb_sym command;
+      mrb_value *mrb_argv = NULL;
+      mrb_int argc = 0;
+      mrb_value block = mrb_nil_value();
+
+      mrb_get_args(mrb, "n*&", &command, &mrb_argv, &argc, &block);
+
+      mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+      if (unlikely(mrb_context->pending > 0)) {
+        mrb_raise(mrb, E_HIREDIS_ERROR, "replies pending");
+      }
+
+      mrb_hiredis_argv *argv = &mrb_context->argv;
+      argc = mrb_hiredis_generate_argv(mrb, argv, command, mrb_argv, argc);
+      int table;
+      mrb_hiredis_pubsub_kind kind = mrb_hiredis_pubsub_classify(argv->argv[0], argv->argvlen[0], &table);
+
+      if (kind == MRB_HIREDIS_PUBSUB_SUBSCRIBE) {
+        if (unlikely(mrb_type(block) != MRB_TT_PROC)) {
+          mrb_raise(mrb, E_ARGUMENT_ERROR, "no block given");
+        }
+      }
+      else if (unlikely(kind != MRB_HIREDIS_PUBSUB_UNSUBSCRIBE)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "not a subscribe or unsubscribe command");
+      }
+
+      errno = 0;
+      if (unlikely(redisAppendCommandArgv(context, argc, argv->argv, argv->argvlen) != REDIS_OK)) {
+        mrb_hiredis_check_error(mrb, context);
+      }
+      /* only once the command is on its way, a failed append leaves no handlers behind */
+      if (kind == MRB_HIREDIS_PUBSUB_SUBSCRIBE) {
+        mrb_int i;
+        for (i = 1; i < argc; i++) {
+          mrb_hash_set(mrb, mrb_context->subscriptions[table], mrb_str_new(mrb, argv->argv[i], argv->argvlen[i]), block);
+        }
+      }
+      mrb_context->stats.commands++;
+      int wdone = 0;
+      do {
+        if (unlikely(redisBufferWrite(context, &wdone) == REDIS_ERR)) {
+          mrb_hiredis_check_error(mrb, context);
+        }
+      } while (!wdone);
+
+      return self;
+    } else {
+      mrb_hiredis_check_error(mrb, context);
+      return mrb_false_value();
+    }
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_dispatch(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
+    if (likely(context->err == 0)) {
+      mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+      int rc = REDIS_OK;
+      mrb_value reply_val = mrb_nil_value();
+      if (RARRAY_LEN(mrb_context->pushes) > 0) {
+        /* messages the push callback set aside during call go first */
+        reply_val = mrb_ary_shift(mrb, mrb_context->pushes);
+      } else {
+        /* RESP3 delivers pub/sub as push replies, take them here instead of the push callback */
+        redisPushFn *push_cb = context->push_cb;
+        void *reply = NULL;
+        context->push_cb = NULL;
+        errno = 0;
+        rc = redisGetReply(context, &reply);
+        context->push_cb = push_cb;
+        if (likely(rc == REDIS_OK && reply != NULL)) {
+          reply_val = mrb_hiredis_take_reply(reply);
+        }
+      }
+
+      if (likely(rc == REDIS_OK)) {
+        int ai = mrb_gc_arena_save(mrb);
+        /* invalidations are the cache's business, not a subscription's */
+        if (!mrb_hiredis_cache_push(mrb, &mrb_context->cache, reply_val)) {
+          mrb_value handler = mrb_hiredis_pubsub_handler(mrb, mrb_context->subscriptions, reply_val);
+          if (mrb_type(handler) == MRB_TT_PROC) {
+            mrb_yield(mrb, handler, reply_val);
+          }
+        }
+        mrb_gc_arena_restore(mrb, ai);
+        return reply_val;
+      } else {
+        mrb_hiredis_check_error(mrb, context);
+        return mrb_false_value();
+      }
+    } else {
+      mrb_hiredis_check_error(mrb, context);
+      return mrb_false_value();
+    }
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+#if ((HIREDIS_MAJOR == 0) && (HIREDIS_MINOR >= 13) || (HIREDIS_MAJOR > 0))
+static mrb_value
+mrb_redisReconnect(mrb_state *mrb, mrb_value self)
+{
+  redisContext *context = (redisContext *) DATA_PTR(self);
+  if (likely(context)) {
+    mrb_hiredis_check_streaming(mrb, context);
+    int rc = redisReconnect(context);
+    mrb_hiredis_setup_reader(context);
+    mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) context->privdata;
+    mrb_context->pending = 0;
+    mrb_context->stats.starts_len = 0;
+    mrb_hiredis_stats_install(&mrb_context->stats, context);
+    int i;
+    for (i = 0; i < MRB_HIREDIS_PUBSUB_TABLES; i++) {
+      mrb_hash_clear(mrb, mrb_context->subscriptions[i]);
+    }
+    mrb_ary_clear(mrb, mrb_context->pushes);
+    /* the new connection isn't tracked, enable_cache has to be called again */
+    mrb_hiredis_cache_clear(mrb, &mrb_context->cache);
+    mrb_context->cache.enabled = FALSE;
+    if (likely(rc == REDIS_OK)) {
+      mrb_hiredis_apply_socket_options(mrb, context, &mrb_context->sockopts);
+      return self;
+    } else {
+      mrb_hiredis_check_error(mrb, context);
+      return mrb_false_value();
+    }
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+#endif
+
+/* the Strings borrowed by a written iov are let go of and thawed */
+static void
+mrb_hiredis_async_iov_release(mrb_hiredis_async_context *mrb_async_context)
+{
+  mrb_state *mrb = mrb_async_context->mrb;
+  mrb_value strings = mrb_async_context->iov_strings;
+  mrb_int i;
+  for (i = 0; i + 1 < RARRAY_LEN(strings); i += 2) {
+    if (mrb_test(RARRAY_PTR(strings)[i + 1])) {
+      MRB_UNSET_FROZEN_FLAG(mrb_basic_ptr(RARRAY_PTR(strings)[i]));
+    }
+  }
+  mrb_ary_clear(mrb, strings);
+  mrb_hiredis_iov_reset(&mrb_async_context->iov);
+}
+
+MRB_INLINE void
+mrb_hiredis_dataCleanup(void *privdata)
+{
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_hiredis_async_iov_release(mrb_async_context);
+  mrb_data_init(mrb_async_context->self, NULL, NULL);
+  mrb_hiredis_stats_uninstall(&mrb_async_context->stats, &mrb_async_context->async_context->c);
+  mrb_hiredis_async_context_free(mrb_async_context->mrb, mrb_async_context);
+}
+
+MRB_INLINE void
+mrb_hiredis_addRead(void *privdata)
+{
+  mrb_assert(privdata);
+
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_state *mrb = mrb_async_context->mrb;
+  mrb_assert(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@addRead"));
+  if (likely(mrb_type(block) == MRB_TT_PROC)) {
+    mrb_value argv[] = {
+      mrb_async_context->self,
+      mrb_async_context->evloop,
+      mrb_int_value(mrb, mrb_async_context->async_context->c.fd)
+    };
+    mrb_yield_argv(mrb, block, 3, argv);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+MRB_INLINE void
+mrb_hiredis_delRead(void *privdata)
+{
+  mrb_assert(privdata);
+
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_state *mrb = mrb_async_context->mrb;
+  mrb_assert(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@delRead"));
+  if (likely(mrb_type(block) == MRB_TT_PROC)) {
+    mrb_value argv[] = {
+      mrb_async_context->self,
+      mrb_async_context->evloop,
+      mrb_int_value(mrb, mrb_async_context->async_context->c.fd)
+    };
+    mrb_yield_argv(mrb, block, 3, argv);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+/* Commands in the iov are older than anything in c.obuf, hiredis only gets
+ * to write once the iov is out. Until then the write event stays on. */
+static void
+mrb_hiredis_async_handle_write(redisAsyncContext *async_context)
+{
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+  redisContext *context = &async_context->c;
+  if (mrb_async_context && mrb_hiredis_iov_pending(&mrb_async_context->iov) && (context->flags & REDIS_CONNECTED)) {
+    errno = 0;
+    if (mrb_hiredis_iov_write(&mrb_async_context->iov, context->fd, &mrb_async_context->stats) < 0 && errno != EAGAIN) {
+      /* hiredis sees the error on its next write and disconnects */
+      context->err = REDIS_ERR_IO;
+      snprintf(context->errstr, sizeof(context->errstr), "%s", strerror(errno));
+    } else if (mrb_hiredis_iov_pending(&mrb_async_context->iov)) {
+      return;
+    } else {
+      mrb_hiredis_async_iov_release(mrb_async_context);
+    }
+  }
+  redisAsyncHandleWrite(async_context);
+}
+
+static void
+mrb_hiredis_cork_arm(mrb_hiredis_async_context *mrb_async_context);
+
+/* Held back while corked, until uncork or flush, until cork_bytes are
+ * buffered or cork_delay has passed. The native adapter has a timer for
+ * the delay, with Callbacks it is only checked when a command is queued. */
+static void
+mrb_hiredis_cork_addWrite(void *privdata)
+{
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  if (mrb_async_context->corked) {
+    redisContext *context = &mrb_async_context->async_context->c;
+    uint64_t now = mrb_hiredis_now();
+    if (!mrb_async_context->cork_write) {
+      mrb_async_context->cork_write = TRUE;
+      mrb_async_context->cork_since = now;
+      if (mrb_async_context->cork_delay > 0) {
+        mrb_hiredis_cork_arm(mrb_async_context);
+      }
+    }
+    if (sdslen(context->obuf) + mrb_hiredis_iov_bytes(&mrb_async_context->iov) < mrb_async_context->cork_bytes &&
+      (mrb_async_context->cork_delay == 0 || now - mrb_async_context->cork_since < mrb_async_context->cork_delay)) {
+      return;
+    }
+    mrb_async_context->cork_write = FALSE;
+  }
+  mrb_async_context->add_write(privdata);
+}
+
+/* writes what the cork held back right away instead of waiting for the loop */
+static void
+mrb_hiredis_cork_release(mrb_hiredis_async_context *mrb_async_context)
+{
+  if (!mrb_async_context->cork_write) {
+    return;
+  }
+  mrb_async_context->cork_write = FALSE;
+  redisAsyncContext *async_context = mrb_async_context->async_context;
+  redisContext *context = &async_context->c;
+  if (!(context->flags & REDIS_CONNECTED) || mrb_hiredis_iov_pending(&mrb_async_context->iov)) {
+    /* hiredis isn't asked again when a write of the iov stops short, the loop takes care of these */
+    mrb_async_context->add_write(mrb_async_context);
+  } else if (sdslen(context->obuf) > 0) {
+    mrb_hiredis_async_handle_write(async_context);
+  }
+}
+
+/* Like redisAsyncCommandArgv. Commands with large arguments only hand their
+ * name to hiredis, which registers the callback, the rest waits in the iov
+ * with the Strings frozen and referenced until it has been written. */
+static int
+mrb_hiredis_async_command(mrb_state *mrb, mrb_hiredis_async_context *mrb_async_context, redisCallbackFn *fn, void *privdata, const mrb_value *mrb_argv, mrb_int mrb_argc, mrb_int argc, const mrb_hiredis_argv *argv)
+{
+  redisAsyncContext *async_context = mrb_async_context->async_context;
+  redisContext *context = &async_context->c;
+  if (likely(!mrb_hiredis_iov_wanted(argc, argv->argvlen)) || !(context->flags & REDIS_CONNECTED) ||
+    (context->flags & (REDIS_DISCONNECTING|REDIS_FREEING))) {
+    return redisAsyncCommandArgv(async_context, fn, privdata, argc, argv->argv, argv->argvlen);
+  }
+
+  mrb_value strings = mrb_ary_new(mrb);
+  mrb_int i;
+  for (i = 0; i < mrb_argc; i++) {
+    mrb_hiredis_iov_collect(mrb, strings, mrb_argv[i]);
+  }
+  mrb_hiredis_iov *iov = &mrb_async_context->iov;
+  sds buf = mrb_hiredis_iov_prepare(mrb, iov, strings, 1, argc, argv->argv, argv->argvlen);
+  sds head = sdscatprintf(sdsempty(), "*%" MRB_PRId "\r\n$%zu\r\n", argc, argv->argvlen[0]);
+  head = head ? sdscatlen(head, argv->argv[0], argv->argvlen[0]) : NULL;
+  head = head ? sdscatlen(head, "\r\n", 2) : NULL;
+  sds obuf = sdsempty();
+  mrb_value iov_strings = mrb_async_context->iov_strings;
+  mrb_int kept = RARRAY_LEN(iov_strings);
+  mrb_ary_concat(mrb, iov_strings, strings);
+  int rc = REDIS_ERR;
+  if (likely(head && obuf)) {
+    rc = redisAsyncFormattedCommand(async_context, fn, privdata, head, sdslen(head));
+  }
+  sdsfree(head);
+  if (unlikely(rc != REDIS_OK)) {
+    mrb_ary_resize(mrb, iov_strings, kept);
+    sdsfree(obuf);
+    sdsfree(buf);
+    if (!context->err) {
+      mrb_raise(mrb, E_HIREDIS_ERR_OOM, "Out of memory");
+    }
+    return rc;
+  }
+
+  /* what hiredis buffered so far, the header of this command included, goes first */
+  mrb_hiredis_iov_own(iov, context->obuf);
+  mrb_hiredis_iov_push(iov, context->obuf, sdslen(context->obuf));
+  context->obuf = obuf;
+  mrb_hiredis_iov_encode(iov, buf, strings, 1, argc, argv->argv, argv->argvlen);
+
+  for (i = 0; i + 1 < RARRAY_LEN(strings); i += 2) {
+    if (mrb_test(RARRAY_PTR(strings)[i + 1])) {
+      MRB_SET_FROZEN_FLAG(mrb_basic_ptr(RARRAY_PTR(strings)[i]));
+    }
+  }
+
+  return REDIS_OK;
+}
+
+MRB_INLINE void
+mrb_hiredis_addWrite(void *privdata)
+{
+  mrb_assert(privdata);
+
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_state *mrb = mrb_async_context->mrb;
+  mrb_assert(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@addWrite"));
+  if (likely(mrb_type(block) == MRB_TT_PROC)) {
+    mrb_value argv[] = {
+      mrb_async_context->self,
+      mrb_async_context->evloop,
+      mrb_int_value(mrb, mrb_async_context->async_context->c.fd)
+    };
+    mrb_yield_argv(mrb, block, 3, argv);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+MRB_INLINE void
+mrb_hiredis_delWrite(void *privdata)
+{
+  mrb_assert(privdata);
+
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_state *mrb = mrb_async_context->mrb;
+  mrb_assert(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@delWrite"));
+  if (likely(mrb_type(block) == MRB_TT_PROC)) {
+    mrb_value argv[] = {
+      mrb_async_context->self,
+      mrb_async_context->evloop,
+      mrb_int_value(mrb, mrb_async_context->async_context->c.fd)
+    };
+    mrb_yield_argv(mrb, block, 3, argv);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+MRB_INLINE void
+mrb_hiredis_scheduleTimer(void *privdata, struct timeval tv)
+{
+  mrb_assert(privdata);
+
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_state *mrb = mrb_async_context->mrb;
+  mrb_assert(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@scheduleTimer"));
+  if (likely(mrb_type(block) == MRB_TT_PROC)) {
+    mrb_value argv[] = {
+      mrb_async_context->self,
+      mrb_async_context->evloop,
+      mrb_float_value(mrb, (mrb_float) tv.tv_sec + (mrb_float) tv.tv_usec / 1000000)
+    };
+    mrb_yield_argv(mrb, block, 3, argv);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+MRB_INLINE void
+mrb_hiredis_cleanup(void *privdata)
+{
+  mrb_assert(privdata);
+
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_state *mrb = mrb_async_context->mrb;
+  mrb_assert(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@cleanup"));
+  if (likely(mrb_type(block) == MRB_TT_PROC)) {
+    mrb_value argv[] = {
+      mrb_async_context->self,
+      mrb_async_context->evloop
+    };
+    mrb_yield_argv(mrb, block, 2, argv);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+#ifdef MRB_HIREDIS_EPOLL
+/* Raising from inside an ev hook would unwind through hiredis half way
+ * through its own bookkeeping, so hooks only record the first failure and
+ * dispatch or the next command raises it. */
+static void
+mrb_hiredis_epoll_failed(mrb_hiredis_async_context *mrb_async_context, const char *call)
+{
+  if (!mrb_async_context->epoll_failed) {
+    mrb_async_context->epoll_failed = call;
+    mrb_async_context->epoll_errno = errno;
+  }
+}
+
+static void
+mrb_hiredis_epoll_check(mrb_state *mrb, mrb_hiredis_async_context *mrb_async_context)
+{
+  const char *call = mrb_async_context->epoll_failed;
+  if (unlikely(call)) {
+    mrb_async_context->epoll_failed = NULL;
+    errno = mrb_async_context->epoll_errno;
+    mrb_sys_fail(mrb, call);
+  }
+}
+
+/* Native adapter: hiredis readiness changes only touch a private epoll set,
+ * which is registered once with the RedisAe loop. The loop wakes up when the
+ * connection is ready and a single C function dispatches to hiredis, so no
+ * Ruby code runs when hiredis toggles read or write interest. */
+static mrb_value
+mrb_hiredis_epoll_dispatch(mrb_state *mrb, mrb_value block_self)
+{
+  mrb_value self = mrb_proc_cfunc_env_get(mrb, 0);
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (unlikely(!async_context || !async_context->data)) {
+    return mrb_nil_value();
+  }
+
+  mrb_hiredis_epoll_check(mrb, (mrb_hiredis_async_context *) async_context->data);
+  struct epoll_event events[3];
+  int ready = epoll_wait(((mrb_hiredis_async_context *) async_context->data)->epfd, events, 3, 0);
+  int i;
+  for (i = 0; i < ready; i++) {
+    /* any handler may have freed the connection */
+    async_context = (redisAsyncContext *) DATA_PTR(self);
+    if (unlikely(!async_context || !async_context->data)) {
+      return mrb_nil_value();
+    }
+    mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+
+    if (events[i].data.fd == mrb_async_context->timerfd) {
+      uint64_t expirations;
+      if (read(mrb_async_context->timerfd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+        redisAsyncHandleTimeout(async_context);
+      }
+      continue;
+    }
+    if (events[i].data.fd == mrb_async_context->cork_timerfd) {
+      uint64_t expirations;
+      /* a cork released early and started again has rearmed the timer */
+      if (read(mrb_async_context->cork_timerfd, &expirations, sizeof(expirations)) == sizeof(expirations) &&
+        mrb_async_context->cork_write &&
+        mrb_hiredis_now() - mrb_async_context->cork_since >= mrb_async_context->cork_delay) {
+        mrb_hiredis_cork_release(mrb_async_context);
+      }
+      continue;
+    }
+    if (events[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) {
+      redisAsyncHandleRead(async_context);
+      async_context = (redisAsyncContext *) DATA_PTR(self);
+      if (unlikely(!async_context)) {
+        return mrb_nil_value();
+      }
+    }
+    if (events[i].events & EPOLLOUT) {
+      mrb_hiredis_async_handle_write(async_context);
+    }
+  }
+
+  async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context && async_context->data)) {
+    mrb_hiredis_epoll_check(mrb, (mrb_hiredis_async_context *) async_context->data);
+  }
+  return mrb_nil_value();
+}
+
+/* called while the connection is set up, before hiredis uses any hook,
+ * the socket joins the set once hiredis wants to read or write */
+static void
+mrb_hiredis_epoll_open(mrb_state *mrb, mrb_hiredis_async_context *mrb_async_context)
+{
+  errno = 0;
+  mrb_async_context->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (unlikely(mrb_async_context->epfd == -1)) {
+    mrb_sys_fail(mrb, "epoll_create1");
+  }
+
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_value argv[] = {
+    mrb_int_value(mrb, mrb_async_context->epfd),
+    mrb_const_get(mrb, mrb_obj_value(mrb_class_get(mrb, "RedisAe")), mrb_intern_lit(mrb, "READABLE"))
+  };
+  mrb_value dispatch = mrb_obj_value(mrb_proc_new_cfunc_with_env(mrb, mrb_hiredis_epoll_dispatch, 1, &mrb_async_context->self));
+  mrb_value file_event = mrb_funcall_with_block(mrb, mrb_async_context->evloop, mrb_intern_lit(mrb, "create_file_event"), 2, argv, dispatch);
+  mrb_iv_set(mrb, mrb_async_context->self, mrb_intern_lit(mrb, "epoll_event"), file_event);
+  mrb_gc_arena_restore(mrb, ai);
+}
+
+/* EPOLLHUP and EPOLLERR are reported even without any events, so a socket
+ * nobody waits on leaves the set instead of keeping the loop spinning */
+static void
+mrb_hiredis_epoll_update(mrb_hiredis_async_context *mrb_async_context, uint32_t events)
+{
+  if (events == mrb_async_context->events || mrb_async_context->epfd == -1) {
+    return;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.fd = mrb_async_context->async_context->c.fd;
+  int op = events == 0 ? EPOLL_CTL_DEL : mrb_async_context->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+  errno = 0;
+  if (unlikely(epoll_ctl(mrb_async_context->epfd, op, event.data.fd, &event) == -1)) {
+    mrb_hiredis_epoll_failed(mrb_async_context, "epoll_ctl");
+    return;
+  }
+  mrb_async_context->events = events;
+}
+
+/* command and connect timeouts, a timerfd in the same epoll set */
+MRB_INLINE void
+mrb_hiredis_epoll_scheduleTimer(void *privdata, struct timeval tv)
+{
+  mrb_assert(privdata);
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  if (mrb_async_context->epfd == -1) {
+    return;
+  }
+
+  errno = 0;
+  if (mrb_async_context->timerfd == -1) {
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (unlikely(timerfd == -1)) {
+      mrb_hiredis_epoll_failed(mrb_async_context, "timerfd_create");
+      return;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = timerfd;
+    if (unlikely(epoll_ctl(mrb_async_context->epfd, EPOLL_CTL_ADD, event.data.fd, &event) == -1)) {
+      mrb_hiredis_epoll_failed(mrb_async_context, "epoll_ctl");
+      close(timerfd);
+      return;
+    }
+    mrb_async_context->timerfd = timerfd;
+  }
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = tv.tv_sec;
+  spec.it_value.tv_nsec = tv.tv_usec * 1000;
+  if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+    spec.it_value.tv_nsec = 1; /* zero would disarm the timer */
+  }
+  if (unlikely(timerfd_settime(mrb_async_context->timerfd, 0, &spec, NULL) == -1)) {
+    mrb_hiredis_epoll_failed(mrb_async_context, "timerfd_settime");
+  }
+}
+
+MRB_INLINE void
+mrb_hiredis_epoll_addRead(void *privdata)
+{
+  mrb_assert(privdata);
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_hiredis_epoll_update(mrb_async_context, mrb_async_context->events | EPOLLIN);
+}
+
+MRB_INLINE void
+mrb_hiredis_epoll_delRead(void *privdata)
+{
+  mrb_assert(privdata);
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_hiredis_epoll_update(mrb_async_context, mrb_async_context->events & ~((uint32_t) EPOLLIN));
+}
+
+MRB_INLINE void
+mrb_hiredis_epoll_addWrite(void *privdata)
+{
+  mrb_assert(privdata);
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_hiredis_epoll_update(mrb_async_context, mrb_async_context->events | EPOLLOUT);
+}
+
+MRB_INLINE void
+mrb_hiredis_epoll_delWrite(void *privdata)
+{
+  mrb_assert(privdata);
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_hiredis_epoll_update(mrb_async_context, mrb_async_context->events & ~((uint32_t) EPOLLOUT));
+}
+
+/* fires cork_delay after the first write was held back */
+static void
+mrb_hiredis_cork_arm(mrb_hiredis_async_context *mrb_async_context)
+{
+  if (mrb_async_context->add_write != mrb_hiredis_epoll_addWrite || mrb_async_context->epfd == -1) {
+    return;
+  }
+
+  errno = 0;
+  if (mrb_async_context->cork_timerfd == -1) {
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (unlikely(timerfd == -1)) {
+      mrb_hiredis_epoll_failed(mrb_async_context, "timerfd_create");
+      return;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = timerfd;
+    if (unlikely(epoll_ctl(mrb_async_context->epfd, EPOLL_CTL_ADD, event.data.fd, &event) == -1)) {
+      mrb_hiredis_epoll_failed(mrb_async_context, "epoll_ctl");
+      close(timerfd);
+      return;
+    }
+    mrb_async_context->cork_timerfd = timerfd;
+  }
+
+  struct itimerspec spec;
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = (time_t) (mrb_async_context->cork_delay / 1000000000);
+  spec.it_value.tv_nsec = (long) (mrb_async_context->cork_delay % 1000000000);
+  if (unlikely(timerfd_settime(mrb_async_context->cork_timerfd, 0, &spec, NULL) == -1)) {
+    mrb_hiredis_epoll_failed(mrb_async_context, "timerfd_settime");
+  }
+}
+
+MRB_INLINE void
+mrb_hiredis_epoll_cleanup(void *privdata)
+{
+  mrb_assert(privdata);
+
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_state *mrb = mrb_async_context->mrb;
+  mrb_assert(mrb);
+
+  if (mrb_async_context->epfd != -1) {
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_sym file_event_sym = mrb_intern_lit(mrb, "epoll_event");
+    mrb_value file_event = mrb_iv_get(mrb, mrb_async_context->self, file_event_sym);
+    if (!mrb_nil_p(file_event)) {
+      mrb_iv_set(mrb, mrb_async_context->self, file_event_sym, mrb_nil_value());
+      mrb_funcall(mrb, mrb_async_context->evloop, "delete_file_event", 1, file_event);
+    }
+    mrb_gc_arena_restore(mrb, ai);
+    close(mrb_async_context->epfd);
+    mrb_async_context->epfd = -1;
+  }
+  if (mrb_async_context->timerfd != -1) {
+    close(mrb_async_context->timerfd);
+    mrb_async_context->timerfd = -1;
+  }
+  if (mrb_async_context->cork_timerfd != -1) {
+    close(mrb_async_context->cork_timerfd);
+    mrb_async_context->cork_timerfd = -1;
+  }
+  mrb_async_context->events = 0;
+}
+#else
+static void
+mrb_hiredis_cork_arm(mrb_hiredis_async_context *mrb_async_context)
+{
+  (void) mrb_async_context;
+}
+
+MRB_INLINE void
+mrb_hiredis_epoll_check(mrb_state *mrb, mrb_hiredis_async_context *mrb_async_context)
+{
+  (void) mrb;
+  (void) mrb_async_context;
+}
+#endif
+
+MRB_INLINE void
+mrb_redisDisconnectCallback(const struct redisAsyncContext *async_context, int status)
+{
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+  if (unlikely(!mrb_async_context)) {
+    return;
+  }
+  mrb_state *mrb = mrb_async_context->mrb;
+  mrb_assert(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+  if (status != REDIS_OK) {
+    mrb_async_context->stats.io_errors++;
+  }
+  /* what is left in the iov is never written */
+  mrb_hiredis_async_iov_release(mrb_async_context);
+
+  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@disconnect"));
+  if (likely(mrb_type(block) == MRB_TT_PROC)) {
+    mrb_value argv[] = {
+      mrb_async_context->self,
+      mrb_async_context->evloop,
+      mrb_int_value(mrb, status)
+    };
+
+    mrb_yield_argv(mrb, block, 3, argv);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+MRB_INLINE void
+mrb_redisConnectCallback(const struct redisAsyncContext *async_context, int status)
+{
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+  if (unlikely(!mrb_async_context)) {
+    return;
+  }
+  mrb_state *mrb = mrb_async_context->mrb;
+  mrb_assert(mrb);
+  int ai = mrb_gc_arena_save(mrb);
+
+  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@connect"));
+  if (likely(mrb_type(block) == MRB_TT_PROC)) {
+    mrb_value argv[] = {
+      mrb_async_context->self,
+      mrb_async_context->evloop,
+      mrb_int_value(mrb, status)
+    };
+
+    mrb_yield_argv(mrb, block, 3, argv);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+MRB_INLINE mrb_value
+mrb_hiredis_setup_async_context(mrb_state *mrb, mrb_value self, mrb_value callbacks, mrb_value evloop, redisAsyncContext *async_context, mrb_bool native, mrb_bool symbol_keys)
+{
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@callbacks"), callbacks);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@evloop"), evloop);
+  mrb_value replies = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "replies"), replies);
+
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) mrb_malloc(mrb, sizeof(mrb_hiredis_async_context));
+  mrb_async_context->mrb = mrb;
+  mrb_async_context->self = self;
+  mrb_async_context->callbacks = callbacks;
+  mrb_async_context->evloop = evloop;
+  mrb_async_context->async_context = async_context;
+  mrb_async_context->replies = replies;
+  mrb_async_context->replies_free = -1;
+  mrb_hiredis_pubsub_init(mrb, self, mrb_async_context->subscriptions);
+  mrb_async_context->argv.argv = NULL;
+  mrb_async_context->argv.argvlen = NULL;
+  mrb_async_context->argv.numbuf = NULL;
+  mrb_async_context->argv.capa = 0;
+  mrb_async_context->epfd = -1;
+  mrb_async_context->timerfd = -1;
+  mrb_async_context->cork_timerfd = -1;
+  mrb_async_context->events = 0;
+  mrb_async_context->epoll_failed = NULL;
+  mrb_async_context->epoll_errno = 0;
+  mrb_async_context->in_flight = 0;
+  memset(&mrb_async_context->iov, 0, sizeof(mrb_hiredis_iov));
+  mrb_async_context->iov_strings = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "iov_strings"), mrb_async_context->iov_strings);
+  mrb_hiredis_stats_init(&mrb_async_context->stats);
+  mrb_hiredis_stats_install(&mrb_async_context->stats, &async_context->c);
+  mrb_hiredis_intern_init(mrb, self, &mrb_async_context->intern, symbol_keys);
+  mrb_async_context->pool = mrb_hiredis_reply_pool_new(mrb);
+  if (likely(async_context->c.reader)) {
+    async_context->c.reader->fn = &mrb_hiredis_pool_functions;
+    async_context->c.reader->privdata = mrb_async_context->pool;
+  }
+
+  async_context->data = async_context->ev.data = mrb_async_context;
+  async_context->dataCleanup = mrb_hiredis_dataCleanup;
+#ifdef MRB_HIREDIS_EPOLL
+  if (native) {
+    mrb_hiredis_epoll_open(mrb, mrb_async_context);
+    async_context->ev.addRead = mrb_hiredis_epoll_addRead;
+    async_context->ev.delRead = mrb_hiredis_epoll_delRead;
+    async_context->ev.addWrite = mrb_hiredis_epoll_addWrite;
+    async_context->ev.delWrite = mrb_hiredis_epoll_delWrite;
+    async_context->ev.cleanup = mrb_hiredis_epoll_cleanup;
+    async_context->ev.scheduleTimer = mrb_hiredis_epoll_scheduleTimer;
+  } else
+#endif
+  {
+    async_context->ev.addRead = mrb_hiredis_addRead;
+    async_context->ev.delRead = mrb_hiredis_delRead;
+    async_context->ev.addWrite = mrb_hiredis_addWrite;
+    async_context->ev.delWrite = mrb_hiredis_delWrite;
+    async_context->ev.cleanup = mrb_hiredis_cleanup;
+    async_context->ev.scheduleTimer = mrb_hiredis_scheduleTimer;
+  }
+  mrb_async_context->add_write = async_context->ev.addWrite;
+  async_context->ev.addWrite = mrb_hiredis_cork_addWrite;
+  mrb_async_context->corked = mrb_async_context->cork_write = FALSE;
+  mrb_async_context->cork_bytes = 0;
+  mrb_async_context->cork_delay = mrb_async_context->cork_since = 0;
+  redisAsyncSetDisconnectCallback(async_context, mrb_redisDisconnectCallback);
+  redisAsyncSetConnectCallback(async_context, mrb_redisConnectCallback);
+
+  return self;
+}
+
+static mrb_value
+mrb_redisAsyncConnect(mrb_state *mrb, mrb_value self)
+{
+  mrb_value  callbacks = mrb_nil_value(), evloop = mrb_nil_value();
+  char *host_or_path = (char *) "localhost";
+  mrb_int port = 6379;
+  mrb_value options = mrb_nil_value();
+
+  mrb_get_args(mrb, "|ooziH", &callbacks, &evloop, &host_or_path, &port, &options);
+  mrb_assert(port >= INT_MIN && port <= INT_MAX);
+
+  redisOptions opts = {0};
+  struct timeval connect_timeout, command_timeout;
+  mrb_hiredis_socket_options sockopts;
+  if (port == -1) {
+    REDIS_OPTIONS_SET_UNIX(&opts, host_or_path);
+  } else {
+    REDIS_OPTIONS_SET_TCP(&opts, host_or_path, (int) port);
+  }
+  mrb_hiredis_parse_options(mrb, options, &opts, &connect_timeout, &command_timeout, &sockopts);
+
+  /* user supplied Callbacks take over readiness handling, otherwise the native adapter does it */
+  mrb_bool native = mrb_nil_p(callbacks);
+  if (native) {
+    callbacks = mrb_obj_new(mrb, mrb_class_get_under(mrb, mrb_class(mrb, self), "Callbacks"), 0, NULL);
+  }
+
+  if (mrb_nil_p(evloop)) {
+    evloop = mrb_obj_new(mrb, mrb_class_get(mrb, "RedisAe"), 0, NULL);
+  }
+
+  redisAsyncContext *async_context = NULL;
+  errno = 0;
+  async_context = redisAsyncConnectWithOptions(&opts);
+  if (likely(async_context != NULL)) {
+    mrb_data_init(self, async_context, &mrb_redisAsyncContext_type);
+    if (likely(async_context->c.err == 0)) {
+      mrb_hiredis_setup_async_context(mrb, self, callbacks, evloop, async_context, native, mrb_hiredis_option_symbol_keys(mrb, options));
+      mrb_hiredis_apply_socket_options(mrb, &async_context->c, &sockopts);
+      return self;
+    } else {
+      mrb_hiredis_check_error(mrb, &async_context->c);
+      return mrb_false_value();
+    }
+  } else {
+    mrb_sys_fail(mrb, "redisAsyncConnect");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_redisAsyncHandleTimeout(mrb_state *mrb, mrb_value self)
+{
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context)) {
+    redisAsyncHandleTimeout(async_context);
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_redisAsyncStats(mrb_state *mrb, mrb_value self)
+{
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context)) {
+    mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+    mrb_value hash = mrb_hiredis_stats_to_hash(mrb, &mrb_async_context->stats);
+    const mrb_hiredis_reply_pool *pool = mrb_async_context->pool;
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "reply_memory")), mrb_int_value(mrb, (mrb_int) pool->bytes));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "max_reply_memory")), mrb_int_value(mrb, (mrb_int) pool->peak));
+    mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "pooled_replies")), mrb_int_value(mrb, (mrb_int) pool->free_len));
+    return hash;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
 
-  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@addRead"));
-  if (likely(mrb_type(block) == MRB_TT_PROC)) {
-    mrb_value argv[] = {
-      mrb_async_context->self,
-      mrb_async_context->evloop,
-      mrb_int_value(mrb, mrb_async_context->async_context->c.fd)
-    };
-    mrb_yield_argv(mrb, block, 3, argv);
-    mrb_gc_arena_restore(mrb, ai);
+static mrb_value
+mrb_redisAsyncResetStats(mrb_state *mrb, mrb_value self)
+{
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context)) {
+    mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+    mrb_hiredis_stats_reset(&mrb_async_context->stats);
+    mrb_async_context->pool->peak = mrb_async_context->pool->bytes;
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
   }
 }
 
-MRB_INLINE void
-mrb_hiredis_delRead(void *privdata)
+static mrb_value
+mrb_redisAsyncHandleRead(mrb_state *mrb, mrb_value self)
 {
-  mrb_assert(privdata);
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context)) {
+    redisAsyncHandleRead(async_context);
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
 
-  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+static mrb_value
+mrb_redisAsyncHandleWrite(mrb_state *mrb, mrb_value self)
+{
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context)) {
+    mrb_hiredis_async_handle_write(async_context);
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+MRB_INLINE void
+mrb_redisCallbackFn(struct redisAsyncContext *async_context, void *r, void *privdata)
+{
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+  if (unlikely(!mrb_async_context)) {
+    return;
+  }
   mrb_state *mrb = mrb_async_context->mrb;
+
   mrb_assert(mrb);
   int ai = mrb_gc_arena_save(mrb);
 
-  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@delRead"));
+  mrb_int slot = (mrb_int) (intptr_t) privdata;
+  mrb_hiredis_stats *stats = &mrb_async_context->stats;
+  uint64_t now = mrb_hiredis_now();
+  if (likely(r)) {
+    mrb_hiredis_histogram_record(stats->histograms[stats->start_histograms[slot]], now - stats->starts[slot]);
+  }
+  mrb_async_context->in_flight--;
+
+  mrb_value block = mrb_hiredis_replies_release(mrb, mrb_async_context, slot);
   if (likely(mrb_type(block) == MRB_TT_PROC)) {
-    mrb_value argv[] = {
-      mrb_async_context->self,
-      mrb_async_context->evloop,
-      mrb_int_value(mrb, mrb_async_context->async_context->c.fd)
-    };
-    mrb_yield_argv(mrb, block, 3, argv);
-    mrb_gc_arena_restore(mrb, ai);
+    mrb_value reply = mrb_nil_value();
+    if (likely(r)) {
+      stats->replies++;
+      if (((redisReply *) r)->type == REDIS_REPLY_ERROR) {
+        stats->errors++;
+      }
+      reply = mrb_hiredis_get_reply((redisReply *)r, mrb, &mrb_async_context->intern);
+      stats->convert_ns += mrb_hiredis_now() - now;
+    }
+    mrb_yield(mrb, block, reply);
   }
+  mrb_gc_arena_restore(mrb, ai);
 }
 
 MRB_INLINE void
-mrb_hiredis_addWrite(void *privdata)
+mrb_redisSubscribeCallbackFn(struct redisAsyncContext *async_context, void *r, void *privdata)
 {
-  mrb_assert(privdata);
-
-  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+  if (unlikely(!mrb_async_context)) {
+    return;
+  }
   mrb_state *mrb = mrb_async_context->mrb;
+
   mrb_assert(mrb);
   int ai = mrb_gc_arena_save(mrb);
 
-  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@addWrite"));
+  mrb_value block = mrb_obj_value(privdata);
   if (likely(mrb_type(block) == MRB_TT_PROC)) {
-    mrb_value argv[] = {
-      mrb_async_context->self,
-      mrb_async_context->evloop,
-      mrb_int_value(mrb, mrb_async_context->async_context->c.fd)
-    };
-    mrb_yield_argv(mrb, block, 3, argv);
-    mrb_gc_arena_restore(mrb, ai);
+    mrb_gc_protect(mrb, block);
+    mrb_value reply = mrb_nil_value();
+    if (likely(r)) {
+      mrb_hiredis_stats *stats = &mrb_async_context->stats;
+      uint64_t start = mrb_hiredis_now();
+      stats->replies++;
+      reply = mrb_hiredis_get_reply((redisReply *)r, mrb, &mrb_async_context->intern);
+      stats->convert_ns += mrb_hiredis_now() - start;
+    }
+    /* hiredis routes messages itself, this only drops blocks redis confirmed as unsubscribed */
+    mrb_hiredis_pubsub_handler(mrb, mrb_async_context->subscriptions, reply);
+    mrb_yield(mrb, block, reply);
   }
+  mrb_gc_arena_restore(mrb, ai);
 }
 
-MRB_INLINE void
-mrb_hiredis_delWrite(void *privdata)
+static mrb_value
+mrb_redisAsyncCommandArgv(mrb_state *mrb, mrb_value self)
 {
-  mrb_assert(privdata);
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context)) {
+    mrb_sym command;
+    mrb_value *mrb_argv = NULL;
+    mrb_int mrb_argc = 0;
+    mrb_value block = mrb_nil_value();
 
-  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
-  mrb_state *mrb = mrb_async_context->mrb;
-  mrb_assert(mrb);
-  int ai = mrb_gc_arena_save(mrb);
+    mrb_get_args(mrb, "n*&", &command, &mrb_argv, &mrb_argc, &block);
 
-  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@delWrite"));
-  if (likely(mrb_type(block) == MRB_TT_PROC)) {
-    mrb_value argv[] = {
-      mrb_async_context->self,
-      mrb_async_context->evloop,
-      mrb_int_value(mrb, mrb_async_context->async_context->c.fd)
-    };
-    mrb_yield_argv(mrb, block, 3, argv);
-    mrb_gc_arena_restore(mrb, ai);
+    mrb_hiredis_argv *argv = &((mrb_hiredis_async_context *) async_context->data)->argv;
+    mrb_int argc = mrb_hiredis_generate_argv(mrb, argv, command, mrb_argv, mrb_argc);
+    int rc;
+
+    errno = 0;
+    if (mrb_type(block) == MRB_TT_PROC) {
+      mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+      size_t command_len = argv->argvlen[0];
+      const char *command_name = argv->argv[0];
+
+      int table;
+      mrb_hiredis_pubsub_kind kind = mrb_hiredis_pubsub_classify(command_name, command_len, &table);
+
+      if (kind == MRB_HIREDIS_PUBSUB_SUBSCRIBE) {
+#if (HIREDIS_MAJOR < 1) || ((HIREDIS_MAJOR == 1) && (HIREDIS_MINOR < 2))
+        if (unlikely(table == MRB_HIREDIS_PUBSUB_SHARD_CHANNELS)) {
+          mrb_raise(mrb, E_NOTIMP_ERROR, "sharded pub/sub needs hiredis >= 1.2");
+        }
+#endif
+        rc = redisAsyncCommandArgv(async_context, mrb_redisSubscribeCallbackFn, mrb_ptr(block), argc, argv->argv, argv->argvlen);
+        if (likely(rc == REDIS_OK)) {
+          mrb_int i;
+          for (i = 1; i < argc; i++) {
+            mrb_hash_set(mrb, mrb_async_context->subscriptions[table], mrb_str_new(mrb, argv->argv[i], argv->argvlen[i]), block);
+          }
+        }
+      }
+      else if (kind == MRB_HIREDIS_PUBSUB_UNSUBSCRIBE) {
+        /* confirmations arrive on the callbacks of the channels being left */
+        rc = redisAsyncCommandArgv(async_context, NULL, NULL, argc, argv->argv, argv->argvlen);
+      }
+      else if (command_len == 7 && strncasecmp(command_name, "monitor", command_len) == 0) {
+        rc = redisAsyncCommandArgv(async_context, mrb_redisSubscribeCallbackFn, mrb_ptr(block), argc, argv->argv, argv->argvlen);
+        if (likely(rc == REDIS_OK)) {
+          mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "monitor"), block);
+        }
+      }
+      else {
+        mrb_hiredis_stats *stats = &mrb_async_context->stats;
+        mrb_int histogram = mrb_hiredis_stats_histogram(mrb, stats, command_name, command_len);
+        mrb_int slot = mrb_hiredis_replies_register(mrb, mrb_async_context, block);
+        mrb_hiredis_stats_reserve(mrb, stats, slot + 1);
+        stats->starts[slot] = mrb_hiredis_now();
+        stats->start_histograms[slot] = histogram;
+        rc = mrb_hiredis_async_command(mrb, mrb_async_context, mrb_redisCallbackFn, (void *) (intptr_t) slot, mrb_argv, mrb_argc, argc, argv);
+        if (likely(rc == REDIS_OK)) {
+          if (++mrb_async_context->in_flight > stats->max_pending) {
+            stats->max_pending = mrb_async_context->in_flight;
+          }
+        } else {
+          mrb_hiredis_replies_release(mrb, mrb_async_context, slot);
+        }
+      }
+
+    } else {
+      rc = mrb_hiredis_async_command(mrb, (mrb_hiredis_async_context *) async_context->data, NULL, NULL, mrb_argv, mrb_argc, argc, argv);
+    }
+
+    if (likely(rc == REDIS_OK)) {
+      ((mrb_hiredis_async_context *) async_context->data)->stats.commands++;
+      mrb_hiredis_epoll_check(mrb, (mrb_hiredis_async_context *) async_context->data);
+      return self;
+    } else {
+      mrb_hiredis_check_error(mrb, &async_context->c);
+      return mrb_false_value();
+    }
+
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
   }
 }
 
-MRB_INLINE void
-mrb_hiredis_cleanup(void *privdata)
+static mrb_value
+mrb_redisAsyncFormattedCommand(mrb_state *mrb, mrb_value self)
 {
-  mrb_assert(privdata);
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context)) {
+    mrb_value command;
+    mrb_value *values = NULL;
+    mrb_int valuesc = 0;
+    mrb_value block = mrb_nil_value();
 
-  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) privdata;
-  mrb_state *mrb = mrb_async_context->mrb;
-  mrb_assert(mrb);
-  int ai = mrb_gc_arena_save(mrb);
+    mrb_get_args(mrb, "o*&", &command, &values, &valuesc, &block);
 
-  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@cleanup"));
-  if (likely(mrb_type(block) == MRB_TT_PROC)) {
-    mrb_value argv[] = {
-      mrb_async_context->self,
-      mrb_async_context->evloop
-    };
-    mrb_yield_argv(mrb, block, 2, argv);
-    mrb_gc_arena_restore(mrb, ai);
+    size_t len, name_len;
+    const char *name;
+    const char *resp = mrb_hiredis_formatted(mrb, command, values, valuesc, &len, &name, &name_len);
+
+    int table;
+    if (unlikely(mrb_hiredis_pubsub_classify(name, name_len, &table) == MRB_HIREDIS_PUBSUB_SUBSCRIBE ||
+      (name_len == 7 && strncasecmp(name, "monitor", name_len) == 0))) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "subscribe and monitor have to go through queue");
+    }
+
+    mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+    int rc;
+    errno = 0;
+    if (mrb_type(block) == MRB_TT_PROC) {
+      mrb_hiredis_stats *stats = &mrb_async_context->stats;
+      mrb_int histogram = mrb_hiredis_stats_histogram(mrb, stats, name, name_len);
+      mrb_int slot = mrb_hiredis_replies_register(mrb, mrb_async_context, block);
+      mrb_hiredis_stats_reserve(mrb, stats, slot + 1);
+      stats->starts[slot] = mrb_hiredis_now();
+      stats->start_histograms[slot] = histogram;
+      rc = redisAsyncFormattedCommand(async_context, mrb_redisCallbackFn, (void *) (intptr_t) slot, resp, len);
+      if (likely(rc == REDIS_OK)) {
+        if (++mrb_async_context->in_flight > stats->max_pending) {
+          stats->max_pending = mrb_async_context->in_flight;
+        }
+      } else {
+        mrb_hiredis_replies_release(mrb, mrb_async_context, slot);
+      }
+    } else {
+      rc = redisAsyncFormattedCommand(async_context, NULL, NULL, resp, len);
+    }
+
+    if (likely(rc == REDIS_OK)) {
+      mrb_async_context->stats.commands++;
+      mrb_hiredis_epoll_check(mrb, mrb_async_context);
+      return self;
+    } else {
+      mrb_hiredis_check_error(mrb, &async_context->c);
+      return mrb_false_value();
+    }
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
   }
 }
 
-MRB_INLINE void
-mrb_redisDisconnectCallback(const struct redisAsyncContext *async_context, int status)
+static mrb_value
+mrb_hiredis_async_setup_cork(mrb_state *mrb, mrb_value self)
 {
-  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
-  mrb_state *mrb = mrb_async_context->mrb;
-  mrb_assert(mrb);
-  int ai = mrb_gc_arena_save(mrb);
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context)) {
+    mrb_int max_bytes;
+    mrb_float max_delay;
 
-  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@disconnect"));
-  if (likely(mrb_type(block) == MRB_TT_PROC)) {
-    mrb_value argv[] = {
-      mrb_async_context->self,
-      mrb_async_context->evloop,
-      mrb_int_value(mrb, status)
-    };
+    mrb_get_args(mrb, "if", &max_bytes, &max_delay);
+    if (unlikely(max_bytes <= 0 || max_delay < 0)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "max_bytes must be positive and max_delay not negative");
+    }
 
-    mrb_yield_argv(mrb, block, 3, argv);
-    mrb_gc_arena_restore(mrb, ai);
+    mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+    mrb_async_context->corked = TRUE;
+    mrb_async_context->cork_bytes = (size_t) max_bytes;
+    mrb_async_context->cork_delay = (uint64_t) (max_delay * 1e9);
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_async_uncork(mrb_state *mrb, mrb_value self)
+{
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context)) {
+    mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+    mrb_async_context->corked = FALSE;
+    mrb_hiredis_cork_release(mrb_async_context);
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+/* writes now and stays corked, what the socket doesn't take goes out with the loop */
+static mrb_value
+mrb_hiredis_async_flush(mrb_state *mrb, mrb_value self)
+{
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context)) {
+    mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+    mrb_bool corked = mrb_async_context->corked;
+    mrb_async_context->corked = FALSE;
+    mrb_hiredis_cork_release(mrb_async_context);
+    /* a failed write disconnects and frees the context */
+    async_context = (redisAsyncContext *) DATA_PTR(self);
+    if (likely(async_context)) {
+      ((mrb_hiredis_async_context *) async_context->data)->corked = corked;
+    }
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
+  }
+}
+
+static mrb_value
+mrb_hiredis_async_corked_p(mrb_state *mrb, mrb_value self)
+{
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  return mrb_bool_value(async_context && ((mrb_hiredis_async_context *) async_context->data)->corked);
+}
+
+static mrb_value
+mrb_redisAsyncDisconnect(mrb_state *mrb, mrb_value self)
+{
+  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
+  if (likely(async_context)) {
+    /* hiredis waits for the replies of corked commands, they have to go out */
+    mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+    mrb_async_context->corked = FALSE;
+    if (mrb_async_context->cork_write) {
+      mrb_async_context->cork_write = FALSE;
+      mrb_async_context->add_write(mrb_async_context);
+    }
+    redisAsyncDisconnect(async_context);
+    return mrb_nil_value();
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    return mrb_false_value();
   }
 }
 
-MRB_INLINE void
-mrb_redisConnectCallback(const struct redisAsyncContext *async_context, int status)
+static mrb_value
+mrb_hiredis_command_initialize(mrb_state *mrb, mrb_value self)
 {
-  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
-  mrb_state *mrb = mrb_async_context->mrb;
-  mrb_assert(mrb);
-  int ai = mrb_gc_arena_save(mrb);
+  mrb_value *argv = NULL;
+  mrb_int argc = 0;
+  mrb_get_args(mrb, "*", &argv, &argc);
 
-  mrb_value block = mrb_iv_get(mrb, mrb_async_context->callbacks, mrb_intern_lit(mrb, "@connect"));
-  if (likely(mrb_type(block) == MRB_TT_PROC)) {
-    mrb_value argv[] = {
-      mrb_async_context->self,
-      mrb_async_context->evloop,
-      mrb_int_value(mrb, status)
-    };
+  mrb_hiredis_command *command = (mrb_hiredis_command *) mrb_calloc(mrb, 1, sizeof(mrb_hiredis_command));
+  mrb_data_init(self, command, &mrb_hiredis_command_type);
+  mrb_hiredis_command_init(mrb, command, argv, argc);
 
-    mrb_yield_argv(mrb, block, 3, argv);
-    mrb_gc_arena_restore(mrb, ai);
-  }
+  return self;
 }
 
-MRB_INLINE mrb_value
-mrb_hiredis_setup_async_context(mrb_state *mrb, mrb_value self, mrb_value callbacks, mrb_value evloop, redisAsyncContext *async_context)
+static mrb_value
+mrb_hiredis_command_format(mrb_state *mrb, mrb_value self)
 {
-  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@callbacks"), callbacks);
-  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "@evloop"), evloop);
-  mrb_value replies = mrb_ary_new(mrb);
-  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "replies"), replies);
-  mrb_value subscriptions = mrb_hash_new(mrb);
-  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "subscriptions"), subscriptions);
+  mrb_value *values = NULL;
+  mrb_int valuesc = 0;
+  mrb_get_args(mrb, "*", &values, &valuesc);
+
+  mrb_hiredis_command *command = (mrb_hiredis_command *) mrb_data_get_ptr(mrb, self, &mrb_hiredis_command_type);
+  size_t len;
+  const char *resp = mrb_hiredis_command_fill(mrb, command, values, valuesc, &len);
+  mrb_value str = mrb_str_new(mrb, resp, len);
+  mrb_obj_freeze(mrb, str);
+  return str;
+}
 
-  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) mrb_malloc(mrb, sizeof(mrb_hiredis_async_context));
-  mrb_async_context->mrb = mrb;
-  mrb_async_context->self = self;
-  mrb_async_context->callbacks = callbacks;
-  mrb_async_context->evloop = evloop;
-  mrb_async_context->async_context = async_context;
-  mrb_async_context->replies = replies;
-  mrb_async_context->subscriptions = subscriptions;
+static mrb_value
+mrb_hiredis_command_arity(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_command *command = (mrb_hiredis_command *) mrb_data_get_ptr(mrb, self, &mrb_hiredis_command_type);
+  return mrb_int_value(mrb, command->holes_len);
+}
 
-  async_context->data = async_context->ev.data = mrb_async_context;
-  async_context->dataCleanup = mrb_hiredis_dataCleanup;
-  async_context->ev.addRead = mrb_hiredis_addRead;
-  async_context->ev.delRead = mrb_hiredis_delRead;
-  async_context->ev.addWrite = mrb_hiredis_addWrite;
-  async_context->ev.delWrite = mrb_hiredis_delWrite;
-  async_context->ev.cleanup = mrb_hiredis_cleanup;
-  redisAsyncSetDisconnectCallback(async_context, mrb_redisDisconnectCallback);
-  redisAsyncSetConnectCallback(async_context, mrb_redisConnectCallback);
+static mrb_value
+mrb_hiredis_reader_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_value options = mrb_nil_value();
+  mrb_get_args(mrb, "|H", &options);
+  mrb_bool symbol_keys = mrb_hiredis_option_symbol_keys(mrb, options);
+  if (unlikely(!mrb_nil_p(options) && mrb_hash_size(mrb, options) > (mrb_hash_key_p(mrb, options, mrb_symbol_value(mrb_intern_lit(mrb, "symbol_keys"))) ? 1 : 0))) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "Hiredis::Reader only takes the symbol_keys option");
+  }
+
+  mrb_value pending_keys = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "pending_keys"), pending_keys);
+
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) mrb_calloc(mrb, 1, sizeof(mrb_hiredis_context));
+  mrb_context->root.type = REDIS_REPLY_NIL;
+  mrb_context->root.value = mrb_nil_value();
+  mrb_context->mrb = mrb;
+  mrb_context->pending_keys = pending_keys;
+  mrb_context->reply_error_class = E_HIREDIS_REPLY_ERROR;
+  mrb_context->verb_class = mrb_class_get_under(mrb, mrb_class_get(mrb, "Hiredis"), "Verb");
+  mrb_context->stream = FALSE;
+  int i;
+  for (i = 0; i < MRB_HIREDIS_PUBSUB_TABLES; i++) {
+    mrb_context->subscriptions[i] = mrb_nil_value();
+  }
+  mrb_context->pushes = mrb_nil_value();
+  mrb_hiredis_cache_init(&mrb_context->cache);
+  mrb_hiredis_stats_init(&mrb_context->stats);
+  mrb_hiredis_intern_init(mrb, self, &mrb_context->intern, symbol_keys);
+
+  redisReader *reader = redisReaderCreateWithFunctions(&mrb_hiredis_reply_functions);
+  if (unlikely(!reader)) {
+    mrb_hiredis_context_free(mrb_context);
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->nomem_err));
+  }
+  reader->privdata = mrb_context;
+  mrb_data_init(self, reader, &mrb_hiredis_reader_type);
 
   return self;
 }
 
-static mrb_value
-mrb_redisAsyncConnect(mrb_state *mrb, mrb_value self)
+static void
+mrb_hiredis_reader_check_error(mrb_state *mrb, const redisReader *reader)
 {
-  mrb_value  callbacks = mrb_nil_value(), evloop = mrb_nil_value();
-  char *host_or_path = (char *) "localhost";
-  mrb_int port = 6379;
-
-  mrb_get_args(mrb, "|oozi", &callbacks, &evloop, &host_or_path, &port);
-  mrb_assert(port >= INT_MIN && port <= INT_MAX);
+  switch (reader->err) {
+  case REDIS_ERR_OOM:
+    mrb_raise(mrb, E_HIREDIS_ERR_OOM, reader->errstr);
+    break;
+  case REDIS_ERR_PROTOCOL:
+    mrb_raise(mrb, E_HIREDIS_ERR_PROTOCOL, reader->errstr);
+    break;
+  default:
+    mrb_raise(mrb, E_HIREDIS_ERROR, reader->err ? reader->errstr : "reader error");
+  }
+}
 
-  if (mrb_nil_p(callbacks)) {
-    callbacks = mrb_obj_new(mrb, mrb_class_get_under(mrb, mrb_class(mrb, self), "Callbacks"), 0, NULL);
+static mrb_value
+mrb_hiredis_reader_feed(mrb_state *mrb, mrb_value self)
+{
+  redisReader *reader = (redisReader *) DATA_PTR(self);
+  if (likely(reader)) {
+    const char *buf;
+    mrb_int len;
+    mrb_get_args(mrb, "s", &buf, &len);
+    if (unlikely(redisReaderFeed(reader, buf, len) != REDIS_OK)) {
+      mrb_hiredis_reader_check_error(mrb, reader);
+    }
+    return self;
+  } else {
+    mrb_raise(mrb, E_IO_ERROR, "closed reader");
+    return mrb_false_value();
   }
+}
 
-  if (mrb_nil_p(evloop)) {
-    evloop = mrb_obj_new(mrb, mrb_class_get(mrb, "RedisAe"), 0, NULL);
+/* Parses the next complete reply into the ready ivar, wrapped in an Array
+ * so a false or nil reply can be told apart from no reply at all. */
+static mrb_bool
+mrb_hiredis_reader_next(mrb_state *mrb, mrb_value self, redisReader *reader)
+{
+  mrb_sym ready_sym = mrb_intern_lit(mrb, "ready");
+  if (!mrb_nil_p(mrb_iv_get(mrb, self, ready_sym))) {
+    return TRUE;
+  }
+  void *reply = NULL;
+  if (unlikely(redisReaderGetReply(reader, &reply) != REDIS_OK)) {
+    mrb_hiredis_reader_check_error(mrb, reader);
   }
+  mrb_value reply_val = reply ? mrb_hiredis_take_reply(reply) : mrb_nil_value();
+  /* a reply split across feeds is built in place, it has to survive the
+   * GC until the rest arrives */
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "partial"), ((mrb_hiredis_context *) reader->privdata)->root.value);
+  if (reply) {
+    mrb_iv_set(mrb, self, ready_sym, mrb_ary_new_from_values(mrb, 1, &reply_val));
+    return TRUE;
+  }
+  return FALSE;
+}
 
-  redisAsyncContext *async_context = NULL;
-  errno = 0;
-  if (port == -1) {
-    async_context = redisAsyncConnectUnix(host_or_path);
+static mrb_value
+mrb_hiredis_reader_has_reply(mrb_state *mrb, mrb_value self)
+{
+  redisReader *reader = (redisReader *) DATA_PTR(self);
+  if (likely(reader)) {
+    return mrb_bool_value(mrb_hiredis_reader_next(mrb, self, reader));
   } else {
-    async_context = redisAsyncConnect(host_or_path, port);
+    mrb_raise(mrb, E_IO_ERROR, "closed reader");
+    return mrb_false_value();
   }
-  if (likely(async_context != NULL)) {
-    mrb_data_init(self, async_context, &mrb_redisAsyncContext_type);
-    if (likely(async_context->c.err == 0)) {
-      return mrb_hiredis_setup_async_context(mrb, self, callbacks, evloop, async_context);
-    } else {
-      mrb_hiredis_check_error(mrb, &async_context->c);
+}
+
+/* false when no complete reply is buffered, which RESP3 #f looks the same
+ * as, has_reply? tells them apart */
+static mrb_value
+mrb_hiredis_reader_gets(mrb_state *mrb, mrb_value self)
+{
+  redisReader *reader = (redisReader *) DATA_PTR(self);
+  if (likely(reader)) {
+    if (!mrb_hiredis_reader_next(mrb, self, reader)) {
       return mrb_false_value();
     }
+    mrb_sym ready_sym = mrb_intern_lit(mrb, "ready");
+    mrb_value ready = mrb_iv_get(mrb, self, ready_sym);
+    mrb_iv_set(mrb, self, ready_sym, mrb_nil_value());
+    return RARRAY_PTR(ready)[0];
   } else {
-    mrb_sys_fail(mrb, "redisAsyncConnect");
+    mrb_raise(mrb, E_IO_ERROR, "closed reader");
     return mrb_false_value();
   }
 }
 
 static mrb_value
-mrb_redisAsyncHandleRead(mrb_state *mrb, mrb_value self)
+mrb_hiredis_reader_free_m(mrb_state *mrb, mrb_value self)
 {
-  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
-  if (likely(async_context)) {
-    redisAsyncHandleRead(async_context);
-    return self;
+  redisReader *reader = (redisReader *) DATA_PTR(self);
+  if (likely(reader)) {
+    mrb_hiredis_reader_free(mrb, reader);
+    mrb_data_init(self, NULL, NULL);
+    mrb_iv_remove(mrb, self, mrb_intern_lit(mrb, "partial"));
+    return mrb_nil_value();
   } else {
-    mrb_raise(mrb, E_IO_ERROR, "closed stream");
+    mrb_raise(mrb, E_IO_ERROR, "closed reader");
     return mrb_false_value();
   }
 }
 
 static mrb_value
-mrb_redisAsyncHandleWrite(mrb_state *mrb, mrb_value self)
+mrb_hiredis_cluster_key_slot(mrb_state *mrb, mrb_value self)
 {
-  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
-  if (likely(async_context)) {
-    redisAsyncHandleWrite(async_context);
-    return self;
+  mrb_value key;
+  mrb_get_args(mrb, "o", &key);
+
+  if (mrb_symbol_p(key)) {
+    mrb_int len;
+    const char *name = mrb_sym2name_len(mrb, mrb_symbol(key), &len);
+    return mrb_int_value(mrb, mrb_hiredis_key_slot(name, len));
   } else {
-    mrb_raise(mrb, E_IO_ERROR, "closed stream");
-    return mrb_false_value();
+    key = mrb_str_to_str(mrb, key);
+    return mrb_int_value(mrb, mrb_hiredis_key_slot(RSTRING_PTR(key), RSTRING_LEN(key)));
   }
 }
 
-MRB_INLINE void
-mrb_redisCallbackFn(struct redisAsyncContext *async_context, void *r, void *privdata)
+static mrb_value
+mrb_hiredis_script_digest(mrb_state *mrb, mrb_value self)
 {
-  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
-  mrb_assert(mrb_async_context);
-  mrb_state *mrb = mrb_async_context->mrb;
+  mrb_value source;
+  mrb_get_args(mrb, "S", &source);
 
-  mrb_assert(mrb);
-  int ai = mrb_gc_arena_save(mrb);
+  mrb_value sha = mrb_str_new(mrb, NULL, 40);
+  mrb_hiredis_sha1_hex(RSTRING_PTR(source), RSTRING_LEN(source), RSTRING_PTR(sha));
+  return sha;
+}
 
-  mrb_value block = mrb_obj_value(privdata);
-  mrb_funcall(mrb, mrb_async_context->replies, "delete", 1, block);
-  if (likely(mrb_type(block) == MRB_TT_PROC)) {
-    mrb_value reply = mrb_nil_value();
-    if (likely(r)) {
-      reply = mrb_hiredis_get_reply((redisReply *)r, mrb);
-    }
-    mrb_yield(mrb, block, reply);
+static mrb_hiredis_threaded *
+mrb_hiredis_threaded_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_threaded *threaded = (mrb_hiredis_threaded *) DATA_PTR(self);
+  if (unlikely(!threaded)) {
+    mrb_raise(mrb, E_IO_ERROR, "closed stream");
   }
-  mrb_gc_arena_restore(mrb, ai);
+  return threaded;
 }
 
 static mrb_value
-mrb_redisAsyncCommandArgv(mrb_state *mrb, mrb_value self)
+mrb_hiredis_threaded_initialize(mrb_state *mrb, mrb_value self)
 {
-  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
-  if (likely(async_context)) {
-    mrb_sym command;
-    mrb_value *mrb_argv = NULL;
-    mrb_int argc = 0;
-    mrb_value block = mrb_nil_value();
+  char *host_or_path = (char *) "localhost";
+  mrb_int port = 6379;
+  mrb_value options = mrb_nil_value();
 
-    mrb_get_args(mrb, "n*&", &command, &mrb_argv, &argc, &block);
+  mrb_get_args(mrb, "|ziH", &host_or_path, &port, &options);
+  mrb_assert(port >= INT_MIN && port <= INT_MAX);
 
-    const char **argv;
-    size_t *argvlen;
-    mrb_hiredis_generate_argv_argc_array(mrb, command, mrb_argv, &argc, &argv, &argvlen);
-    int rc;
+  redisOptions opts = {0};
+  struct timeval connect_timeout, command_timeout;
+  mrb_hiredis_socket_options sockopts;
+  if (port == -1) {
+    REDIS_OPTIONS_SET_UNIX(&opts, host_or_path);
+  } else {
+    REDIS_OPTIONS_SET_TCP(&opts, host_or_path, (int) port);
+  }
+  mrb_hiredis_parse_options(mrb, options, &opts, &connect_timeout, &command_timeout, &sockopts);
 
-    errno = 0;
-    if (mrb_type(block) == MRB_TT_PROC) {
-      rc = redisAsyncCommandArgv(async_context, mrb_redisCallbackFn, mrb_ptr(block), argc, argv, argvlen);
-      mrb_free(mrb, argv);
-      mrb_int command_len = argvlen[0];
-      mrb_free(mrb, argvlen);
+  mrb_hiredis_threaded *threaded = (mrb_hiredis_threaded *) mrb_calloc(mrb, 1, sizeof(mrb_hiredis_threaded));
+  threaded->wake_io[0] = threaded->wake_io[1] = threaded->wake_mrb[0] = threaded->wake_mrb[1] = -1;
+  mrb_data_init(self, threaded, &mrb_hiredis_threaded_type);
+  mrb_hiredis_intern_init(mrb, self, &threaded->intern, mrb_hiredis_option_symbol_keys(mrb, options));
 
-      if (likely(rc == REDIS_OK)) {
-        if ((command_len == 9 && strncasecmp(argv[0], "subscribe", command_len) == 0)||
-          (command_len == 10 && strncasecmp(argv[0], "psubscribe", command_len) == 0)) {
-          if (likely(argc == 2)) {
-            mrb_hash_set(mrb, ((mrb_hiredis_async_context *) async_context->ev.data)->subscriptions, mrb_argv[0], block);
-          } else {
-            mrb_raise(mrb, E_ARGUMENT_ERROR, "hiredis only supports one topic Subscribtions");
-          }
-        }
-        else if ((command_len == 11 && strncasecmp(argv[0], "unsubscribe", command_len) == 0)||
-          (command_len == 12 && strncasecmp(argv[0], "punsubscribe", command_len) == 0)) {
-          if (likely(argc == 2)) {
-            mrb_hash_delete_key(mrb, ((mrb_hiredis_async_context *) async_context->ev.data)->subscriptions, mrb_argv[0]);
-          } else {
-            mrb_raise(mrb, E_ARGUMENT_ERROR, "hiredis only supports one topic Subscribtions");
-          }
-        }
-        else if (command_len == 7 && strncasecmp(argv[0], "monitor", command_len) == 0) {
-          mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "monitor"), block);
-        }
-        else {
-          mrb_ary_push(mrb, ((mrb_hiredis_async_context *) async_context->ev.data)->replies, block);
-        }
-      }
+  errno = 0;
+  redisContext *context = threaded->context = redisConnectWithOptions(&opts);
+  if (unlikely(!context)) {
+    mrb_sys_fail(mrb, "redisConnect");
+  }
+  if (unlikely(context->err)) {
+    mrb_hiredis_check_error(mrb, context);
+  }
+  mrb_hiredis_finish_connect(mrb, context);
+  mrb_hiredis_apply_socket_options(mrb, context, &sockopts);
+
+  /* from here on hiredis must not block, the I/O thread polls for it */
+  if (fcntl(context->fd, F_SETFL, fcntl(context->fd, F_GETFL) | O_NONBLOCK) == -1) {
+    mrb_sys_fail(mrb, "fcntl");
+  }
+  context->flags &= ~REDIS_BLOCK;
+  if (pipe(threaded->wake_io) == -1 || pipe(threaded->wake_mrb) == -1) {
+    mrb_sys_fail(mrb, "pipe");
+  }
+  int i;
+  for (i = 0; i < 2; i++) {
+    fcntl(threaded->wake_io[i], F_SETFL, fcntl(threaded->wake_io[i], F_GETFL) | O_NONBLOCK);
+    fcntl(threaded->wake_mrb[i], F_SETFL, fcntl(threaded->wake_mrb[i], F_GETFL) | O_NONBLOCK);
+  }
+
+  int rc = pthread_create(&threaded->thread, NULL, mrb_hiredis_threaded_run, threaded);
+  if (rc != 0) {
+    errno = rc;
+    mrb_sys_fail(mrb, "pthread_create");
+  }
+  threaded->running = TRUE;
+
+  return self;
+}
+
+static void
+mrb_hiredis_threaded_fail(mrb_state *mrb, mrb_hiredis_threaded *threaded)
+{
+  __atomic_store_n(&threaded->mrb_waiting, 0, __ATOMIC_SEQ_CST);
+  if (threaded->context->err) {
+    mrb_hiredis_check_error(mrb, threaded->context);
+  }
+  mrb_raise(mrb, E_IO_ERROR, "closed stream");
+}
+
+/* sleeps until the I/O thread made progress, mrb_waiting has to be set */
+static void
+mrb_hiredis_threaded_wait(mrb_state *mrb, mrb_hiredis_threaded *threaded)
+{
+  int timeout = -1;
+  const struct timeval *tv = threaded->context->command_timeout;
+  if (tv && (tv->tv_sec || tv->tv_usec)) {
+    timeout = (int) (tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000);
+  }
+  struct pollfd pfd = { threaded->wake_mrb[0], POLLIN, 0 };
+  int rc;
+  while ((rc = poll(&pfd, 1, timeout)) == -1 && errno == EINTR);
+  __atomic_store_n(&threaded->mrb_waiting, 0, __ATOMIC_SEQ_CST);
+  if (unlikely(rc == 0)) {
+    /* replies still in flight would be handed to the next caller, so the connection is done */
+    mrb_hiredis_threaded_stop(threaded);
+    threaded->pending = 0;
+    if (threaded->context->err == 0) {
+      threaded->context->err = REDIS_ERR_TIMEOUT;
+      strcpy(threaded->context->errstr, "timeout waiting for a reply, close it and create a new Hiredis::Threaded");
+    }
+    mrb_hiredis_threaded_fail(mrb, threaded);
+  }
+  mrb_hiredis_threaded_drain(threaded->wake_mrb[0]);
+}
+
+/* appends the RESP of a command, returns NULL and leaves buf as it was when out of memory */
+static sds
+mrb_hiredis_sds_command(sds buf, int argc, const char **argv, const size_t *argvlen)
+{
+  char head[32];
+  size_t total = (size_t) snprintf(head, sizeof(head), "*%d\r\n", argc);
+  int i;
+  for (i = 0; i < argc; i++) {
+    total += (size_t) snprintf(head, sizeof(head), "$%zu\r\n", argvlen[i]) + argvlen[i] + 2;
+  }
+  sds grown = sdsMakeRoomFor(buf, total);
+  if (unlikely(!grown)) {
+    return NULL;
+  }
+  char *p = grown + sdslen(grown);
+  p += sprintf(p, "*%d\r\n", argc);
+  for (i = 0; i < argc; i++) {
+    p += sprintf(p, "$%zu\r\n", argvlen[i]);
+    memcpy(p, argv[i], argvlen[i]);
+    p += argvlen[i];
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+  sdsIncrLen(grown, (ssize_t) total);
+  return grown;
+}
+
+static void
+mrb_hiredis_threaded_append(mrb_state *mrb, mrb_hiredis_threaded *threaded, mrb_sym command, const mrb_value *mrb_argv, mrb_int argc)
+{
+  if (unlikely(__atomic_load_n(&threaded->stopped, __ATOMIC_ACQUIRE))) {
+    mrb_hiredis_threaded_fail(mrb, threaded);
+  }
+  mrb_int pending;
+  if (unlikely(mrb_int_add_overflow(threaded->pending, 1, &pending))) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "integer addition would overflow");
+  }
+  argc = mrb_hiredis_generate_argv(mrb, &threaded->argv, command, mrb_argv, argc);
+  if (!threaded->obuf && unlikely(!(threaded->obuf = sdsempty()))) {
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->nomem_err));
+  }
+  sds obuf = mrb_hiredis_sds_command(threaded->obuf, (int) argc, threaded->argv.argv, threaded->argv.argvlen);
+  if (unlikely(!obuf)) {
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->nomem_err));
+  }
+  threaded->obuf = obuf;
+  threaded->pending = pending;
+}
 
+/* hands the commands queued so far to the I/O thread */
+static void
+mrb_hiredis_threaded_flush(mrb_state *mrb, mrb_hiredis_threaded *threaded)
+{
+  if (!threaded->obuf || sdslen(threaded->obuf) == 0) {
+    return;
+  }
+  for (;;) {
+    if (unlikely(__atomic_load_n(&threaded->stopped, __ATOMIC_ACQUIRE))) {
+      mrb_hiredis_threaded_fail(mrb, threaded);
+    }
+    if (likely(mrb_hiredis_ring_push(&threaded->requests, threaded->obuf))) {
+      break;
+    }
+    __atomic_store_n(&threaded->mrb_waiting, 1, __ATOMIC_SEQ_CST);
+    if (mrb_hiredis_ring_full(&threaded->requests)) {
+      mrb_hiredis_threaded_wait(mrb, threaded);
     } else {
-      rc = redisAsyncCommandArgv(async_context, NULL, NULL, argc, argv, argvlen);
-      mrb_free(mrb, argv);
-      mrb_free(mrb, argvlen);
+      __atomic_store_n(&threaded->mrb_waiting, 0, __ATOMIC_SEQ_CST);
     }
+  }
+  threaded->obuf = NULL;
+  char byte = 0;
+  while (write(threaded->wake_io[1], &byte, 1) == -1 && errno == EINTR);
+}
 
-    if (likely(rc == REDIS_OK)) {
-      return self;
+static mrb_value
+mrb_hiredis_threaded_take(mrb_state *mrb, mrb_hiredis_threaded *threaded)
+{
+  redisReply *reply;
+  for (;;) {
+    mrb_bool stopped = __atomic_load_n(&threaded->stopped, __ATOMIC_ACQUIRE);
+    if ((reply = (redisReply *) mrb_hiredis_ring_pop(&threaded->replies))) {
+      break;
+    }
+    if (unlikely(stopped)) {
+      mrb_hiredis_threaded_fail(mrb, threaded);
+    }
+    __atomic_store_n(&threaded->mrb_waiting, 1, __ATOMIC_SEQ_CST);
+    if (mrb_hiredis_ring_empty(&threaded->replies)) {
+      mrb_hiredis_threaded_wait(mrb, threaded);
     } else {
-      mrb_hiredis_check_error(mrb, &async_context->c);
-      return mrb_false_value();
+      __atomic_store_n(&threaded->mrb_waiting, 0, __ATOMIC_SEQ_CST);
     }
+  }
+  mrb_hiredis_threaded_wake(&threaded->io_waiting, threaded->wake_io[1]);
+  threaded->pending--;
 
-  } else {
-    mrb_raise(mrb, E_IO_ERROR, "closed stream");
-    return mrb_false_value();
+  mrb_value value = mrb_hiredis_get_reply(reply, mrb, &threaded->intern);
+  freeReplyObject(reply);
+  return value;
+}
+
+static mrb_value
+mrb_hiredis_threaded_queue(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_threaded *threaded = mrb_hiredis_threaded_get(mrb, self);
+  mrb_sym command;
+  mrb_value *mrb_argv = NULL;
+  mrb_int argc = 0;
+
+  mrb_get_args(mrb, "n*", &command, &mrb_argv, &argc);
+
+  mrb_hiredis_threaded_append(mrb, threaded, command, mrb_argv, argc);
+  return self;
+}
+
+static mrb_value
+mrb_hiredis_threaded_call(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_threaded *threaded = mrb_hiredis_threaded_get(mrb, self);
+  mrb_sym command;
+  mrb_value *mrb_argv = NULL;
+  mrb_int argc = 0;
+
+  mrb_get_args(mrb, "n*", &command, &mrb_argv, &argc);
+
+  mrb_hiredis_threaded_append(mrb, threaded, command, mrb_argv, argc);
+  mrb_hiredis_threaded_flush(mrb, threaded);
+  return mrb_hiredis_threaded_take(mrb, threaded);
+}
+
+static mrb_value
+mrb_hiredis_threaded_flush_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_threaded_flush(mrb, mrb_hiredis_threaded_get(mrb, self));
+  return self;
+}
+
+static mrb_value
+mrb_hiredis_threaded_reply(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_threaded *threaded = mrb_hiredis_threaded_get(mrb, self);
+  if (unlikely(threaded->pending == 0)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "nothing queued yet");
   }
+  mrb_hiredis_threaded_flush(mrb, threaded);
+  return mrb_hiredis_threaded_take(mrb, threaded);
 }
 
 static mrb_value
-mrb_redisAsyncDisconnect(mrb_state *mrb, mrb_value self)
+mrb_hiredis_threaded_bulk_reply(mrb_state *mrb, mrb_value self)
 {
-  redisAsyncContext *async_context = (redisAsyncContext *) DATA_PTR(self);
-  if (likely(async_context)) {
-    redisAsyncDisconnect(async_context);
-    return mrb_nil_value();
-  } else {
-    mrb_raise(mrb, E_IO_ERROR, "closed stream");
-    return mrb_false_value();
+  mrb_hiredis_threaded *threaded = mrb_hiredis_threaded_get(mrb, self);
+  mrb_int pending = threaded->pending;
+  if (unlikely(pending == 0)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "nothing queued yet");
+  }
+  mrb_hiredis_threaded_flush(mrb, threaded);
+  mrb_value bulk_reply = mrb_ary_new_capa(mrb, pending);
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_int i;
+  for (i = 0; i < pending; i++) {
+    mrb_ary_push(mrb, bulk_reply, mrb_hiredis_threaded_take(mrb, threaded));
+    mrb_gc_arena_restore(mrb, ai);
   }
+  return bulk_reply;
+}
+
+static mrb_value
+mrb_hiredis_threaded_pending(mrb_state *mrb, mrb_value self)
+{
+  return mrb_int_value(mrb, mrb_hiredis_threaded_get(mrb, self)->pending);
+}
+
+static mrb_value
+mrb_hiredis_threaded_free_m(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_threaded_free(mrb, mrb_hiredis_threaded_get(mrb, self));
+  mrb_data_init(self, NULL, NULL);
+  return mrb_nil_value();
 }
 
 void
 mrb_mruby_hiredis_gem_init(mrb_state* mrb)
 { 
-  struct RClass *hiredis_class, *hiredis_error_class, *hiredis_async_class;
+  struct RClass *hiredis_class, *hiredis_error_class, *hiredis_reply_class, *hiredis_cluster_class, *hiredis_async_class, *hiredis_reader_class;
+  struct RClass *hiredis_command_class, *hiredis_pipeline_class, *hiredis_cluster_pipeline_class, *hiredis_script_class;
+  struct RClass *hiredis_fiber_client_class, *hiredis_threaded_class;
+  size_t i;
   hiredis_class = mrb_define_class(mrb, "Hiredis", mrb->object_class);
   MRB_SET_INSTANCE_TT(hiredis_class, MRB_TT_DATA);
 
@@ -724,25 +3526,113 @@ mrb_mruby_hiredis_gem_init(mrb_state* mrb)
   mrb_define_class_under(mrb, hiredis_class, "ProtocolError", hiredis_error_class);
   mrb_define_class_under(mrb, hiredis_class, "OOMError",      hiredis_error_class);
 
-  mrb_define_method(mrb, hiredis_class, "initialize", mrb_redisConnect,           MRB_ARGS_OPT(2));
+  mrb_define_method(mrb, hiredis_class, "initialize", mrb_redisConnect,           MRB_ARGS_OPT(3));
   mrb_define_method(mrb, hiredis_class, "free",       mrb_redisFree,              MRB_ARGS_NONE());
   mrb_define_alias (mrb, hiredis_class, "close", "free");
   mrb_define_method(mrb, hiredis_class, "call",       mrb_redisCommandArgv,       (MRB_ARGS_REQ(1)|MRB_ARGS_REST()));
+  mrb_define_method(mrb, hiredis_class, "call_lazy",  mrb_redisCommandArgvLazy,   (MRB_ARGS_REQ(1)|MRB_ARGS_REST()));
+  mrb_define_method(mrb, hiredis_class, "call_each",  mrb_redisCommandArgvEach,   (MRB_ARGS_REQ(1)|MRB_ARGS_REST()|MRB_ARGS_BLOCK()));
+  mrb_define_method(mrb, hiredis_class, "stream_get", mrb_hiredis_stream_get,     MRB_ARGS_REQ(3));
+  mrb_define_method(mrb, hiredis_class, "stream_set", mrb_hiredis_stream_set,     MRB_ARGS_REQ(4));
+  mrb_define_method(mrb, hiredis_class, "busy",       mrb_hiredis_busy,           MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, hiredis_class, "flush",      mrb_redisBufferWrite,       MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_class, "listen",     mrb_hiredis_listen,         (MRB_ARGS_REQ(1)|MRB_ARGS_REST()|MRB_ARGS_BLOCK()));
+  mrb_define_method(mrb, hiredis_class, "dispatch",   mrb_hiredis_dispatch,       MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_class, "setup_cache",       mrb_hiredis_setup_cache,       MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, hiredis_class, "teardown_cache",    mrb_hiredis_teardown_cache,    MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_class, "cache_stats",       mrb_hiredis_cache_stats,       MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_class, "reset_cache_stats", mrb_hiredis_reset_cache_stats, MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_class, "stats",             mrb_hiredis_stats_m,           MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_class, "reset_stats",       mrb_hiredis_reset_stats,       MRB_ARGS_NONE());
   mrb_define_method(mrb, hiredis_class, "queue",      mrb_redisAppendCommandArgv, (MRB_ARGS_REQ(1)|MRB_ARGS_REST()));
+  mrb_define_method(mrb, hiredis_class, "call_formatted",  mrb_hiredis_call_formatted,  (MRB_ARGS_REQ(1)|MRB_ARGS_REST()));
+  mrb_define_method(mrb, hiredis_class, "queue_formatted", mrb_hiredis_queue_formatted, (MRB_ARGS_REQ(1)|MRB_ARGS_REST()));
   mrb_define_method(mrb, hiredis_class, "reply",      mrb_redisGetReply,          MRB_ARGS_NONE());
   mrb_define_method(mrb, hiredis_class, "bulk_reply", mrb_redisGetBulkReply,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_class, "pending",    mrb_hiredis_pending,        MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_class, "closed?",    mrb_hiredis_closed_p,       MRB_ARGS_NONE());
 #if ((HIREDIS_MAJOR == 0) && (HIREDIS_MINOR >= 13) || (HIREDIS_MAJOR > 0))
   mrb_define_method(mrb, hiredis_class, "reconnect",  mrb_redisReconnect,         MRB_ARGS_NONE());
 #endif
+  for (i = 0; i < sizeof(mrb_hiredis_commands) / sizeof(mrb_hiredis_commands[0]); i++) {
+    mrb_define_method(mrb, hiredis_class, mrb_hiredis_commands[i], mrb_hiredis_command_method, MRB_ARGS_ANY());
+  }
+
+  hiredis_reply_class = mrb_define_class_under(mrb, hiredis_class, "Reply", mrb->object_class);
+  MRB_SET_INSTANCE_TT(hiredis_reply_class, MRB_TT_DATA);
+  mrb_undef_class_method(mrb, hiredis_reply_class, "new");
+  mrb_define_method(mrb, hiredis_reply_class, "size",       mrb_hiredis_lazy_reply_size,      MRB_ARGS_NONE());
+  mrb_define_alias (mrb, hiredis_reply_class, "length", "size");
+  mrb_define_method(mrb, hiredis_reply_class, "[]",         mrb_hiredis_lazy_reply_aref,      MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, hiredis_reply_class, "each",       mrb_hiredis_lazy_reply_each,      MRB_ARGS_BLOCK());
+  mrb_define_method(mrb, hiredis_reply_class, "to_a",       mrb_hiredis_lazy_reply_to_a,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_reply_class, "free",       mrb_hiredis_lazy_reply_free_m,    MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_reply_class, "consumed?",  mrb_hiredis_lazy_reply_consumed,  MRB_ARGS_NONE());
+
+  hiredis_command_class = mrb_define_class_under(mrb, hiredis_class, "Command", mrb->object_class);
+  MRB_SET_INSTANCE_TT(hiredis_command_class, MRB_TT_DATA);
+  mrb_define_method(mrb, hiredis_command_class, "initialize", mrb_hiredis_command_initialize, MRB_ARGS_ANY());
+  mrb_define_method(mrb, hiredis_command_class, "format",     mrb_hiredis_command_format,     MRB_ARGS_ANY());
+  mrb_define_method(mrb, hiredis_command_class, "arity",      mrb_hiredis_command_arity,      MRB_ARGS_NONE());
+
+  hiredis_script_class = mrb_define_class_under(mrb, hiredis_class, "Script", mrb->object_class);
+  mrb_define_class_method(mrb, hiredis_script_class, "digest", mrb_hiredis_script_digest, MRB_ARGS_REQ(1));
+
+  hiredis_reader_class = mrb_define_class_under(mrb, hiredis_class, "Reader", mrb->object_class);
+  MRB_SET_INSTANCE_TT(hiredis_reader_class, MRB_TT_DATA);
+  mrb_define_method(mrb, hiredis_reader_class, "initialize", mrb_hiredis_reader_initialize, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, hiredis_reader_class, "feed",       mrb_hiredis_reader_feed,       MRB_ARGS_REQ(1));
+  mrb_define_method(mrb, hiredis_reader_class, "gets",       mrb_hiredis_reader_gets,       MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_reader_class, "has_reply?", mrb_hiredis_reader_has_reply,  MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_reader_class, "free",       mrb_hiredis_reader_free_m,     MRB_ARGS_NONE());
+  mrb_define_alias (mrb, hiredis_reader_class, "close", "free");
+
+  hiredis_cluster_class = mrb_define_class_under(mrb, hiredis_class, "Cluster", mrb->object_class);
+  mrb_define_const(mrb, hiredis_cluster_class, "SLOTS", mrb_int_value(mrb, MRB_HIREDIS_CLUSTER_SLOTS));
+  mrb_define_class_method(mrb, hiredis_cluster_class, "key_slot", mrb_hiredis_cluster_key_slot, MRB_ARGS_REQ(1));
+  hiredis_pipeline_class = mrb_define_class_under(mrb, hiredis_class, "Pipeline", mrb->object_class);
+  hiredis_cluster_pipeline_class = mrb_define_class_under(mrb, hiredis_cluster_class, "Pipeline", mrb->object_class);
+  hiredis_fiber_client_class = mrb_define_class_under(mrb, hiredis_class, "FiberClient", mrb->object_class);
+  hiredis_threaded_class = mrb_define_class_under(mrb, hiredis_class, "Threaded", mrb->object_class);
+  for (i = 0; i < sizeof(mrb_hiredis_commands) / sizeof(mrb_hiredis_commands[0]); i++) {
+    mrb_define_method(mrb, hiredis_cluster_class,          mrb_hiredis_commands[i], mrb_hiredis_forward_call,  MRB_ARGS_ANY());
+    mrb_define_method(mrb, hiredis_fiber_client_class,     mrb_hiredis_commands[i], mrb_hiredis_forward_call,  MRB_ARGS_ANY());
+    mrb_define_method(mrb, hiredis_threaded_class,         mrb_hiredis_commands[i], mrb_hiredis_forward_call,  MRB_ARGS_ANY());
+    mrb_define_method(mrb, hiredis_pipeline_class,         mrb_hiredis_commands[i], mrb_hiredis_forward_queue, MRB_ARGS_ANY());
+    mrb_define_method(mrb, hiredis_cluster_pipeline_class, mrb_hiredis_commands[i], mrb_hiredis_forward_queue, MRB_ARGS_ANY());
+  }
+
+  MRB_SET_INSTANCE_TT(hiredis_threaded_class, MRB_TT_DATA);
+  mrb_define_method(mrb, hiredis_threaded_class, "initialize", mrb_hiredis_threaded_initialize, MRB_ARGS_OPT(3));
+  mrb_define_method(mrb, hiredis_threaded_class, "call",       mrb_hiredis_threaded_call,       (MRB_ARGS_REQ(1)|MRB_ARGS_REST()));
+  mrb_define_method(mrb, hiredis_threaded_class, "queue",      mrb_hiredis_threaded_queue,      (MRB_ARGS_REQ(1)|MRB_ARGS_REST()));
+  mrb_define_method(mrb, hiredis_threaded_class, "flush",      mrb_hiredis_threaded_flush_m,    MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_threaded_class, "reply",      mrb_hiredis_threaded_reply,      MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_threaded_class, "bulk_reply", mrb_hiredis_threaded_bulk_reply, MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_threaded_class, "pending",    mrb_hiredis_threaded_pending,    MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_threaded_class, "free",       mrb_hiredis_threaded_free_m,     MRB_ARGS_NONE());
+  mrb_define_alias (mrb, hiredis_threaded_class, "close", "free");
 
   hiredis_async_class = mrb_define_class_under(mrb, hiredis_class, "Async", mrb->object_class);
   MRB_SET_INSTANCE_TT(hiredis_async_class, MRB_TT_DATA);
-  mrb_define_method(mrb, hiredis_async_class, "initialize", mrb_redisAsyncConnect,      MRB_ARGS_ARG(2, 2));
+  mrb_define_method(mrb, hiredis_async_class, "initialize", mrb_redisAsyncConnect,      MRB_ARGS_OPT(5));
   mrb_define_method(mrb, hiredis_async_class, "read",       mrb_redisAsyncHandleRead,   MRB_ARGS_NONE());
   mrb_define_method(mrb, hiredis_async_class, "write",      mrb_redisAsyncHandleWrite,  MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_async_class, "handle_timeout", mrb_redisAsyncHandleTimeout, MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_async_class, "stats",      mrb_redisAsyncStats,        MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_async_class, "reset_stats", mrb_redisAsyncResetStats,  MRB_ARGS_NONE());
   mrb_define_method(mrb, hiredis_async_class, "queue",      mrb_redisAsyncCommandArgv,  (MRB_ARGS_REQ(1)|MRB_ARGS_REST()|MRB_ARGS_BLOCK()));
+  mrb_define_method(mrb, hiredis_async_class, "queue_formatted", mrb_redisAsyncFormattedCommand, (MRB_ARGS_REQ(1)|MRB_ARGS_REST()|MRB_ARGS_BLOCK()));
+  mrb_define_method(mrb, hiredis_async_class, "setup_cork", mrb_hiredis_async_setup_cork, MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, hiredis_async_class, "uncork",     mrb_hiredis_async_uncork,   MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_async_class, "flush",      mrb_hiredis_async_flush,    MRB_ARGS_NONE());
+  mrb_define_method(mrb, hiredis_async_class, "corked?",    mrb_hiredis_async_corked_p, MRB_ARGS_NONE());
   mrb_define_method(mrb, hiredis_async_class, "disconnect", mrb_redisAsyncDisconnect,   MRB_ARGS_NONE());
   mrb_define_alias (mrb, hiredis_async_class, "close", "disconnect");
+
+#ifdef MRB_HIREDIS_BENCH
+  mrb_hiredis_mock_init(mrb, hiredis_class);
+#endif
 }
 
 void mrb_mruby_hiredis_gem_final(mrb_state* mrb) {}
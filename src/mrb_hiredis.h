@@ -18,6 +18,28 @@
 #include <strings.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+#include <mruby/proc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#if defined(__linux__) && !defined(MRB_HIREDIS_NO_EPOLL)
+#define MRB_HIREDIS_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
 
 #if (MRB_INT_BIT < 64)
   #error "mruby-hiredis: MRB_INT64 must be defined in mrbconf.h"
@@ -41,85 +63,2541 @@ static const struct mrb_data_type mrb_redisContext_type = {
   "$i_mrb_redisContext_type", mrb_redisFree_gc
 };
 
+#define MRB_HIREDIS_NUMBUF_SIZE 32
+#define MRB_HIREDIS_MAX_ARGV_DEPTH 16
+
+/* Scratch space for command arguments, kept per connection and grown on
+ * demand. Integers and Floats are formatted into numbuf, one
+ * MRB_HIREDIS_NUMBUF_SIZE slot per argument, everything else points
+ * straight at the mruby String or Symbol name. */
 typedef struct {
-  mrb_value self;
-  redisReply *reply;
-} mrb_redisGetReply_cb_data;
+  const char **argv;
+  size_t *argvlen;
+  char *numbuf;
+  size_t capa;
+} mrb_hiredis_argv;
 
-static const struct mrb_data_type mrb_redisCallbackFn_cb_data_type = {
-  "$i_mrb_redisCallbackFn_cb_data_type", mrb_free
-};
+static void
+mrb_hiredis_argv_free(mrb_state *mrb, mrb_hiredis_argv *mrb_argv)
+{
+  mrb_free(mrb, mrb_argv->argv);
+  mrb_free(mrb, mrb_argv->argvlen);
+  mrb_free(mrb, mrb_argv->numbuf);
+  mrb_argv->argv = NULL;
+  mrb_argv->argvlen = NULL;
+  mrb_argv->numbuf = NULL;
+  mrb_argv->capa = 0;
+}
+
+static void
+mrb_hiredis_argv_reserve(mrb_state *mrb, mrb_hiredis_argv *mrb_argv, mrb_int argc)
+{
+  if (likely((size_t) argc <= mrb_argv->capa)) {
+    return;
+  }
+
+  size_t capa = mrb_argv->capa ? mrb_argv->capa : 16;
+  while (capa < (size_t) argc) {
+    capa *= 2;
+  }
+  if (unlikely(capa > SIZE_MAX / MRB_HIREDIS_NUMBUF_SIZE)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot allocate argv array");
+  }
+
+  mrb_argv->argv = (const char **) mrb_realloc(mrb, mrb_argv->argv, capa * sizeof(*mrb_argv->argv));
+  mrb_argv->argvlen = (size_t *) mrb_realloc(mrb, mrb_argv->argvlen, capa * sizeof(*mrb_argv->argvlen));
+  mrb_argv->numbuf = (char *) mrb_realloc(mrb, mrb_argv->numbuf, capa * MRB_HIREDIS_NUMBUF_SIZE);
+  mrb_argv->capa = capa;
+}
+
+static mrb_int
+mrb_hiredis_argv_count(mrb_state *mrb, mrb_value arg, int depth)
+{
+  switch (mrb_type(arg)) {
+    case MRB_TT_ARRAY: {
+      if (unlikely(depth >= MRB_HIREDIS_MAX_ARGV_DEPTH)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "argument nesting too deep");
+      }
+      mrb_int argc = 0;
+      mrb_int i;
+      for (i = 0; i < RARRAY_LEN(arg); i++) {
+        argc += mrb_hiredis_argv_count(mrb, RARRAY_PTR(arg)[i], depth + 1);
+      }
+      return argc;
+    }
+    case MRB_TT_HASH:
+      return mrb_hash_size(mrb, arg) * 2;
+    default:
+      return 1;
+  }
+}
+
+static void
+mrb_hiredis_argv_set(mrb_state *mrb, mrb_hiredis_argv *mrb_argv, mrb_int i, mrb_value arg)
+{
+  switch (mrb_type(arg)) {
+    case MRB_TT_STRING:
+      mrb_argv->argv[i] = RSTRING_PTR(arg);
+      mrb_argv->argvlen[i] = RSTRING_LEN(arg);
+      break;
+    case MRB_TT_SYMBOL: {
+      mrb_int len;
+      mrb_argv->argv[i] = mrb_sym2name_len(mrb, mrb_symbol(arg), &len);
+      mrb_argv->argvlen[i] = len;
+    } break;
+    case MRB_TT_INTEGER: {
+      char *buf = mrb_argv->numbuf + i * MRB_HIREDIS_NUMBUF_SIZE;
+      mrb_argv->argv[i] = buf;
+      mrb_argv->argvlen[i] = snprintf(buf, MRB_HIREDIS_NUMBUF_SIZE, "%" MRB_PRId, mrb_integer(arg));
+    } break;
+    case MRB_TT_FLOAT: {
+      /* shortest "%g" that reads back to the same double, like Float#to_s */
+      char *buf = mrb_argv->numbuf + i * MRB_HIREDIS_NUMBUF_SIZE;
+      mrb_float f = mrb_float(arg);
+      int len = 0;
+      int precision;
+      for (precision = 15; precision <= 17; precision++) {
+        len = snprintf(buf, MRB_HIREDIS_NUMBUF_SIZE, "%.*g", precision, (double) f);
+        if (strtod(buf, NULL) == f) {
+          break;
+        }
+      }
+      if (len + 2 < MRB_HIREDIS_NUMBUF_SIZE && strpbrk(buf, ".eni") == NULL) {
+        buf[len++] = '.';
+        buf[len++] = '0';
+        buf[len] = '\0';
+      }
+      mrb_argv->argv[i] = buf;
+      mrb_argv->argvlen[i] = len;
+    } break;
+    default: {
+      mrb_value str = mrb_str_to_str(mrb, arg);
+      mrb_argv->argv[i] = RSTRING_PTR(str);
+      mrb_argv->argvlen[i] = RSTRING_LEN(str);
+    }
+  }
+}
 
 typedef struct {
-  const mrb_sym command;
-  const mrb_value *mrb_argv;
-  mrb_int *argc_p;
-  const char ***argv_p;
-  size_t **argvlen_p;
-} mrb_hiredis_generate_argv_argc_array_cb_data;
+  mrb_hiredis_argv *mrb_argv;
+  mrb_int argc;
+  mrb_int capa;
+} mrb_hiredis_argv_fill_data;
 
-MRB_INLINE mrb_value
-mrb_hiredis_generate_argv_argc_array_cb(mrb_state *mrb, const mrb_value command_argv_argc)
-{
-  mrb_hiredis_generate_argv_argc_array_cb_data *cb_data = (mrb_hiredis_generate_argv_argc_array_cb_data *) mrb_cptr(command_argv_argc);
-  *cb_data->argv_p = NULL;
-  *cb_data->argvlen_p = NULL;
-  *cb_data->argc_p += 1;
-  if (likely((*cb_data->argc_p <= SIZE_MAX / sizeof(const char *)) && (*cb_data->argc_p <= SIZE_MAX / sizeof(size_t)))) {
-    const char **argv = *cb_data->argv_p = mrb_malloc(mrb, *cb_data->argc_p * sizeof(*argv));
-    size_t *argvlen = *cb_data->argvlen_p = mrb_malloc(mrb, *cb_data->argc_p * sizeof(*argvlen));
-    mrb_int command_len;
-    argv[0] = mrb_sym2name_len(mrb, cb_data->command, &command_len);
-    argvlen[0] = command_len;
-
-    mrb_int argc_current;
-    for (argc_current = 1; argc_current < *cb_data->argc_p; argc_current++) {
-      mrb_value curr = mrb_str_to_str(mrb, cb_data->mrb_argv[argc_current - 1]);
-      argv[argc_current] = RSTRING_PTR(curr);
-      argvlen[argc_current] = RSTRING_LEN(curr);
+static void
+mrb_hiredis_argv_fill(mrb_state *mrb, mrb_hiredis_argv_fill_data *fill_data, mrb_value arg);
+
+static int
+mrb_hiredis_argv_fill_pair(mrb_state *mrb, mrb_value key, mrb_value val, void *data)
+{
+  mrb_hiredis_argv_fill_data *fill_data = (mrb_hiredis_argv_fill_data *) data;
+  if (unlikely(fill_data->argc + 2 > fill_data->capa)) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "hash modified during command encoding");
+  }
+  mrb_hiredis_argv_set(mrb, fill_data->mrb_argv, fill_data->argc++, key);
+  mrb_hiredis_argv_set(mrb, fill_data->mrb_argv, fill_data->argc++, val);
+  return 0;
+}
+
+static void
+mrb_hiredis_argv_fill(mrb_state *mrb, mrb_hiredis_argv_fill_data *fill_data, mrb_value arg)
+{
+  switch (mrb_type(arg)) {
+    case MRB_TT_ARRAY: {
+      mrb_int i;
+      for (i = 0; i < RARRAY_LEN(arg); i++) {
+        mrb_hiredis_argv_fill(mrb, fill_data, RARRAY_PTR(arg)[i]);
+      }
+    } break;
+    case MRB_TT_HASH:
+      mrb_hash_foreach(mrb, mrb_hash_ptr(arg), mrb_hiredis_argv_fill_pair, fill_data);
+      break;
+    default:
+      if (unlikely(fill_data->argc >= fill_data->capa)) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "array modified during command encoding");
+      }
+      mrb_hiredis_argv_set(mrb, fill_data->mrb_argv, fill_data->argc++, arg);
+  }
+}
+
+/* Encodes command and arguments into the connection's scratch argv, Arrays
+ * are flattened and Hashes expanded into key value pairs. Returns argc. */
+static mrb_int
+mrb_hiredis_generate_argv(mrb_state *mrb, mrb_hiredis_argv *mrb_argv, mrb_sym command, const mrb_value *argv, mrb_int argc)
+{
+  mrb_int capa = 1;
+  mrb_int i;
+  for (i = 0; i < argc; i++) {
+    capa += mrb_hiredis_argv_count(mrb, argv[i], 0);
+  }
+  mrb_hiredis_argv_reserve(mrb, mrb_argv, capa);
+
+  mrb_int command_len;
+  mrb_argv->argv[0] = mrb_sym2name_len(mrb, command, &command_len);
+  mrb_argv->argvlen[0] = command_len;
+
+  mrb_hiredis_argv_fill_data fill_data = { mrb_argv, 1, capa };
+  for (i = 0; i < argc; i++) {
+    mrb_hiredis_argv_fill(mrb, &fill_data, argv[i]);
+  }
+
+  return fill_data.argc;
+}
+
+/* A command encoded to RESP once. Placeholders (:_) leave a hole at their
+ * offset in resp, the values for them are spliced in per call into buf,
+ * which is handed to redisAppendFormattedCommand and reused afterwards. */
+typedef struct {
+  char *resp;
+  size_t len;
+  size_t capa;
+  size_t *holes;
+  mrb_int holes_len;
+  size_t name_offset;
+  size_t name_len;
+  char *buf;
+  size_t buf_capa;
+} mrb_hiredis_command;
+
+static void
+mrb_hiredis_command_free(mrb_state *mrb, void *p)
+{
+  mrb_hiredis_command *command = (mrb_hiredis_command *) p;
+  mrb_free(mrb, command->resp);
+  mrb_free(mrb, command->holes);
+  mrb_free(mrb, command->buf);
+  mrb_free(mrb, command);
+}
+
+static const struct mrb_data_type mrb_hiredis_command_type = {
+  "$i_mrb_hiredis_command_type", mrb_hiredis_command_free
+};
+
+static char *
+mrb_hiredis_command_reserve(mrb_state *mrb, char **buf, size_t *capa, size_t len)
+{
+  if (len > *capa) {
+    size_t new_capa = *capa ? *capa : 64;
+    while (new_capa < len) {
+      new_capa *= 2;
     }
-  } else {
-    mrb_raise(mrb, E_RUNTIME_ERROR, "Cannot allocate argv array");
+    *buf = (char *) mrb_realloc(mrb, *buf, new_capa);
+    *capa = new_capa;
   }
+  return *buf;
+}
+
+/* writes one bulk string, buf must have room for len + MRB_HIREDIS_NUMBUF_SIZE + 4 bytes */
+MRB_INLINE size_t
+mrb_hiredis_command_bulk(char *buf, const char *data, size_t len)
+{
+  size_t n = (size_t) snprintf(buf, MRB_HIREDIS_NUMBUF_SIZE + 1, "$%zu\r\n", len);
+  memcpy(buf + n, data, len);
+  n += len;
+  buf[n++] = '\r';
+  buf[n++] = '\n';
+  return n;
+}
 
-  return mrb_nil_value();
+static int
+mrb_hiredis_command_flatten_pair(mrb_state *mrb, mrb_value key, mrb_value val, void *data)
+{
+  mrb_value flat = *(mrb_value *) data;
+  mrb_ary_push(mrb, flat, key);
+  mrb_ary_push(mrb, flat, val);
+  return 0;
+}
+
+/* Arrays and Hashes are expanded the way mrb_hiredis_generate_argv does it */
+static void
+mrb_hiredis_command_flatten(mrb_state *mrb, mrb_value flat, mrb_value arg, int depth)
+{
+  switch (mrb_type(arg)) {
+    case MRB_TT_ARRAY: {
+      if (unlikely(depth >= MRB_HIREDIS_MAX_ARGV_DEPTH)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "argument nesting too deep");
+      }
+      mrb_int i;
+      for (i = 0; i < RARRAY_LEN(arg); i++) {
+        mrb_hiredis_command_flatten(mrb, flat, RARRAY_PTR(arg)[i], depth + 1);
+      }
+    } break;
+    case MRB_TT_HASH:
+      mrb_hash_foreach(mrb, mrb_hash_ptr(arg), mrb_hiredis_command_flatten_pair, &flat);
+      break;
+    default:
+      mrb_ary_push(mrb, flat, arg);
+  }
 }
 
 static void
-mrb_hiredis_generate_argv_argc_array(mrb_state *mrb, const mrb_sym command, const mrb_value *mrb_argv, mrb_int *argc_p, const char ***argv_p, size_t **argvlen_p)
+mrb_hiredis_command_init(mrb_state *mrb, mrb_hiredis_command *command, const mrb_value *args, mrb_int argsc)
+{
+  mrb_value flat = mrb_ary_new_capa(mrb, argsc);
+  mrb_int i;
+  for (i = 0; i < argsc; i++) {
+    mrb_hiredis_command_flatten(mrb, flat, args[i], 0);
+  }
+  const mrb_value *argv = RARRAY_PTR(flat);
+  mrb_int argc = RARRAY_LEN(flat);
+
+  if (unlikely(argc < 1)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "command name missing");
+  }
+  mrb_sym placeholder = mrb_intern_lit(mrb, "_");
+  char numbuf[MRB_HIREDIS_NUMBUF_SIZE];
+  const char *data;
+  size_t len;
+  mrb_hiredis_argv one = { &data, &len, numbuf, 1 };
+
+  mrb_hiredis_command_reserve(mrb, &command->resp, &command->capa, MRB_HIREDIS_NUMBUF_SIZE + 3);
+  command->len = (size_t) snprintf(command->resp, MRB_HIREDIS_NUMBUF_SIZE + 3, "*%" MRB_PRId "\r\n", argc);
+  command->holes = (size_t *) mrb_malloc(mrb, argc * sizeof(size_t));
+
+  for (i = 0; i < argc; i++) {
+    if (mrb_symbol_p(argv[i]) && mrb_symbol(argv[i]) == placeholder) {
+      if (unlikely(i == 0)) {
+        mrb_raise(mrb, E_ARGUMENT_ERROR, "command name can't be a placeholder");
+      }
+      command->holes[command->holes_len++] = command->len;
+      continue;
+    }
+    mrb_hiredis_argv_set(mrb, &one, 0, argv[i]);
+    mrb_hiredis_command_reserve(mrb, &command->resp, &command->capa, command->len + len + MRB_HIREDIS_NUMBUF_SIZE + 4);
+    size_t n = mrb_hiredis_command_bulk(command->resp + command->len, data, len);
+    if (i == 0) {
+      command->name_offset = command->len + n - len - 2;
+      command->name_len = len;
+    }
+    command->len += n;
+  }
+}
+
+/* the RESP of a command with its placeholders filled in */
+static const char *
+mrb_hiredis_command_fill(mrb_state *mrb, mrb_hiredis_command *command, const mrb_value *values, mrb_int valuesc, size_t *len_out)
+{
+  if (unlikely(valuesc != command->holes_len)) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "wrong number of values (given %i, expected %i)", valuesc, command->holes_len);
+  }
+  if (command->holes_len == 0) {
+    *len_out = command->len;
+    return command->resp;
+  }
+
+  char numbuf[MRB_HIREDIS_NUMBUF_SIZE];
+  const char *data;
+  size_t len;
+  mrb_hiredis_argv one = { &data, &len, numbuf, 1 };
+  size_t out = 0;
+  size_t from = 0;
+  mrb_int i;
+  for (i = 0; i < valuesc; i++) {
+    if (unlikely(mrb_array_p(values[i]) || mrb_hash_p(values[i]))) {
+      mrb_raise(mrb, E_TYPE_ERROR, "a placeholder takes a single value, not an Array or Hash");
+    }
+    mrb_hiredis_argv_set(mrb, &one, 0, values[i]);
+    size_t part = command->holes[i] - from;
+    char *buf = mrb_hiredis_command_reserve(mrb, &command->buf, &command->buf_capa,
+      out + part + len + MRB_HIREDIS_NUMBUF_SIZE + 4 + (command->len - command->holes[i]));
+    memcpy(buf + out, command->resp + from, part);
+    out += part;
+    out += mrb_hiredis_command_bulk(buf + out, data, len);
+    from = command->holes[i];
+  }
+  memcpy(command->buf + out, command->resp + from, command->len - from);
+  *len_out = out + command->len - from;
+  return command->buf;
+}
+
+/* finds the command name in preformatted RESP, for the latency histograms */
+static const char *
+mrb_hiredis_formatted_name(const char *resp, size_t len, size_t *name_len)
 {
-  mrb_hiredis_generate_argv_argc_array_cb_data cb_data = {command, mrb_argv, argc_p, argv_p, argvlen_p};
+  const char *end = resp + len;
+  const char *p = (const char *) memchr(resp, '\n', len);
+  if (!p || ++p >= end || *p != '$') {
+    return NULL;
+  }
+  size_t bulk_len = (size_t) strtoul(p + 1, NULL, 10);
+  p = (const char *) memchr(p, '\n', end - p);
+  if (!p || (size_t) (end - ++p) < bulk_len) {
+    return NULL;
+  }
+  *name_len = bulk_len;
+  return p;
+}
 
-  mrb_bool error;
-  mrb_value result = mrb_protect(mrb, mrb_hiredis_generate_argv_argc_array_cb, mrb_cptr_value(mrb, &cb_data), &error);
-  if (unlikely(error)) {
-    mrb_free(mrb, *argv_p);
-    mrb_free(mrb, *argvlen_p);
-    mrb_exc_raise(mrb, result);
+/* a Hiredis::Command with its values or a preformatted RESP String */
+static const char *
+mrb_hiredis_formatted(mrb_state *mrb, mrb_value command, const mrb_value *values, mrb_int valuesc, size_t *len, const char **name, size_t *name_len)
+{
+  if (mrb_string_p(command)) {
+    if (unlikely(valuesc > 0)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "a formatted command takes no values");
+    }
+    *len = RSTRING_LEN(command);
+    *name = mrb_hiredis_formatted_name(RSTRING_PTR(command), *len, name_len);
+    if (unlikely(!*name)) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "not a RESP command");
+    }
+    return RSTRING_PTR(command);
+  }
+  mrb_hiredis_command *prepared = (mrb_hiredis_command *) mrb_data_get_ptr(mrb, command, &mrb_hiredis_command_type);
+  if (unlikely(!prepared)) {
+    mrb_raise(mrb, E_TYPE_ERROR, "expected a Hiredis::Command or a String");
   }
+  const char *resp = mrb_hiredis_command_fill(mrb, prepared, values, valuesc, len);
+  *name = prepared->resp + prepared->name_offset;
+  *name_len = prepared->name_len;
+  return resp;
 }
 
+#define MRB_HIREDIS_HISTOGRAM_SUB_BITS 4
+#define MRB_HIREDIS_HISTOGRAM_SUB (1 << MRB_HIREDIS_HISTOGRAM_SUB_BITS)
+#define MRB_HIREDIS_HISTOGRAM_MAX_BIT 40
+#define MRB_HIREDIS_HISTOGRAM_BUCKETS ((MRB_HIREDIS_HISTOGRAM_MAX_BIT - MRB_HIREDIS_HISTOGRAM_SUB_BITS + 2) * MRB_HIREDIS_HISTOGRAM_SUB)
+#define MRB_HIREDIS_COMMAND_NAME_SIZE 32
+
+/* Log linear latency histogram in nanoseconds, every power of two is split
+ * into 16 buckets, which keeps the error below 6.25% up to about 18 minutes. */
 typedef struct {
-  mrb_state *mrb;
-  mrb_value self;
-  mrb_value callbacks;
-  mrb_value evloop;
-  redisAsyncContext *async_context;
-  mrb_value replies;
-  mrb_value subscriptions;
-} mrb_hiredis_async_context;
+  char name[MRB_HIREDIS_COMMAND_NAME_SIZE];
+  size_t len;
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint32_t buckets[MRB_HIREDIS_HISTOGRAM_BUCKETS];
+} mrb_hiredis_histogram;
+
+/* Per connection counters. The hiredis read/write functions are wrapped
+ * through a copy of redisContextFuncs stored here, the wrappers find their
+ * counters again from the funcs pointer of the context. */
+typedef struct {
+  redisContextFuncs funcs;
+  const redisContextFuncs *orig_funcs;
+  uint64_t commands;
+  uint64_t replies;
+  uint64_t errors;    /* error replies */
+  uint64_t io_errors; /* failures of the connection itself: I/O, EOF, protocol, out of memory */
+  uint64_t bytes_written;
+  uint64_t bytes_read;
+  uint64_t writes;
+  uint64_t reads;
+  uint64_t convert_ns;
+  mrb_int max_pending;
+  mrb_hiredis_histogram **histograms;
+  mrb_int histograms_len;
+  mrb_int last_histogram;
+  uint64_t *starts;     /* send time of every command waiting for its reply */
+  mrb_int *start_histograms;
+  mrb_int starts_capa;
+  mrb_int starts_head;
+  mrb_int starts_len;
+} mrb_hiredis_stats;
+
+MRB_INLINE uint64_t
+mrb_hiredis_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static mrb_int
+mrb_hiredis_histogram_index(uint64_t value)
+{
+  if (value < MRB_HIREDIS_HISTOGRAM_SUB) {
+    return (mrb_int) value;
+  }
+  int bit = 63;
+#if (__GNUC__ >= 4) || defined(__clang__)
+  bit -= __builtin_clzll(value);
+#else
+  while (!(value & (1ULL << bit))) {
+    bit--;
+  }
+#endif
+  if (bit > MRB_HIREDIS_HISTOGRAM_MAX_BIT) {
+    return MRB_HIREDIS_HISTOGRAM_BUCKETS - 1;
+  }
+  return (bit - MRB_HIREDIS_HISTOGRAM_SUB_BITS + 1) * MRB_HIREDIS_HISTOGRAM_SUB +
+    (mrb_int) ((value >> (bit - MRB_HIREDIS_HISTOGRAM_SUB_BITS)) & (MRB_HIREDIS_HISTOGRAM_SUB - 1));
+}
+
+/* highest value which lands in a bucket */
+static uint64_t
+mrb_hiredis_histogram_value(mrb_int index)
+{
+  mrb_int block = index / MRB_HIREDIS_HISTOGRAM_SUB;
+  uint64_t sub = (uint64_t) (index % MRB_HIREDIS_HISTOGRAM_SUB);
+  if (block == 0) {
+    return sub;
+  }
+  int shift = (int) block - 1;
+  return (((MRB_HIREDIS_HISTOGRAM_SUB + sub + 1) << shift) - 1);
+}
+
+static uint64_t
+mrb_hiredis_histogram_percentile(const mrb_hiredis_histogram *histogram, double percentile)
+{
+  uint64_t rank = (uint64_t) (percentile / 100.0 * (double) histogram->count + 0.5);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  mrb_int i;
+  for (i = 0; i < MRB_HIREDIS_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank) {
+      uint64_t value = mrb_hiredis_histogram_value(i);
+      return value < histogram->max ? value : histogram->max;
+    }
+  }
+  return histogram->max;
+}
 
 static void
-mrb_redisAsyncFree_gc(mrb_state *mrb, void *p)
+mrb_hiredis_histogram_record(mrb_hiredis_histogram *histogram, uint64_t ns)
 {
-  redisAsyncContext *async_context = (redisAsyncContext *) p;
-  mrb_free(mrb, async_context->ev.data);
-  async_context->ev.data = NULL;
-  redisAsyncFree(async_context);
+  if (histogram->count == 0 || ns < histogram->min) {
+    histogram->min = ns;
+  }
+  if (ns > histogram->max) {
+    histogram->max = ns;
+  }
+  histogram->count++;
+  histogram->sum += ns;
+  histogram->buckets[mrb_hiredis_histogram_index(ns)]++;
 }
 
-static const struct mrb_data_type mrb_redisAsyncContext_type = {
-  "$i_mrb_redisAsyncContext_type", mrb_redisAsyncFree_gc
+static ssize_t
+mrb_hiredis_stats_read(redisContext *context, char *buf, size_t bufcap);
+
+static ssize_t
+mrb_hiredis_stats_write(redisContext *context);
+
+MRB_INLINE mrb_hiredis_stats *
+mrb_hiredis_stats_of(const redisContext *context)
+{
+  if (context->funcs && context->funcs->read == mrb_hiredis_stats_read) {
+    return (mrb_hiredis_stats *) ((char *) context->funcs - offsetof(mrb_hiredis_stats, funcs));
+  }
+  return NULL;
+}
+
+static ssize_t
+mrb_hiredis_stats_read(redisContext *context, char *buf, size_t bufcap)
+{
+  mrb_hiredis_stats *stats = mrb_hiredis_stats_of(context);
+  ssize_t nread = stats->orig_funcs->read(context, buf, bufcap);
+  stats->reads++;
+  if (nread > 0) {
+    stats->bytes_read += (uint64_t) nread;
+  }
+  return nread;
+}
+
+static ssize_t
+mrb_hiredis_stats_write(redisContext *context)
+{
+  mrb_hiredis_stats *stats = mrb_hiredis_stats_of(context);
+  ssize_t nwritten = stats->orig_funcs->write(context);
+  stats->writes++;
+  if (nwritten > 0) {
+    stats->bytes_written += (uint64_t) nwritten;
+  }
+  return nwritten;
+}
+
+static void
+mrb_hiredis_stats_init(mrb_hiredis_stats *stats)
+{
+  memset(stats, 0, sizeof(mrb_hiredis_stats));
+  stats->last_histogram = -1;
+}
+
+/* redisReconnect may put the default funcs back, so this runs after every connect */
+static void
+mrb_hiredis_stats_install(mrb_hiredis_stats *stats, redisContext *context)
+{
+  if (!context->funcs || context->funcs == &stats->funcs) {
+    return;
+  }
+  stats->orig_funcs = context->funcs;
+  stats->funcs = *context->funcs;
+  stats->funcs.read = mrb_hiredis_stats_read;
+  stats->funcs.write = mrb_hiredis_stats_write;
+  context->funcs = &stats->funcs;
+}
+
+/* hiredis still calls into funcs after our privdata is gone, hand it its own table back first */
+static void
+mrb_hiredis_stats_uninstall(mrb_hiredis_stats *stats, redisContext *context)
+{
+  if (context && context->funcs == &stats->funcs) {
+    context->funcs = stats->orig_funcs;
+  }
+}
+
+static void
+mrb_hiredis_stats_free(mrb_state *mrb, mrb_hiredis_stats *stats)
+{
+  mrb_int i;
+  for (i = 0; i < stats->histograms_len; i++) {
+    mrb_free(mrb, stats->histograms[i]);
+  }
+  mrb_free(mrb, stats->histograms);
+  mrb_free(mrb, stats->starts);
+  mrb_free(mrb, stats->start_histograms);
+}
+
+static void
+mrb_hiredis_stats_reset(mrb_hiredis_stats *stats)
+{
+  stats->commands = stats->replies = stats->errors = stats->io_errors = 0;
+  stats->bytes_written = stats->bytes_read = stats->writes = stats->reads = 0;
+  stats->convert_ns = 0;
+  stats->max_pending = 0;
+  mrb_int i;
+  for (i = 0; i < stats->histograms_len; i++) {
+    mrb_hiredis_histogram *histogram = stats->histograms[i];
+    memset(&histogram->count, 0, sizeof(mrb_hiredis_histogram) - offsetof(mrb_hiredis_histogram, count));
+  }
+}
+
+/* the histogram of a command name, commands repeat so the last one is checked first */
+static mrb_int
+mrb_hiredis_stats_histogram(mrb_state *mrb, mrb_hiredis_stats *stats, const char *name, size_t len)
+{
+  if (len >= MRB_HIREDIS_COMMAND_NAME_SIZE) {
+    len = MRB_HIREDIS_COMMAND_NAME_SIZE - 1;
+  }
+  mrb_int last = stats->last_histogram;
+  if (last != -1 && stats->histograms[last]->len == len && strncasecmp(stats->histograms[last]->name, name, len) == 0) {
+    return last;
+  }
+  mrb_int i;
+  for (i = 0; i < stats->histograms_len; i++) {
+    if (stats->histograms[i]->len == len && strncasecmp(stats->histograms[i]->name, name, len) == 0) {
+      stats->last_histogram = i;
+      return i;
+    }
+  }
+
+  stats->histograms = (mrb_hiredis_histogram **) mrb_realloc(mrb, stats->histograms, (stats->histograms_len + 1) * sizeof(mrb_hiredis_histogram *));
+  mrb_hiredis_histogram *histogram = (mrb_hiredis_histogram *) mrb_calloc(mrb, 1, sizeof(mrb_hiredis_histogram));
+  size_t j;
+  for (j = 0; j < len; j++) {
+    char c = name[j];
+    histogram->name[j] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+  }
+  histogram->len = len;
+  stats->histograms[stats->histograms_len] = histogram;
+  stats->last_histogram = stats->histograms_len;
+  return stats->histograms_len++;
+}
+
+static void
+mrb_hiredis_stats_reserve(mrb_state *mrb, mrb_hiredis_stats *stats, mrb_int capa)
+{
+  if (capa <= stats->starts_capa) {
+    return;
+  }
+  mrb_int new_capa = stats->starts_capa ? stats->starts_capa : 16;
+  while (new_capa < capa) {
+    new_capa *= 2;
+  }
+  uint64_t *starts = (uint64_t *) mrb_malloc(mrb, new_capa * sizeof(uint64_t));
+  mrb_int *start_histograms = (mrb_int *) mrb_malloc(mrb, new_capa * sizeof(mrb_int));
+  /* unwrap the ring so it starts at 0 again, for slot indexed use head stays 0 */
+  mrb_int i;
+  for (i = 0; i < stats->starts_capa; i++) {
+    mrb_int from = (stats->starts_head + i) % stats->starts_capa;
+    starts[i] = stats->starts[from];
+    start_histograms[i] = stats->start_histograms[from];
+  }
+  mrb_free(mrb, stats->starts);
+  mrb_free(mrb, stats->start_histograms);
+  stats->starts = starts;
+  stats->start_histograms = start_histograms;
+  stats->starts_capa = new_capa;
+  stats->starts_head = 0;
+}
+
+/* FIFO of send times for pipelined commands on the sync client */
+static void
+mrb_hiredis_stats_push(mrb_state *mrb, mrb_hiredis_stats *stats, mrb_int histogram, uint64_t start)
+{
+  mrb_hiredis_stats_reserve(mrb, stats, stats->starts_len + 1);
+  mrb_int tail = (stats->starts_head + stats->starts_len) % stats->starts_capa;
+  stats->starts[tail] = start;
+  stats->start_histograms[tail] = histogram;
+  stats->starts_len++;
+}
+
+static void
+mrb_hiredis_stats_pop(mrb_hiredis_stats *stats, uint64_t now)
+{
+  if (stats->starts_len == 0) {
+    return;
+  }
+  mrb_int head = stats->starts_head;
+  mrb_hiredis_histogram_record(stats->histograms[stats->start_histograms[head]], now - stats->starts[head]);
+  stats->starts_head = (head + 1) % stats->starts_capa;
+  stats->starts_len--;
+}
+
+static mrb_value
+mrb_hiredis_stats_to_hash(mrb_state *mrb, const mrb_hiredis_stats *stats)
+{
+  mrb_value hash = mrb_hash_new_capa(mrb, 12);
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "commands")), mrb_int_value(mrb, (mrb_int) stats->commands));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "replies")), mrb_int_value(mrb, (mrb_int) stats->replies));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "errors")), mrb_int_value(mrb, (mrb_int) stats->errors));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "io_errors")), mrb_int_value(mrb, (mrb_int) stats->io_errors));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "bytes_written")), mrb_int_value(mrb, (mrb_int) stats->bytes_written));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "bytes_read")), mrb_int_value(mrb, (mrb_int) stats->bytes_read));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "writes")), mrb_int_value(mrb, (mrb_int) stats->writes));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "reads")), mrb_int_value(mrb, (mrb_int) stats->reads));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "max_pending")), mrb_int_value(mrb, stats->max_pending));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "convert_time")), mrb_float_value(mrb, (mrb_float) stats->convert_ns / 1e9));
+
+  mrb_value latency = mrb_hash_new_capa(mrb, stats->histograms_len);
+  mrb_int i;
+  for (i = 0; i < stats->histograms_len; i++) {
+    const mrb_hiredis_histogram *histogram = stats->histograms[i];
+    if (histogram->count == 0) {
+      continue;
+    }
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_value entry = mrb_hash_new_capa(mrb, 8);
+    mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "count")), mrb_int_value(mrb, (mrb_int) histogram->count));
+    mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "min")), mrb_float_value(mrb, (mrb_float) histogram->min / 1e9));
+    mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "mean")), mrb_float_value(mrb, (mrb_float) histogram->sum / (mrb_float) histogram->count / 1e9));
+    mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "p50")), mrb_float_value(mrb, (mrb_float) mrb_hiredis_histogram_percentile(histogram, 50.0) / 1e9));
+    mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "p90")), mrb_float_value(mrb, (mrb_float) mrb_hiredis_histogram_percentile(histogram, 90.0) / 1e9));
+    mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "p99")), mrb_float_value(mrb, (mrb_float) mrb_hiredis_histogram_percentile(histogram, 99.0) / 1e9));
+    mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "p999")), mrb_float_value(mrb, (mrb_float) mrb_hiredis_histogram_percentile(histogram, 99.9) / 1e9));
+    mrb_hash_set(mrb, entry, mrb_symbol_value(mrb_intern_lit(mrb, "max")), mrb_float_value(mrb, (mrb_float) histogram->max / 1e9));
+    mrb_hash_set(mrb, latency, mrb_str_new(mrb, histogram->name, histogram->len), entry);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  mrb_hash_set(mrb, hash, mrb_symbol_value(mrb_intern_lit(mrb, "latency")), latency);
+
+  return hash;
+}
+
+/* Socket settings hiredis has no redisOptions field for, applied after
+ * every connect. Zero or -1 leaves the system or hiredis default alone. */
+typedef struct {
+  mrb_int keepalive;
+  int nodelay;
+  mrb_int rcvbuf;
+  mrb_int sndbuf;
+  mrb_int maxbuf;
+} mrb_hiredis_socket_options;
+
+static const char *mrb_hiredis_option_names[] = {
+  "connect_timeout", "timeout", "keepalive", "nodelay", "rcvbuf", "sndbuf", "maxbuf", "nonblock", "symbol_keys"
 };
 
+static int
+mrb_hiredis_check_option(mrb_state *mrb, mrb_value key, mrb_value val, void *data)
+{
+  if (mrb_symbol_p(key)) {
+    mrb_int len;
+    const char *name = mrb_sym2name_len(mrb, mrb_symbol(key), &len);
+    size_t i;
+    for (i = 0; i < sizeof(mrb_hiredis_option_names) / sizeof(mrb_hiredis_option_names[0]); i++) {
+      if (strlen(mrb_hiredis_option_names[i]) == (size_t) len && memcmp(name, mrb_hiredis_option_names[i], len) == 0) {
+        return 0;
+      }
+    }
+  }
+  mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown option: %v", key);
+  return 1;
+}
+
+static mrb_value
+mrb_hiredis_option(mrb_state *mrb, mrb_value options, const char *name)
+{
+  return mrb_hash_get(mrb, options, mrb_symbol_value(mrb_intern_cstr(mrb, name)));
+}
+
+static mrb_bool
+mrb_hiredis_option_timeval(mrb_state *mrb, mrb_value options, const char *name, struct timeval *tv)
+{
+  mrb_value value = mrb_hiredis_option(mrb, options, name);
+  double seconds;
+  if (mrb_nil_p(value)) {
+    return FALSE;
+  } else if (mrb_integer_p(value)) {
+    seconds = (double) mrb_integer(value);
+  } else if (mrb_float_p(value)) {
+    seconds = mrb_float(value);
+  } else {
+    mrb_raisef(mrb, E_TYPE_ERROR, "%s must be a number of seconds", name);
+  }
+  if (unlikely(seconds < 0)) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%s can't be negative", name);
+  }
+  tv->tv_sec = (time_t) seconds;
+  tv->tv_usec = (suseconds_t) ((seconds - (double) tv->tv_sec) * 1000000);
+  return TRUE;
+}
+
+static mrb_int
+mrb_hiredis_option_int(mrb_state *mrb, mrb_value options, const char *name, mrb_int dflt)
+{
+  mrb_value value = mrb_hiredis_option(mrb, options, name);
+  if (mrb_nil_p(value)) {
+    return dflt;
+  }
+  if (unlikely(!mrb_integer_p(value) || mrb_integer(value) < 0 || mrb_integer(value) > INT_MAX)) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "%s must be an Integer between 0 and %d", name, INT_MAX);
+  }
+  return mrb_integer(value);
+}
+
+/* Fills redisOptions from the options Hash given to Hiredis.new and
+ * Hiredis::Async.new, the timevals have to outlive the connect call. */
+static void
+mrb_hiredis_parse_options(mrb_state *mrb, mrb_value options, redisOptions *opts,
+  struct timeval *connect_timeout, struct timeval *command_timeout, mrb_hiredis_socket_options *sockopts)
+{
+  sockopts->keepalive = 0;
+  sockopts->nodelay = -1;
+  sockopts->rcvbuf = 0;
+  sockopts->sndbuf = 0;
+  sockopts->maxbuf = -1;
+  if (mrb_nil_p(options)) {
+    return;
+  }
+  mrb_hash_foreach(mrb, mrb_hash_ptr(options), mrb_hiredis_check_option, NULL);
+
+  if (mrb_hiredis_option_timeval(mrb, options, "connect_timeout", connect_timeout)) {
+    opts->connect_timeout = connect_timeout;
+  }
+  if (mrb_hiredis_option_timeval(mrb, options, "timeout", command_timeout)) {
+    opts->command_timeout = command_timeout;
+  }
+  if (mrb_test(mrb_hiredis_option(mrb, options, "nonblock"))) {
+    opts->options |= REDIS_OPT_NONBLOCK;
+  }
+  mrb_value nodelay = mrb_hiredis_option(mrb, options, "nodelay");
+  if (!mrb_nil_p(nodelay)) {
+    sockopts->nodelay = mrb_test(nodelay) ? 1 : 0;
+  }
+  sockopts->keepalive = mrb_hiredis_option_int(mrb, options, "keepalive", 0);
+  sockopts->rcvbuf = mrb_hiredis_option_int(mrb, options, "rcvbuf", 0);
+  sockopts->sndbuf = mrb_hiredis_option_int(mrb, options, "sndbuf", 0);
+  sockopts->maxbuf = mrb_hiredis_option_int(mrb, options, "maxbuf", -1);
+}
+
+/* nonblock: true only keeps the connect from blocking, replies are read
+ * blocking, so the socket is switched back once it is connected */
+static void
+mrb_hiredis_finish_connect(mrb_state *mrb, redisContext *context)
+{
+  if ((context->flags & REDIS_BLOCK) || context->fd == REDIS_INVALID_FD) {
+    return;
+  }
+  int timeout = -1;
+  const struct timeval *tv = context->connect_timeout;
+  if (tv && (tv->tv_sec || tv->tv_usec)) {
+    timeout = (int) (tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000);
+  }
+  struct pollfd pfd = { context->fd, POLLOUT, 0 };
+  int rc;
+  while ((rc = poll(&pfd, 1, timeout)) == -1 && errno == EINTR);
+  if (unlikely(rc == -1)) {
+    mrb_sys_fail(mrb, "poll");
+  }
+  if (unlikely(rc == 0)) {
+    errno = ETIMEDOUT;
+    mrb_sys_fail(mrb, "connect");
+  }
+  int err = 0;
+  socklen_t errlen = sizeof(err);
+  if (unlikely(getsockopt(context->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1)) {
+    mrb_sys_fail(mrb, "getsockopt(SO_ERROR)");
+  }
+  if (unlikely(err)) {
+    errno = err;
+    mrb_sys_fail(mrb, "connect");
+  }
+  if (unlikely(fcntl(context->fd, F_SETFL, fcntl(context->fd, F_GETFL) & ~O_NONBLOCK) == -1)) {
+    mrb_sys_fail(mrb, "fcntl");
+  }
+  context->flags |= REDIS_BLOCK;
+  if (context->command_timeout && unlikely(redisSetTimeout(context, *context->command_timeout) != REDIS_OK)) {
+    mrb_sys_fail(mrb, "setsockopt(SO_RCVTIMEO)");
+  }
+}
+
+/* map keys become Symbols, they are never collected so only for known key sets */
+MRB_INLINE mrb_bool
+mrb_hiredis_option_symbol_keys(mrb_state *mrb, mrb_value options)
+{
+  return !mrb_nil_p(options) && mrb_test(mrb_hiredis_option(mrb, options, "symbol_keys"));
+}
+
+static void
+mrb_hiredis_apply_socket_options(mrb_state *mrb, redisContext *context, const mrb_hiredis_socket_options *sockopts)
+{
+  if (sockopts->maxbuf != -1 && context->reader) {
+    context->reader->maxbuf = (size_t) sockopts->maxbuf;
+  }
+  if (context->fd == REDIS_INVALID_FD) {
+    return;
+  }
+
+  errno = 0;
+  if (context->connection_type == REDIS_CONN_TCP) {
+    if (sockopts->keepalive > 0) {
+#if (HIREDIS_MAJOR > 1) || ((HIREDIS_MAJOR == 1) && (HIREDIS_MINOR >= 1))
+      if (unlikely(redisEnableKeepAliveWithInterval(context, (int) sockopts->keepalive) != REDIS_OK)) {
+#else
+      if (unlikely(redisEnableKeepAlive(context) != REDIS_OK)) {
+#endif
+        mrb_sys_fail(mrb, "keepalive");
+      }
+    }
+    if (sockopts->nodelay != -1) {
+      int nodelay = sockopts->nodelay;
+      if (unlikely(setsockopt(context->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1)) {
+        mrb_sys_fail(mrb, "setsockopt(TCP_NODELAY)");
+      }
+    }
+  }
+  if (sockopts->rcvbuf > 0) {
+    int size = (int) sockopts->rcvbuf;
+    if (unlikely(setsockopt(context->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1)) {
+      mrb_sys_fail(mrb, "setsockopt(SO_RCVBUF)");
+    }
+  }
+  if (sockopts->sndbuf > 0) {
+    int size = (int) sockopts->sndbuf;
+    if (unlikely(setsockopt(context->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1)) {
+      mrb_sys_fail(mrb, "setsockopt(SO_SNDBUF)");
+    }
+  }
+}
+
+enum {
+  MRB_HIREDIS_PUBSUB_CHANNELS,
+  MRB_HIREDIS_PUBSUB_PATTERNS,
+  MRB_HIREDIS_PUBSUB_SHARD_CHANNELS,
+  MRB_HIREDIS_PUBSUB_TABLES
+};
+
+typedef enum {
+  MRB_HIREDIS_PUBSUB_NONE,
+  MRB_HIREDIS_PUBSUB_SUBSCRIBE,
+  MRB_HIREDIS_PUBSUB_UNSUBSCRIBE,
+  MRB_HIREDIS_PUBSUB_MESSAGE
+} mrb_hiredis_pubsub_kind;
+
+static const struct {
+  const char *name;
+  size_t len;
+  int table;
+  mrb_hiredis_pubsub_kind kind;
+} mrb_hiredis_pubsub_names[] = {
+  { "subscribe",     9, MRB_HIREDIS_PUBSUB_CHANNELS,       MRB_HIREDIS_PUBSUB_SUBSCRIBE },
+  { "psubscribe",   10, MRB_HIREDIS_PUBSUB_PATTERNS,       MRB_HIREDIS_PUBSUB_SUBSCRIBE },
+  { "ssubscribe",   10, MRB_HIREDIS_PUBSUB_SHARD_CHANNELS, MRB_HIREDIS_PUBSUB_SUBSCRIBE },
+  { "unsubscribe",  11, MRB_HIREDIS_PUBSUB_CHANNELS,       MRB_HIREDIS_PUBSUB_UNSUBSCRIBE },
+  { "punsubscribe", 12, MRB_HIREDIS_PUBSUB_PATTERNS,       MRB_HIREDIS_PUBSUB_UNSUBSCRIBE },
+  { "sunsubscribe", 12, MRB_HIREDIS_PUBSUB_SHARD_CHANNELS, MRB_HIREDIS_PUBSUB_UNSUBSCRIBE },
+  { "message",       7, MRB_HIREDIS_PUBSUB_CHANNELS,       MRB_HIREDIS_PUBSUB_MESSAGE },
+  { "pmessage",      8, MRB_HIREDIS_PUBSUB_PATTERNS,       MRB_HIREDIS_PUBSUB_MESSAGE },
+  { "smessage",      8, MRB_HIREDIS_PUBSUB_SHARD_CHANNELS, MRB_HIREDIS_PUBSUB_MESSAGE }
+};
+
+/* Classifies a pub/sub command or the kind field of a pub/sub reply and
+ * tells which handler table it belongs to. */
+static mrb_hiredis_pubsub_kind
+mrb_hiredis_pubsub_classify(const char *name, size_t len, int *table)
+{
+  size_t i;
+  for (i = 0; i < sizeof(mrb_hiredis_pubsub_names) / sizeof(mrb_hiredis_pubsub_names[0]); i++) {
+    if (len == mrb_hiredis_pubsub_names[i].len && strncasecmp(name, mrb_hiredis_pubsub_names[i].name, len) == 0) {
+      *table = mrb_hiredis_pubsub_names[i].table;
+      return mrb_hiredis_pubsub_names[i].kind;
+    }
+  }
+  return MRB_HIREDIS_PUBSUB_NONE;
+}
+
+static void
+mrb_hiredis_pubsub_init(mrb_state *mrb, mrb_value self, mrb_value *tables)
+{
+  tables[MRB_HIREDIS_PUBSUB_CHANNELS] = mrb_hash_new(mrb);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "subscriptions"), tables[MRB_HIREDIS_PUBSUB_CHANNELS]);
+  tables[MRB_HIREDIS_PUBSUB_PATTERNS] = mrb_hash_new(mrb);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "psubscriptions"), tables[MRB_HIREDIS_PUBSUB_PATTERNS]);
+  tables[MRB_HIREDIS_PUBSUB_SHARD_CHANNELS] = mrb_hash_new(mrb);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "ssubscriptions"), tables[MRB_HIREDIS_PUBSUB_SHARD_CHANNELS]);
+}
+
+static mrb_bool
+mrb_hiredis_pubsub_active(mrb_state *mrb, const mrb_value *tables)
+{
+  int i;
+  for (i = 0; i < MRB_HIREDIS_PUBSUB_TABLES; i++) {
+    if (!mrb_nil_p(tables[i]) && !mrb_hash_empty_p(mrb, tables[i])) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* Returns the block registered for the channel or pattern a pub/sub reply
+ * belongs to. Unsubscribe confirmations drop the entry, the block stays in
+ * the arena so it can still be yielded the confirmation. */
+static mrb_value
+mrb_hiredis_pubsub_handler(mrb_state *mrb, const mrb_value *tables, mrb_value reply)
+{
+  if (!mrb_array_p(reply) || RARRAY_LEN(reply) < 3) {
+    return mrb_nil_value();
+  }
+  mrb_value kind = RARRAY_PTR(reply)[0];
+  mrb_value channel = RARRAY_PTR(reply)[1];
+  if (!mrb_string_p(kind) || !mrb_string_p(channel)) {
+    return mrb_nil_value();
+  }
+
+  int table;
+  switch (mrb_hiredis_pubsub_classify(RSTRING_PTR(kind), RSTRING_LEN(kind), &table)) {
+    case MRB_HIREDIS_PUBSUB_SUBSCRIBE:
+    case MRB_HIREDIS_PUBSUB_MESSAGE:
+      return mrb_hash_get(mrb, tables[table], channel);
+    case MRB_HIREDIS_PUBSUB_UNSUBSCRIBE: {
+      mrb_value handler = mrb_hash_delete_key(mrb, tables[table], channel);
+      mrb_gc_protect(mrb, handler);
+      return handler;
+    }
+    default:
+      return mrb_nil_value();
+  }
+}
+
+enum {
+  MRB_HIREDIS_CACHE_FIRST_KEY,
+  MRB_HIREDIS_CACHE_ALL_KEYS
+};
+
+/* read commands whose replies only change when one of their keys does */
+static const struct {
+  const char *name;
+  size_t len;
+  int keys;
+} mrb_hiredis_cacheable_commands[] = {
+  { "get",        3, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "mget",       4, MRB_HIREDIS_CACHE_ALL_KEYS },
+  { "strlen",     6, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "getrange",   8, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "exists",     6, MRB_HIREDIS_CACHE_ALL_KEYS },
+  { "type",       4, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "hget",       4, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "hmget",      5, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "hgetall",    7, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "hexists",    7, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "hlen",       4, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "hkeys",      5, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "hvals",      5, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "hstrlen",    7, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "smembers",   8, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "sismember",  9, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "smismember", 10, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "scard",      5, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "lrange",     6, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "lindex",     6, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "llen",       4, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "zrange",     6, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "zscore",     6, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "zmscore",    7, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "zrank",      5, MRB_HIREDIS_CACHE_FIRST_KEY },
+  { "zcard",      5, MRB_HIREDIS_CACHE_FIRST_KEY }
+};
+
+static int
+mrb_hiredis_cacheable(const char *name, size_t len)
+{
+  size_t i;
+  for (i = 0; i < sizeof(mrb_hiredis_cacheable_commands) / sizeof(mrb_hiredis_cacheable_commands[0]); i++) {
+    if (len == mrb_hiredis_cacheable_commands[i].len && strncasecmp(name, mrb_hiredis_cacheable_commands[i].name, len) == 0) {
+      return mrb_hiredis_cacheable_commands[i].keys;
+    }
+  }
+  return -1;
+}
+
+typedef struct {
+  mrb_int prev;
+  mrb_int next; /* links free slots too */
+  mrb_int bytes;
+} mrb_hiredis_cache_node;
+
+/* Client side cache fed by CLIENT TRACKING. Entries live in slots of the
+ * keys/values/sources Arrays, which keep them reachable for the GC, and are
+ * chained into a LRU list by index, most recently used at head. */
+typedef struct {
+  mrb_bool enabled;
+  mrb_int max_bytes;
+  mrb_int bytes;
+  mrb_int entries;
+  mrb_int hits;
+  mrb_int misses;
+  mrb_int invalidations;
+  mrb_int evictions;
+  uint64_t sync_interval; /* ns between polls of the socket for invalidations */
+  uint64_t synced;
+  mrb_hiredis_cache_node *nodes;
+  mrb_int capa;
+  mrb_int head;
+  mrb_int tail;
+  mrb_int free;
+  mrb_value index;      /* cache key => slot */
+  mrb_value keys;       /* slot => cache key */
+  mrb_value values;     /* slot => reply */
+  mrb_value sources;    /* slot => Array of redis keys */
+  mrb_value dependents; /* redis key => Hash of cache keys */
+} mrb_hiredis_cache;
+
+static void
+mrb_hiredis_cache_init(mrb_hiredis_cache *cache)
+{
+  cache->enabled = FALSE;
+  cache->max_bytes = cache->bytes = cache->entries = 0;
+  cache->hits = cache->misses = cache->invalidations = cache->evictions = 0;
+  cache->sync_interval = cache->synced = 0;
+  cache->nodes = NULL;
+  cache->capa = 0;
+  cache->head = cache->tail = cache->free = -1;
+  cache->index = cache->keys = cache->values = cache->sources = cache->dependents = mrb_nil_value();
+}
+
+static void
+mrb_hiredis_cache_unlink(mrb_hiredis_cache *cache, mrb_int slot)
+{
+  mrb_hiredis_cache_node *node = &cache->nodes[slot];
+  if (node->prev != -1) {
+    cache->nodes[node->prev].next = node->next;
+  } else {
+    cache->head = node->next;
+  }
+  if (node->next != -1) {
+    cache->nodes[node->next].prev = node->prev;
+  } else {
+    cache->tail = node->prev;
+  }
+}
+
+static void
+mrb_hiredis_cache_link_head(mrb_hiredis_cache *cache, mrb_int slot)
+{
+  mrb_hiredis_cache_node *node = &cache->nodes[slot];
+  node->prev = -1;
+  node->next = cache->head;
+  if (cache->head != -1) {
+    cache->nodes[cache->head].prev = slot;
+  } else {
+    cache->tail = slot;
+  }
+  cache->head = slot;
+}
+
+static void
+mrb_hiredis_cache_remove(mrb_state *mrb, mrb_hiredis_cache *cache, mrb_int slot)
+{
+  mrb_value key = RARRAY_PTR(cache->keys)[slot];
+  mrb_value sources = RARRAY_PTR(cache->sources)[slot];
+  mrb_int i;
+  for (i = 0; i < RARRAY_LEN(sources); i++) {
+    mrb_value source = RARRAY_PTR(sources)[i];
+    mrb_value dependents = mrb_hash_get(mrb, cache->dependents, source);
+    if (mrb_hash_p(dependents)) {
+      mrb_hash_delete_key(mrb, dependents, key);
+      if (mrb_hash_empty_p(mrb, dependents)) {
+        mrb_hash_delete_key(mrb, cache->dependents, source);
+      }
+    }
+  }
+  mrb_hash_delete_key(mrb, cache->index, key);
+
+  mrb_hiredis_cache_unlink(cache, slot);
+  cache->bytes -= cache->nodes[slot].bytes;
+  cache->entries--;
+  mrb_ary_set(mrb, cache->keys, slot, mrb_nil_value());
+  mrb_ary_set(mrb, cache->values, slot, mrb_nil_value());
+  mrb_ary_set(mrb, cache->sources, slot, mrb_nil_value());
+  cache->nodes[slot].next = cache->free;
+  cache->free = slot;
+}
+
+static void
+mrb_hiredis_cache_clear(mrb_state *mrb, mrb_hiredis_cache *cache)
+{
+  if (mrb_nil_p(cache->index)) {
+    return;
+  }
+  mrb_hash_clear(mrb, cache->index);
+  mrb_hash_clear(mrb, cache->dependents);
+  mrb_ary_resize(mrb, cache->keys, 0);
+  mrb_ary_resize(mrb, cache->values, 0);
+  mrb_ary_resize(mrb, cache->sources, 0);
+  cache->head = cache->tail = cache->free = -1;
+  cache->bytes = cache->entries = 0;
+}
+
+static void
+mrb_hiredis_cache_evict(mrb_state *mrb, mrb_hiredis_cache *cache, mrb_int max_bytes)
+{
+  while (cache->bytes > max_bytes && cache->tail != -1) {
+    mrb_hiredis_cache_remove(mrb, cache, cache->tail);
+    cache->evictions++;
+  }
+}
+
+static void
+mrb_hiredis_cache_invalidate(mrb_state *mrb, mrb_hiredis_cache *cache, mrb_value source)
+{
+  mrb_value dependents = mrb_hash_delete_key(mrb, cache->dependents, source);
+  if (!mrb_hash_p(dependents)) {
+    return;
+  }
+  mrb_value keys = mrb_hash_keys(mrb, dependents);
+  mrb_int i;
+  for (i = 0; i < RARRAY_LEN(keys); i++) {
+    mrb_value slot = mrb_hash_get(mrb, cache->index, RARRAY_PTR(keys)[i]);
+    if (mrb_integer_p(slot)) {
+      mrb_hiredis_cache_remove(mrb, cache, mrb_integer(slot));
+      cache->invalidations++;
+    }
+  }
+}
+
+/* Handles a RESP3 push, returns TRUE when it was an invalidation message.
+ * A nil key list means the server flushed its tracking table. */
+static mrb_bool
+mrb_hiredis_cache_push(mrb_state *mrb, mrb_hiredis_cache *cache, mrb_value push)
+{
+  if (!mrb_array_p(push) || RARRAY_LEN(push) < 2) {
+    return FALSE;
+  }
+  mrb_value kind = RARRAY_PTR(push)[0];
+  if (!mrb_string_p(kind) || RSTRING_LEN(kind) != 10 || strncasecmp(RSTRING_PTR(kind), "invalidate", 10) != 0) {
+    return FALSE;
+  }
+  if (!cache->enabled) {
+    return TRUE;
+  }
+
+  mrb_value sources = RARRAY_PTR(push)[1];
+  if (mrb_array_p(sources)) {
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_int i;
+    for (i = 0; i < RARRAY_LEN(sources); i++) {
+      mrb_hiredis_cache_invalidate(mrb, cache, RARRAY_PTR(sources)[i]);
+      mrb_gc_arena_restore(mrb, ai);
+    }
+  } else {
+    cache->invalidations += cache->entries;
+    mrb_hiredis_cache_clear(mrb, cache);
+  }
+  return TRUE;
+}
+
+typedef struct {
+  mrb_value hash;
+  mrb_int *bytes;
+} mrb_hiredis_cache_copy_data;
+
+static int
+mrb_hiredis_cache_copy_pair(mrb_state *mrb, mrb_value key, mrb_value val, void *data);
+
+/* Returns a frozen copy of a reply for the cache, so callers can't change
+ * what later hits return while the reply of a miss stays their own, and
+ * adds how much memory it holds to bytes. Frozen Strings, like the
+ * interned status replies and map keys, are shared. */
+static mrb_value
+mrb_hiredis_cache_copy(mrb_state *mrb, mrb_value value, mrb_int *bytes)
+{
+  if (mrb_immediate_p(value)) {
+    *bytes += sizeof(mrb_value);
+    return value;
+  }
+
+  mrb_value copy;
+  switch (mrb_type(value)) {
+    case MRB_TT_STRING:
+      *bytes += sizeof(struct RString) + RSTRING_LEN(value);
+      copy = MRB_FROZEN_P(mrb_basic_ptr(value)) ? value : mrb_str_dup(mrb, value);
+      break;
+    case MRB_TT_ARRAY: {
+      *bytes += sizeof(struct RArray);
+      copy = mrb_ary_new_capa(mrb, RARRAY_LEN(value));
+      int ai = mrb_gc_arena_save(mrb);
+      mrb_int i;
+      for (i = 0; i < RARRAY_LEN(value); i++) {
+        mrb_ary_push(mrb, copy, mrb_hiredis_cache_copy(mrb, RARRAY_PTR(value)[i], bytes));
+        mrb_gc_arena_restore(mrb, ai);
+      }
+    } break;
+    case MRB_TT_HASH: {
+      *bytes += sizeof(struct RHash);
+      mrb_hiredis_cache_copy_data data = { mrb_hash_new_capa(mrb, mrb_hash_size(mrb, value)), bytes };
+      mrb_hash_foreach(mrb, mrb_hash_ptr(value), mrb_hiredis_cache_copy_pair, &data);
+      copy = data.hash;
+    } break;
+    case MRB_TT_OBJECT:
+      *bytes += sizeof(struct RBasic) + sizeof(mrb_value);
+      copy = mrb_obj_dup(mrb, value);
+      break;
+    default:
+      *bytes += sizeof(struct RBasic) + sizeof(mrb_value);
+      copy = value;
+  }
+  MRB_SET_FROZEN_FLAG(mrb_basic_ptr(copy));
+  return copy;
+}
+
+static int
+mrb_hiredis_cache_copy_pair(mrb_state *mrb, mrb_value key, mrb_value val, void *data)
+{
+  mrb_hiredis_cache_copy_data *copy_data = (mrb_hiredis_cache_copy_data *) data;
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_value key_copy = mrb_hiredis_cache_copy(mrb, key, copy_data->bytes);
+  mrb_hash_set(mrb, copy_data->hash, key_copy, mrb_hiredis_cache_copy(mrb, val, copy_data->bytes));
+  mrb_gc_arena_restore(mrb, ai);
+  return 0;
+}
+
+/* length prefixed arguments with the command name lowercased, so "GET"
+ * and :get share an entry and arguments can't run into each other */
+static mrb_value
+mrb_hiredis_cache_key(mrb_state *mrb, const mrb_hiredis_argv *argv, mrb_int argc)
+{
+  mrb_int capa = 0;
+  mrb_int i;
+  for (i = 0; i < argc; i++) {
+    capa += argv->argvlen[i] + 21;
+  }
+  mrb_value key = mrb_str_new_capa(mrb, capa);
+  char numbuf[22];
+  for (i = 0; i < argc; i++) {
+    int numlen = snprintf(numbuf, sizeof(numbuf), "%zu:", argv->argvlen[i]);
+    mrb_str_cat(mrb, key, numbuf, numlen);
+    if (i == 0) {
+      size_t j;
+      for (j = 0; j < argv->argvlen[0]; j++) {
+        char c = argv->argv[0][j];
+        if (c >= 'A' && c <= 'Z') {
+          c += 'a' - 'A';
+        }
+        mrb_str_cat(mrb, key, &c, 1);
+      }
+    } else {
+      mrb_str_cat(mrb, key, argv->argv[i], argv->argvlen[i]);
+    }
+  }
+  return key;
+}
+
+static mrb_bool
+mrb_hiredis_cache_fetch(mrb_state *mrb, mrb_hiredis_cache *cache, mrb_value key, mrb_value *value)
+{
+  mrb_value slot = mrb_hash_get(mrb, cache->index, key);
+  if (!mrb_integer_p(slot)) {
+    return FALSE;
+  }
+  mrb_int i = mrb_integer(slot);
+  if (cache->head != i) {
+    mrb_hiredis_cache_unlink(cache, i);
+    mrb_hiredis_cache_link_head(cache, i);
+  }
+  *value = RARRAY_PTR(cache->values)[i];
+  return TRUE;
+}
+
+static void
+mrb_hiredis_cache_store(mrb_state *mrb, mrb_hiredis_cache *cache, mrb_value key, int keys, const mrb_hiredis_argv *argv, mrb_int argc, mrb_value value)
+{
+  mrb_int bytes = RSTRING_LEN(key) + sizeof(mrb_hiredis_cache_node);
+  value = mrb_hiredis_cache_copy(mrb, value, &bytes);
+  if (bytes > cache->max_bytes) {
+    return;
+  }
+  mrb_hiredis_cache_evict(mrb, cache, cache->max_bytes - bytes);
+
+  mrb_int slot = cache->free;
+  if (slot != -1) {
+    cache->free = cache->nodes[slot].next;
+  } else {
+    slot = RARRAY_LEN(cache->keys);
+    if (slot >= cache->capa) {
+      mrb_int capa = cache->capa ? cache->capa * 2 : 64;
+      cache->nodes = (mrb_hiredis_cache_node *) mrb_realloc(mrb, cache->nodes, capa * sizeof(mrb_hiredis_cache_node));
+      cache->capa = capa;
+    }
+  }
+
+  mrb_int nsources = keys == MRB_HIREDIS_CACHE_ALL_KEYS ? argc - 1 : 1;
+  mrb_value sources = mrb_ary_new_capa(mrb, nsources);
+  mrb_value present = mrb_true_value();
+  mrb_int i;
+  for (i = 1; i <= nsources; i++) {
+    mrb_value source = mrb_str_new(mrb, argv->argv[i], argv->argvlen[i]);
+    mrb_ary_push(mrb, sources, source);
+    mrb_value dependents = mrb_hash_get(mrb, cache->dependents, source);
+    if (!mrb_hash_p(dependents)) {
+      dependents = mrb_hash_new(mrb);
+      mrb_hash_set(mrb, cache->dependents, source, dependents);
+    }
+    mrb_hash_set(mrb, dependents, key, present);
+  }
+
+  mrb_ary_set(mrb, cache->keys, slot, key);
+  mrb_ary_set(mrb, cache->values, slot, value);
+  mrb_ary_set(mrb, cache->sources, slot, sources);
+  mrb_hash_set(mrb, cache->index, key, mrb_int_value(mrb, slot));
+  cache->nodes[slot].bytes = bytes;
+  mrb_hiredis_cache_link_head(cache, slot);
+  cache->bytes += bytes;
+  cache->entries++;
+}
+
+#define MRB_HIREDIS_INTERN_SLOTS 512
+#define MRB_HIREDIS_INTERN_MAX_LEN 64
+
+/* Status replies and map keys repeat across replies, they come out of a
+ * direct mapped cache of frozen Strings instead of being allocated every
+ * time. A colliding string takes over the slot, so the cache stays small
+ * and follows the working set. slots is an ivar of the connection. */
+typedef struct {
+  mrb_value slots;
+  mrb_bool symbol_keys;
+} mrb_hiredis_intern;
+
+static void
+mrb_hiredis_intern_init(mrb_state *mrb, mrb_value self, mrb_hiredis_intern *intern, mrb_bool symbol_keys)
+{
+  intern->slots = mrb_ary_new_capa(mrb, MRB_HIREDIS_INTERN_SLOTS);
+  mrb_ary_resize(mrb, intern->slots, MRB_HIREDIS_INTERN_SLOTS);
+  mrb_iv_set(mrb, self, mrb_intern_lit(mrb, "interned"), intern->slots);
+  intern->symbol_keys = symbol_keys;
+}
+
+static mrb_value
+mrb_hiredis_intern_str(mrb_state *mrb, mrb_hiredis_intern *intern, const char *str, size_t len)
+{
+  if (!intern || len > MRB_HIREDIS_INTERN_MAX_LEN) {
+    return mrb_str_new(mrb, str, len);
+  }
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char) str[i]) * 16777619u;
+  }
+  mrb_int slot = (mrb_int) (hash & (MRB_HIREDIS_INTERN_SLOTS - 1));
+  mrb_value cached = RARRAY_PTR(intern->slots)[slot];
+  if (mrb_string_p(cached) && (size_t) RSTRING_LEN(cached) == len && memcmp(RSTRING_PTR(cached), str, len) == 0) {
+    return cached;
+  }
+  mrb_value value = mrb_str_new(mrb, str, len);
+  MRB_SET_FROZEN_FLAG(mrb_basic_ptr(value));
+  mrb_ary_set(mrb, intern->slots, slot, value);
+  return value;
+}
+
+MRB_INLINE mrb_value
+mrb_hiredis_intern_key(mrb_state *mrb, mrb_hiredis_intern *intern, const char *str, size_t len)
+{
+  if (intern && intern->symbol_keys) {
+    return mrb_symbol_value(mrb_intern(mrb, str, len));
+  }
+  return mrb_hiredis_intern_str(mrb, intern, str, len);
+}
+
+/* Arguments of at least MRB_HIREDIS_WRITEV_MIN bytes are not copied into
+ * the output buffer, they are written with writev from the mruby String they
+ * live in. Everything around them, RESP headers and small arguments, is
+ * encoded into sds buffers owned by the iov. */
+#ifndef MRB_HIREDIS_WRITEV_MIN
+#define MRB_HIREDIS_WRITEV_MIN (64 * 1024)
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+typedef struct {
+  struct iovec *iov;
+  size_t len;
+  size_t pos;
+  size_t capa;
+  sds *bufs;
+  size_t bufs_len;
+  size_t bufs_capa;
+} mrb_hiredis_iov;
+
+MRB_INLINE mrb_bool
+mrb_hiredis_iov_wanted(mrb_int argc, const size_t *argvlen)
+{
+  mrb_int i;
+  for (i = 1; i < argc; i++) {
+    if (argvlen[i] >= MRB_HIREDIS_WRITEV_MIN) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+MRB_INLINE mrb_bool
+mrb_hiredis_iov_pending(const mrb_hiredis_iov *iov)
+{
+  return iov->pos < iov->len;
+}
+
+static size_t
+mrb_hiredis_iov_bytes(const mrb_hiredis_iov *iov)
+{
+  size_t bytes = 0;
+  size_t i;
+  for (i = iov->pos; i < iov->len; i++) {
+    bytes += iov->iov[i].iov_len;
+  }
+  return bytes;
+}
+
+/* room for n more iovecs and m more buffers, so pushing them can't fail half way */
+static void
+mrb_hiredis_iov_reserve(mrb_state *mrb, mrb_hiredis_iov *iov, size_t n, size_t m)
+{
+  if (iov->len + n > iov->capa) {
+    size_t capa = iov->capa ? iov->capa : 16;
+    while (capa < iov->len + n) {
+      capa *= 2;
+    }
+    iov->iov = (struct iovec *) mrb_realloc(mrb, iov->iov, capa * sizeof(struct iovec));
+    iov->capa = capa;
+  }
+  if (iov->bufs_len + m > iov->bufs_capa) {
+    size_t capa = iov->bufs_capa ? iov->bufs_capa : 4;
+    while (capa < iov->bufs_len + m) {
+      capa *= 2;
+    }
+    iov->bufs = (sds *) mrb_realloc(mrb, iov->bufs, capa * sizeof(sds));
+    iov->bufs_capa = capa;
+  }
+}
+
+MRB_INLINE void
+mrb_hiredis_iov_push(mrb_hiredis_iov *iov, const char *base, size_t len)
+{
+  if (len == 0) {
+    return;
+  }
+  if (iov->len > iov->pos) {
+    struct iovec *last = &iov->iov[iov->len - 1];
+    if ((const char *) last->iov_base + last->iov_len == base) {
+      last->iov_len += len;
+      return;
+    }
+  }
+  iov->iov[iov->len].iov_base = (void *) base;
+  iov->iov[iov->len].iov_len = len;
+  iov->len++;
+}
+
+/* takes ownership of buf, room for it has to be reserved */
+MRB_INLINE void
+mrb_hiredis_iov_own(mrb_hiredis_iov *iov, sds buf)
+{
+  iov->bufs[iov->bufs_len++] = buf;
+}
+
+static void
+mrb_hiredis_iov_reset(mrb_hiredis_iov *iov)
+{
+  size_t i;
+  for (i = 0; i < iov->bufs_len; i++) {
+    sdsfree(iov->bufs[i]);
+  }
+  iov->bufs_len = 0;
+  iov->len = iov->pos = 0;
+}
+
+static void
+mrb_hiredis_iov_free(mrb_state *mrb, mrb_hiredis_iov *iov)
+{
+  mrb_hiredis_iov_reset(iov);
+  mrb_free(mrb, iov->iov);
+  mrb_free(mrb, iov->bufs);
+  iov->iov = NULL;
+  iov->bufs = NULL;
+  iov->capa = iov->bufs_capa = 0;
+}
+
+/* keep, when given, lists the Strings large arguments may point into, those
+ * that can't be found there are copied after all */
+static mrb_bool
+mrb_hiredis_iov_borrowed(mrb_value keep, const char *arg, size_t len)
+{
+  if (len < MRB_HIREDIS_WRITEV_MIN) {
+    return FALSE;
+  }
+  if (mrb_nil_p(keep)) {
+    return TRUE;
+  }
+  mrb_int i;
+  for (i = 0; i < RARRAY_LEN(keep); i += 2) {
+    if (RSTRING_PTR(RARRAY_PTR(keep)[i]) == arg) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static void
+mrb_hiredis_iov_collect(mrb_state *mrb, mrb_value strings, mrb_value arg);
+
+static int
+mrb_hiredis_iov_collect_pair(mrb_state *mrb, mrb_value key, mrb_value val, void *data)
+{
+  mrb_hiredis_iov_collect(mrb, *(mrb_value *) data, key);
+  mrb_hiredis_iov_collect(mrb, *(mrb_value *) data, val);
+  return 0;
+}
+
+/* Pushes the large Strings among the arguments onto strings, each followed
+ * by whether it still has to be frozen for the write, and thawed after it.
+ * A String the caller froze stays frozen. */
+static void
+mrb_hiredis_iov_collect(mrb_state *mrb, mrb_value strings, mrb_value arg)
+{
+  switch (mrb_type(arg)) {
+    case MRB_TT_ARRAY: {
+      mrb_int i;
+      for (i = 0; i < RARRAY_LEN(arg); i++) {
+        mrb_hiredis_iov_collect(mrb, strings, RARRAY_PTR(arg)[i]);
+      }
+    } break;
+    case MRB_TT_HASH:
+      mrb_hash_foreach(mrb, mrb_hash_ptr(arg), mrb_hiredis_iov_collect_pair, &strings);
+      break;
+    case MRB_TT_STRING:
+      if (RSTRING_LEN(arg) >= MRB_HIREDIS_WRITEV_MIN) {
+        mrb_ary_push(mrb, strings, arg);
+        mrb_ary_push(mrb, strings, mrb_bool_value(!MRB_FROZEN_P(mrb_basic_ptr(arg))));
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/* Reserves room for argv[from..argc) and returns the buffer its headers and
+ * small arguments go into, nothing is pushed yet. */
+static sds
+mrb_hiredis_iov_prepare(mrb_state *mrb, mrb_hiredis_iov *iov, mrb_value keep, mrb_int from, mrb_int argc, const char **argv, const size_t *argvlen)
+{
+  size_t need = 32;
+  size_t borrowed = 0;
+  mrb_int i;
+  for (i = from; i < argc; i++) {
+    need += 32;
+    if (mrb_hiredis_iov_borrowed(keep, argv[i], argvlen[i])) {
+      borrowed++;
+    } else {
+      need += argvlen[i];
+    }
+  }
+  mrb_hiredis_iov_reserve(mrb, iov, borrowed * 2 + 2, 2);
+  /* room for everything up front, the iovecs point into buf so it must never move */
+  sds buf = sdsMakeRoomFor(sdsempty(), need);
+  if (unlikely(!buf)) {
+    mrb_raise(mrb, E_HIREDIS_ERR_OOM, "Out of memory");
+  }
+  return buf;
+}
+
+/* Encodes argv[from..argc) as RESP into buf from mrb_hiredis_iov_prepare,
+ * the "*argc" header only when from is 0. Can't fail. */
+static void
+mrb_hiredis_iov_encode(mrb_hiredis_iov *iov, sds buf, mrb_value keep, mrb_int from, mrb_int argc, const char **argv, const size_t *argvlen)
+{
+  mrb_hiredis_iov_own(iov, buf);
+  char *p = buf;
+  char *run = buf;
+  if (from == 0) {
+    p += snprintf(p, 32, "*%" MRB_PRId "\r\n", argc);
+  }
+  mrb_int i;
+  for (i = from; i < argc; i++) {
+    p += snprintf(p, 32, "$%zu\r\n", argvlen[i]);
+    if (mrb_hiredis_iov_borrowed(keep, argv[i], argvlen[i])) {
+      mrb_hiredis_iov_push(iov, run, p - run);
+      mrb_hiredis_iov_push(iov, argv[i], argvlen[i]);
+      run = p;
+    } else {
+      memcpy(p, argv[i], argvlen[i]);
+      p += argvlen[i];
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+  mrb_hiredis_iov_push(iov, run, p - run);
+  sdsIncrLen(buf, (ssize_t) (p - buf));
+}
+
+/* Writes as much as the socket takes, returns the bytes written or -1 with
+ * errno set. Partly written iovecs are advanced in place. */
+static ssize_t
+mrb_hiredis_iov_write(mrb_hiredis_iov *iov, int fd, mrb_hiredis_stats *stats)
+{
+  ssize_t total = 0;
+  while (iov->pos < iov->len) {
+    size_t count = iov->len - iov->pos;
+    if (count > IOV_MAX) {
+      count = IOV_MAX;
+    }
+    ssize_t nwritten = writev(fd, iov->iov + iov->pos, (int) count);
+    if (nwritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return total > 0 && errno == EAGAIN ? total : -1;
+    }
+    stats->writes++;
+    stats->bytes_written += (uint64_t) nwritten;
+    total += nwritten;
+    size_t left = (size_t) nwritten;
+    while (left > 0) {
+      struct iovec *current = &iov->iov[iov->pos];
+      if (left >= current->iov_len) {
+        left -= current->iov_len;
+        iov->pos++;
+      } else {
+        current->iov_base = (char *) current->iov_base + left;
+        current->iov_len -= left;
+        left = 0;
+      }
+    }
+  }
+  return total;
+}
+
+typedef struct {
+  int type; /* must stay first, hiredis peeks at it to spot RESP3 push replies */
+  mrb_value value;
+} mrb_hiredis_reply;
+
+typedef struct {
+  mrb_hiredis_reply root;
+  mrb_state *mrb;
+  mrb_value pending_keys;
+  struct RClass *reply_error_class;
+  struct RClass *verb_class;
+  mrb_hiredis_argv argv;
+  mrb_int pending;
+  redisContext *context;
+  redisReplyObjectFunctions *default_functions;
+  mrb_bool stream;
+  mrb_value subscriptions[MRB_HIREDIS_PUBSUB_TABLES];
+  /* pub/sub messages which arrived while a command waited for its reply */
+  mrb_value pushes;
+  mrb_hiredis_cache cache;
+  mrb_hiredis_socket_options sockopts;
+  mrb_hiredis_stats stats;
+  mrb_hiredis_intern intern;
+  mrb_hiredis_iov iov;
+} mrb_hiredis_context;
+
+static void
+mrb_hiredis_context_free(void *privdata)
+{
+  mrb_hiredis_context *mrb_context = (mrb_hiredis_context *) privdata;
+  mrb_hiredis_argv_free(mrb_context->mrb, &mrb_context->argv);
+  mrb_hiredis_iov_free(mrb_context->mrb, &mrb_context->iov);
+  mrb_free(mrb_context->mrb, mrb_context->cache.nodes);
+  mrb_hiredis_stats_uninstall(&mrb_context->stats, mrb_context->context);
+  mrb_hiredis_stats_free(mrb_context->mrb, &mrb_context->stats);
+  mrb_free(mrb_context->mrb, mrb_context);
+}
+
+typedef struct {
+  redisReply *reply;
+  mrb_int size;
+} mrb_hiredis_lazy_reply;
+
+static void
+mrb_hiredis_lazy_reply_free(mrb_state *mrb, void *p)
+{
+  mrb_hiredis_lazy_reply *lazy_reply = (mrb_hiredis_lazy_reply *) p;
+  if (lazy_reply->reply) {
+    freeReplyObject(lazy_reply->reply);
+  }
+  mrb_free(mrb, lazy_reply);
+}
+
+static const struct mrb_data_type mrb_hiredis_lazy_reply_type = {
+  "$i_mrb_hiredis_lazy_reply_type", mrb_hiredis_lazy_reply_free
+};
+
+/* Hiredis::Reader wraps a bare redisReader with the same reply builder as
+ * the sync client, its privdata is a mrb_hiredis_context without a
+ * connection. The reader goes first, freeing it still calls freeObject. */
+static void
+mrb_hiredis_reader_free(mrb_state *mrb, void *p)
+{
+  redisReader *reader = (redisReader *) p;
+  void *mrb_context = reader->privdata;
+  redisReaderFree(reader);
+  mrb_hiredis_context_free(mrb_context);
+}
+
+static const struct mrb_data_type mrb_hiredis_reader_type = {
+  "$i_mrb_hiredis_reader_type", mrb_hiredis_reader_free
+};
+
+#define MRB_HIREDIS_CLUSTER_SLOTS 16384
+
+/* CRC16-CCITT (XMODEM), the key hash Redis Cluster uses */
+static const uint16_t mrb_hiredis_crc16_table[256] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+  0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+  0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+  0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+  0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+  0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+  0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+  0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+  0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+  0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+  0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+  0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+  0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+  0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+  0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+  0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+  0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+  0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+  0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+  0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+  0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+  0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+  0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+static uint16_t
+mrb_hiredis_crc16(const char *buf, size_t len)
+{
+  uint16_t crc = 0;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    crc = (crc << 8) ^ mrb_hiredis_crc16_table[((crc >> 8) ^ (uint8_t) buf[i]) & 0xff];
+  }
+  return crc;
+}
+
+/* only the part between the first { and the next } is hashed, if not empty */
+static mrb_int
+mrb_hiredis_key_slot(const char *key, size_t len)
+{
+  size_t start, end;
+  for (start = 0; start < len; start++) {
+    if (key[start] == '{') {
+      break;
+    }
+  }
+  if (start < len) {
+    for (end = start + 1; end < len; end++) {
+      if (key[end] == '}') {
+        break;
+      }
+    }
+    if (end < len && end != start + 1) {
+      return mrb_hiredis_crc16(key + start + 1, end - start - 1) & (MRB_HIREDIS_CLUSTER_SLOTS - 1);
+    }
+  }
+  return mrb_hiredis_crc16(key, len) & (MRB_HIREDIS_CLUSTER_SLOTS - 1);
+}
+
+#define MRB_HIREDIS_SHA1_ROL(value, bits) (((value) << (bits)) | ((value) >> (32 - (bits))))
+
+static void
+mrb_hiredis_sha1_block(uint32_t state[5], const unsigned char *block)
+{
+  uint32_t w[80];
+  int i;
+  for (i = 0; i < 16; i++) {
+    w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16) |
+      ((uint32_t) block[i * 4 + 2] << 8) | (uint32_t) block[i * 4 + 3];
+  }
+  for (; i < 80; i++) {
+    w[i] = MRB_HIREDIS_SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+  for (i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t temp = MRB_HIREDIS_SHA1_ROL(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = MRB_HIREDIS_SHA1_ROL(b, 30);
+    b = a;
+    a = temp;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+/* lowercase hex SHA1, the name EVALSHA knows a script by */
+static void
+mrb_hiredis_sha1_hex(const char *data, size_t len, char hex[40])
+{
+  static const char digits[] = "0123456789abcdef";
+  uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  unsigned char block[64];
+  size_t offset = 0;
+  for (; len - offset >= 64; offset += 64) {
+    mrb_hiredis_sha1_block(state, (const unsigned char *) data + offset);
+  }
+  size_t rest = len - offset;
+  memcpy(block, data + offset, rest);
+  block[rest++] = 0x80;
+  if (rest > 56) {
+    memset(block + rest, 0, 64 - rest);
+    mrb_hiredis_sha1_block(state, block);
+    rest = 0;
+  }
+  memset(block + rest, 0, 56 - rest);
+  uint64_t bits = (uint64_t) len * 8;
+  int i;
+  for (i = 0; i < 8; i++) {
+    block[63 - i] = (unsigned char) (bits >> (i * 8));
+  }
+  mrb_hiredis_sha1_block(state, block);
+  for (i = 0; i < 20; i++) {
+    unsigned char byte = (unsigned char) (state[i / 4] >> (24 - (i % 4) * 8));
+    hex[i * 2] = digits[byte >> 4];
+    hex[i * 2 + 1] = digits[byte & 0x0f];
+  }
+}
+
+/* Hiredis::Async replies are redisReply trees which only live until their
+ * callback returned. Their nodes are kept on a per connection free list
+ * instead of going back to malloc, strings which fit are stored inline in
+ * the node and everything else is allocated through the connection's
+ * mrb_state. hiredis still frees the reply it was reading after the
+ * connection is gone, so the pool stays around until every node is back. */
+#define MRB_HIREDIS_POOL_INLINE 48
+#ifndef MRB_HIREDIS_POOL_MAX_FREE
+#define MRB_HIREDIS_POOL_MAX_FREE 1024
+#endif
+
+typedef struct mrb_hiredis_reply_pool mrb_hiredis_reply_pool;
+
+typedef struct mrb_hiredis_reply_node {
+  redisReply reply; /* must stay first, hiredis only sees the redisReply */
+  mrb_hiredis_reply_pool *pool;
+  struct mrb_hiredis_reply_node *next;
+  char str[MRB_HIREDIS_POOL_INLINE];
+} mrb_hiredis_reply_node;
+
+struct mrb_hiredis_reply_pool {
+  mrb_state *mrb;
+  mrb_hiredis_reply_node *free;
+  size_t free_len;
+  size_t live;
+  /* bytes held by replies hiredis hasn't freed yet */
+  size_t bytes;
+  size_t peak;
+  mrb_bool closed;
+};
+
+static mrb_hiredis_reply_pool *
+mrb_hiredis_reply_pool_new(mrb_state *mrb)
+{
+  mrb_hiredis_reply_pool *pool = (mrb_hiredis_reply_pool *) mrb_calloc(mrb, 1, sizeof(mrb_hiredis_reply_pool));
+  pool->mrb = mrb;
+  return pool;
+}
+
+static void
+mrb_hiredis_reply_pool_destroy(mrb_hiredis_reply_pool *pool)
+{
+  mrb_state *mrb = pool->mrb;
+  mrb_hiredis_reply_node *node = pool->free;
+  while (node) {
+    mrb_hiredis_reply_node *next = node->next;
+    mrb_free(mrb, node);
+    node = next;
+  }
+  mrb_free(mrb, pool);
+}
+
+static void
+mrb_hiredis_reply_pool_close(mrb_hiredis_reply_pool *pool)
+{
+  pool->closed = TRUE;
+  if (pool->live == 0) {
+    mrb_hiredis_reply_pool_destroy(pool);
+  }
+}
+
+MRB_INLINE void
+mrb_hiredis_reply_pool_count(mrb_hiredis_reply_pool *pool, size_t bytes)
+{
+  pool->bytes += bytes;
+  if (pool->bytes > pool->peak) {
+    pool->peak = pool->bytes;
+  }
+}
+
+/* nothing may raise in here, hiredis reports NULL as out of memory */
+static redisReply *
+mrb_hiredis_pool_node(const redisReadTask *task)
+{
+  mrb_hiredis_reply_pool *pool = (mrb_hiredis_reply_pool *) task->privdata;
+  mrb_hiredis_reply_node *node = pool->free;
+  if (likely(node)) {
+    pool->free = node->next;
+    pool->free_len--;
+  } else {
+    node = (mrb_hiredis_reply_node *) mrb_malloc_simple(pool->mrb, sizeof(mrb_hiredis_reply_node));
+    if (unlikely(!node)) {
+      return NULL;
+    }
+    node->pool = pool;
+  }
+  memset(&node->reply, 0, sizeof(redisReply));
+  node->reply.type = task->type;
+  pool->live++;
+  mrb_hiredis_reply_pool_count(pool, sizeof(mrb_hiredis_reply_node));
+  return &node->reply;
+}
+
+static void
+mrb_hiredis_pool_freeObject(void *obj)
+{
+  redisReply *reply = (redisReply *) obj;
+  mrb_hiredis_reply_node *node = (mrb_hiredis_reply_node *) reply;
+  mrb_hiredis_reply_pool *pool = node->pool;
+  mrb_state *mrb = pool->mrb;
+
+  if (reply->element) {
+    size_t i;
+    for (i = 0; i < reply->elements; i++) {
+      if (reply->element[i]) {
+        mrb_hiredis_pool_freeObject(reply->element[i]);
+      }
+    }
+    mrb_free(mrb, reply->element);
+    pool->bytes -= reply->elements * sizeof(redisReply *);
+  }
+  if (reply->str && reply->str != node->str) {
+    mrb_free(mrb, reply->str);
+    pool->bytes -= reply->len + 1;
+  }
+
+  pool->bytes -= sizeof(mrb_hiredis_reply_node);
+  pool->live--;
+  if (!pool->closed && pool->free_len < MRB_HIREDIS_POOL_MAX_FREE) {
+    node->next = pool->free;
+    pool->free = node;
+    pool->free_len++;
+  } else {
+    mrb_free(mrb, node);
+    if (pool->closed && pool->live == 0) {
+      mrb_hiredis_reply_pool_destroy(pool);
+    }
+  }
+}
+
+static void *
+mrb_hiredis_pool_attach(const redisReadTask *task, redisReply *reply)
+{
+  if (task->parent) {
+    redisReply *parent = (redisReply *) task->parent->obj;
+    parent->element[task->idx] = reply;
+  }
+  return reply;
+}
+
+static void *
+mrb_hiredis_pool_createString(const redisReadTask *task, char *str, size_t len)
+{
+  redisReply *reply = mrb_hiredis_pool_node(task);
+  if (unlikely(!reply)) {
+    return NULL;
+  }
+  if (task->type == REDIS_REPLY_VERB) {
+    if (unlikely(len < 4)) {
+      mrb_hiredis_pool_freeObject(reply);
+      return NULL;
+    }
+    memcpy(reply->vtype, str, 3);
+    reply->vtype[3] = '\0';
+    str += 4;
+    len -= 4;
+  }
+  mrb_hiredis_reply_node *node = (mrb_hiredis_reply_node *) reply;
+  char *buf = node->str;
+  if (len >= MRB_HIREDIS_POOL_INLINE) {
+    mrb_hiredis_reply_pool *pool = node->pool;
+    if (unlikely(len == SIZE_MAX || !(buf = (char *) mrb_malloc_simple(pool->mrb, len + 1)))) {
+      mrb_hiredis_pool_freeObject(reply);
+      return NULL;
+    }
+    mrb_hiredis_reply_pool_count(pool, len + 1);
+  }
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  reply->str = buf;
+  reply->len = len;
+  return mrb_hiredis_pool_attach(task, reply);
+}
+
+static void *
+mrb_hiredis_pool_createArray(const redisReadTask *task, size_t elements)
+{
+  redisReply *reply = mrb_hiredis_pool_node(task);
+  if (unlikely(!reply)) {
+    return NULL;
+  }
+  if (elements > 0) {
+    mrb_hiredis_reply_pool *pool = ((mrb_hiredis_reply_node *) reply)->pool;
+    if (unlikely(elements > SIZE_MAX / sizeof(redisReply *) ||
+      !(reply->element = (redisReply **) mrb_malloc_simple(pool->mrb, elements * sizeof(redisReply *))))) {
+      mrb_hiredis_pool_freeObject(reply);
+      return NULL;
+    }
+    memset(reply->element, 0, elements * sizeof(redisReply *));
+    reply->elements = elements;
+    mrb_hiredis_reply_pool_count(pool, elements * sizeof(redisReply *));
+  }
+  return mrb_hiredis_pool_attach(task, reply);
+}
+
+static void *
+mrb_hiredis_pool_createInteger(const redisReadTask *task, long long integer)
+{
+  redisReply *reply = mrb_hiredis_pool_node(task);
+  if (unlikely(!reply)) {
+    return NULL;
+  }
+  reply->integer = integer;
+  return mrb_hiredis_pool_attach(task, reply);
+}
+
+static void *
+mrb_hiredis_pool_createDouble(const redisReadTask *task, double dval, char *str, size_t len)
+{
+  redisReply *reply = (redisReply *) mrb_hiredis_pool_createString(task, str, len);
+  if (likely(reply)) {
+    reply->dval = dval;
+  }
+  return reply;
+}
+
+static void *
+mrb_hiredis_pool_createNil(const redisReadTask *task)
+{
+  redisReply *reply = mrb_hiredis_pool_node(task);
+  return reply ? mrb_hiredis_pool_attach(task, reply) : NULL;
+}
+
+static void *
+mrb_hiredis_pool_createBool(const redisReadTask *task, int bval)
+{
+  redisReply *reply = mrb_hiredis_pool_node(task);
+  if (unlikely(!reply)) {
+    return NULL;
+  }
+  reply->integer = bval != 0;
+  return mrb_hiredis_pool_attach(task, reply);
+}
+
+static redisReplyObjectFunctions mrb_hiredis_pool_functions = {
+  .createString  = mrb_hiredis_pool_createString,
+  .createArray   = mrb_hiredis_pool_createArray,
+  .createInteger = mrb_hiredis_pool_createInteger,
+  .createDouble  = mrb_hiredis_pool_createDouble,
+  .createNil     = mrb_hiredis_pool_createNil,
+  .createBool    = mrb_hiredis_pool_createBool,
+  .freeObject    = mrb_hiredis_pool_freeObject
+};
+
+static const struct mrb_data_type mrb_redisCallbackFn_cb_data_type = {
+  "$i_mrb_redisCallbackFn_cb_data_type", mrb_free
+};
+
+typedef struct {
+  mrb_state *mrb;
+  mrb_value self;
+  mrb_value callbacks;
+  mrb_value evloop;
+  redisAsyncContext *async_context;
+  mrb_value replies;
+  mrb_value subscriptions[MRB_HIREDIS_PUBSUB_TABLES];
+  mrb_hiredis_argv argv;
+  mrb_int replies_free;
+  int epfd;
+  int timerfd;
+  int cork_timerfd;
+  uint32_t events;
+  /* hiredis' ev hooks can't raise, a failed epoll or timerfd call waits here */
+  const char *epoll_failed;
+  int epoll_errno;
+  mrb_int in_flight;
+  mrb_hiredis_stats stats;
+  mrb_hiredis_intern intern;
+  /* commands with large arguments waiting to go out ahead of async_context->c.obuf */
+  mrb_hiredis_iov iov;
+  mrb_value iov_strings;
+  mrb_hiredis_reply_pool *pool;
+  /* while corked hiredis asking to write is held back in cork_write */
+  void (*add_write)(void *privdata);
+  mrb_bool corked;
+  mrb_bool cork_write;
+  size_t cork_bytes;
+  uint64_t cork_delay;
+  uint64_t cork_since;
+} mrb_hiredis_async_context;
+
+/* Pending reply blocks live in the replies Array, which keeps them visible
+ * to the GC. hiredis gets the slot index as privdata; free slots hold the
+ * index of the next free one, so registering and releasing are O(1). */
+static mrb_int
+mrb_hiredis_replies_register(mrb_state *mrb, mrb_hiredis_async_context *mrb_async_context, mrb_value block)
+{
+  mrb_value replies = mrb_async_context->replies;
+  mrb_int slot = mrb_async_context->replies_free;
+  if (slot >= 0) {
+    mrb_async_context->replies_free = mrb_integer(RARRAY_PTR(replies)[slot]);
+    mrb_ary_set(mrb, replies, slot, block);
+  } else {
+    slot = RARRAY_LEN(replies);
+    mrb_ary_push(mrb, replies, block);
+  }
+  return slot;
+}
+
+static mrb_value
+mrb_hiredis_replies_release(mrb_state *mrb, mrb_hiredis_async_context *mrb_async_context, mrb_int slot)
+{
+  mrb_value replies = mrb_async_context->replies;
+  mrb_value block = RARRAY_PTR(replies)[slot];
+  mrb_ary_set(mrb, replies, slot, mrb_int_value(mrb, mrb_async_context->replies_free));
+  mrb_async_context->replies_free = slot;
+  return block;
+}
+
+static void
+mrb_hiredis_async_context_free(mrb_state *mrb, mrb_hiredis_async_context *mrb_async_context)
+{
+  mrb_hiredis_argv_free(mrb, &mrb_async_context->argv);
+  mrb_hiredis_stats_free(mrb, &mrb_async_context->stats);
+  mrb_hiredis_iov_free(mrb, &mrb_async_context->iov);
+  mrb_hiredis_reply_pool_close(mrb_async_context->pool);
+#ifdef MRB_HIREDIS_EPOLL
+  if (mrb_async_context->epfd != -1) {
+    close(mrb_async_context->epfd);
+  }
+  if (mrb_async_context->timerfd != -1) {
+    close(mrb_async_context->timerfd);
+  }
+  if (mrb_async_context->cork_timerfd != -1) {
+    close(mrb_async_context->cork_timerfd);
+  }
+#endif
+  mrb_free(mrb, mrb_async_context);
+}
+
+static void
+mrb_redisAsyncFree_gc(mrb_state *mrb, void *p)
+{
+  redisAsyncContext *async_context = (redisAsyncContext *) p;
+  mrb_hiredis_async_context *mrb_async_context = (mrb_hiredis_async_context *) async_context->data;
+  /* nothing may call back into mruby while the GC tears this down */
+  async_context->data = async_context->ev.data = NULL;
+  async_context->dataCleanup = NULL;
+  async_context->ev.addRead = async_context->ev.delRead = NULL;
+  async_context->ev.addWrite = async_context->ev.delWrite = NULL;
+  async_context->ev.cleanup = NULL;
+  async_context->ev.scheduleTimer = NULL;
+  if (mrb_async_context) {
+    mrb_hiredis_stats_uninstall(&mrb_async_context->stats, &async_context->c);
+  }
+  redisAsyncFree(async_context);
+  if (mrb_async_context) {
+    mrb_hiredis_async_context_free(mrb, mrb_async_context);
+  }
+}
+
+static const struct mrb_data_type mrb_redisAsyncContext_type = {
+  "$i_mrb_redisAsyncContext_type", mrb_redisAsyncFree_gc
+};
+
+/* Hiredis::Threaded: a helper thread owns the socket and a plain hiredis
+ * reader, requests go to it and parsed redisReply trees come back through
+ * two single producer single consumer rings. */
+#define MRB_HIREDIS_RING_SIZE 1024
+#define MRB_HIREDIS_CACHE_LINE 64
+
+typedef struct {
+  void *slots[MRB_HIREDIS_RING_SIZE];
+  /* consumer and producer index on their own cache lines */
+  size_t head __attribute__((aligned(MRB_HIREDIS_CACHE_LINE)));
+  size_t tail __attribute__((aligned(MRB_HIREDIS_CACHE_LINE)));
+} mrb_hiredis_ring;
+
+static mrb_bool
+mrb_hiredis_ring_push(mrb_hiredis_ring *ring, void *item)
+{
+  size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == MRB_HIREDIS_RING_SIZE) {
+    return FALSE;
+  }
+  ring->slots[tail & (MRB_HIREDIS_RING_SIZE - 1)] = item;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return TRUE;
+}
+
+static void *
+mrb_hiredis_ring_pop(mrb_hiredis_ring *ring)
+{
+  size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+  void *item = ring->slots[head & (MRB_HIREDIS_RING_SIZE - 1)];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+/* producer side */
+static mrb_bool
+mrb_hiredis_ring_full(mrb_hiredis_ring *ring)
+{
+  return ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == MRB_HIREDIS_RING_SIZE;
+}
+
+/* consumer side */
+static mrb_bool
+mrb_hiredis_ring_empty(mrb_hiredis_ring *ring)
+{
+  return ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+typedef struct {
+  redisContext *context;
+  pthread_t thread;
+  mrb_bool running;
+  int wake_io[2];
+  int wake_mrb[2];
+  mrb_hiredis_ring requests;
+  mrb_hiredis_ring replies;
+  /* set by a side before it sleeps on its pipe, cleared by whoever wakes it */
+  int io_waiting;
+  int mrb_waiting;
+  int stop;
+  /* the I/O thread is gone, context->err tells why */
+  int stopped;
+  /* the fields below are only touched by the mruby thread */
+  sds obuf;
+  mrb_int pending;
+  mrb_hiredis_argv argv;
+  mrb_hiredis_intern intern;
+} mrb_hiredis_threaded;
+
+static void
+mrb_hiredis_threaded_wake(int *waiting, int fd)
+{
+  if (__atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST)) {
+    char byte = 0;
+    while (write(fd, &byte, 1) == -1 && errno == EINTR);
+  }
+}
+
+static void
+mrb_hiredis_threaded_drain(int fd)
+{
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+static void *
+mrb_hiredis_threaded_run(void *data)
+{
+  mrb_hiredis_threaded *threaded = (mrb_hiredis_threaded *) data;
+  redisContext *context = threaded->context;
+  /* parsed, but the replies ring was full */
+  void *held = NULL;
+
+  while (!__atomic_load_n(&threaded->stop, __ATOMIC_ACQUIRE)) {
+    sds request;
+    while ((request = (sds) mrb_hiredis_ring_pop(&threaded->requests))) {
+      if (sdslen(context->obuf) == 0) {
+        sdsfree(context->obuf);
+        context->obuf = request;
+      } else {
+        context->obuf = sdscatsds(context->obuf, request);
+        sdsfree(request);
+        if (unlikely(!context->obuf)) {
+          context->err = REDIS_ERR_OOM;
+          strcpy(context->errstr, "Out of memory");
+          goto done;
+        }
+      }
+      mrb_hiredis_threaded_wake(&threaded->mrb_waiting, threaded->wake_mrb[1]);
+    }
+
+    for (;;) {
+      if (!held) {
+        if (unlikely(redisGetReplyFromReader(context, &held) != REDIS_OK)) {
+          goto done;
+        }
+        if (!held) {
+          break;
+        }
+      }
+      /* nothing on the mruby side waits for RESP3 push messages, they would be taken for replies */
+      if (unlikely(((redisReply *) held)->type == REDIS_REPLY_PUSH)) {
+        freeReplyObject(held);
+        held = NULL;
+        continue;
+      }
+      if (!mrb_hiredis_ring_push(&threaded->replies, held)) {
+        __atomic_store_n(&threaded->io_waiting, 1, __ATOMIC_SEQ_CST);
+        if (!mrb_hiredis_ring_push(&threaded->replies, held)) {
+          break;
+        }
+        __atomic_store_n(&threaded->io_waiting, 0, __ATOMIC_SEQ_CST);
+      }
+      held = NULL;
+      mrb_hiredis_threaded_wake(&threaded->mrb_waiting, threaded->wake_mrb[1]);
+    }
+
+    /* while a reply is held the socket isn't read, the server sees that as backpressure */
+    short events = (held ? 0 : POLLIN) | (sdslen(context->obuf) > 0 ? POLLOUT : 0);
+    struct pollfd fds[2] = {
+      { threaded->wake_io[0], POLLIN, 0 },
+      { events ? context->fd : -1, events, 0 }
+    };
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      context->err = REDIS_ERR_IO;
+      snprintf(context->errstr, sizeof(context->errstr), "poll: %s", strerror(errno));
+      goto done;
+    }
+    if (fds[0].revents) {
+      mrb_hiredis_threaded_drain(threaded->wake_io[0]);
+    }
+    if (fds[1].revents & POLLOUT) {
+      int written = 0;
+      if (unlikely(redisBufferWrite(context, &written) != REDIS_OK)) {
+        goto done;
+      }
+    }
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      if (unlikely(redisBufferRead(context) != REDIS_OK)) {
+        goto done;
+      }
+    }
+  }
+
+done:
+  if (held) {
+    freeReplyObject(held);
+  }
+  __atomic_store_n(&threaded->stopped, 1, __ATOMIC_RELEASE);
+  char byte = 0;
+  while (write(threaded->wake_mrb[1], &byte, 1) == -1 && errno == EINTR);
+  return NULL;
+}
+
+/* joins the I/O thread and drops what is still queued in either direction */
+static void
+mrb_hiredis_threaded_stop(mrb_hiredis_threaded *threaded)
+{
+  if (threaded->running) {
+    __atomic_store_n(&threaded->stop, 1, __ATOMIC_RELEASE);
+    char byte = 0;
+    while (write(threaded->wake_io[1], &byte, 1) == -1 && errno == EINTR);
+    pthread_join(threaded->thread, NULL);
+    threaded->running = FALSE;
+  }
+  void *item;
+  while ((item = mrb_hiredis_ring_pop(&threaded->requests))) {
+    sdsfree((sds) item);
+  }
+  while ((item = mrb_hiredis_ring_pop(&threaded->replies))) {
+    freeReplyObject(item);
+  }
+}
+
+static void
+mrb_hiredis_threaded_free(mrb_state *mrb, void *p)
+{
+  mrb_hiredis_threaded *threaded = (mrb_hiredis_threaded *) p;
+  mrb_hiredis_threaded_stop(threaded);
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (threaded->wake_io[i] != -1) {
+      close(threaded->wake_io[i]);
+    }
+    if (threaded->wake_mrb[i] != -1) {
+      close(threaded->wake_mrb[i]);
+    }
+  }
+  sdsfree(threaded->obuf);
+  if (threaded->context) {
+    redisFree(threaded->context);
+  }
+  mrb_hiredis_argv_free(mrb, &threaded->argv);
+  mrb_free(mrb, threaded);
+}
+
+static const struct mrb_data_type mrb_hiredis_threaded_type = {
+  "$i_mrb_hiredis_threaded_type", mrb_hiredis_threaded_free
+};
+
+#ifdef MRB_HIREDIS_BENCH
+/* in-process RESP server for the benchmarks, see src/mrb_hiredis_mock.c */
+void mrb_hiredis_mock_init(mrb_state *mrb, struct RClass *hiredis_class);
+#endif
+
 #endif
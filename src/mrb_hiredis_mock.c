@@ -0,0 +1,602 @@
+#ifdef MRB_HIREDIS_BENCH
+
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/error.h>
+#include <mruby/hash.h>
+#include <mruby/numeric.h>
+#include <mruby/string.h>
+#include <mruby/hiredis.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* A RESP server on 127.0.0.1 running on its own thread, it answers every
+ * command with a canned reply so the benchmarks measure the client side
+ * only. Everything the thread touches is allocated with plain malloc. */
+
+#define MRB_HIREDIS_MOCK_NAME_SIZE 32
+#define MRB_HIREDIS_MOCK_IOV 64
+
+typedef struct {
+  char name[MRB_HIREDIS_MOCK_NAME_SIZE];
+  size_t len;
+  char *reply;
+  size_t reply_len;
+} mrb_hiredis_mock_reply;
+
+typedef struct {
+  const char *data;
+  size_t len;
+} mrb_hiredis_mock_chunk;
+
+typedef struct {
+  int fd;
+  char *in;
+  size_t in_len;
+  size_t in_capa;
+  mrb_hiredis_mock_chunk *out;
+  size_t out_head;
+  size_t out_len;
+  size_t out_capa;
+} mrb_hiredis_mock_client;
+
+typedef struct {
+  int listen_fd;
+  int wake[2];
+  int port;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  mrb_hiredis_mock_reply *replies;
+  size_t replies_len;
+  /* replaced replies may still be queued on a client, they live until close */
+  char **retired;
+  size_t retired_len;
+  uint64_t commands;
+  mrb_hiredis_mock_client *clients;
+  size_t clients_len;
+} mrb_hiredis_mock;
+
+static const char mrb_hiredis_mock_ok[] = "+OK\r\n";
+
+static void
+mrb_hiredis_mock_client_close(mrb_hiredis_mock_client *client)
+{
+  close(client->fd);
+  free(client->in);
+  free(client->out);
+}
+
+static int
+mrb_hiredis_mock_push(mrb_hiredis_mock_client *client, const char *data, size_t len)
+{
+  if (client->out_head + client->out_len == client->out_capa) {
+    if (client->out_head > 0) {
+      memmove(client->out, client->out + client->out_head, client->out_len * sizeof(mrb_hiredis_mock_chunk));
+      client->out_head = 0;
+    } else {
+      size_t capa = client->out_capa ? client->out_capa * 2 : 64;
+      mrb_hiredis_mock_chunk *out = (mrb_hiredis_mock_chunk *) realloc(client->out, capa * sizeof(mrb_hiredis_mock_chunk));
+      if (!out) {
+        return -1;
+      }
+      client->out = out;
+      client->out_capa = capa;
+    }
+  }
+  client->out[client->out_head + client->out_len].data = data;
+  client->out[client->out_head + client->out_len].len = len;
+  client->out_len++;
+  return 0;
+}
+
+static const char *
+mrb_hiredis_mock_line(const char *p, const char *end, long long *value)
+{
+  const char *cr = (const char *) memchr(p, '\r', end - p);
+  if (!cr || cr + 1 >= end) {
+    return NULL;
+  }
+  *value = strtoll(p + 1, NULL, 10);
+  return cr + 2;
+}
+
+/* parses every complete command in the input buffer and queues its reply,
+ * runs with the lock held */
+static int
+mrb_hiredis_mock_parse(mrb_hiredis_mock *mock, mrb_hiredis_mock_client *client)
+{
+  const char *p = client->in;
+  const char *end = client->in + client->in_len;
+
+  while (p < end) {
+    const char *name = NULL;
+    size_t name_len = 0;
+    const char *next;
+
+    if (*p == '*') {
+      long long argc;
+      next = mrb_hiredis_mock_line(p, end, &argc);
+      long long i;
+      for (i = 0; next && i < argc; i++) {
+        long long len;
+        if (next >= end) {
+          next = NULL;
+          break;
+        }
+        if (*next != '$') {
+          return -1;
+        }
+        const char *data = mrb_hiredis_mock_line(next, end, &len);
+        if (!data || end - data < len + 2) {
+          next = NULL;
+          break;
+        }
+        if (i == 0) {
+          name = data;
+          name_len = (size_t) len;
+        }
+        next = data + len + 2;
+      }
+    } else {
+      /* inline command, the benchmarks only send these by hand */
+      const char *nl = (const char *) memchr(p, '\n', end - p);
+      next = nl ? nl + 1 : NULL;
+      if (next) {
+        name = p;
+        while (name_len < (size_t) (nl - p) && p[name_len] != ' ' && p[name_len] != '\r') {
+          name_len++;
+        }
+      }
+    }
+    if (!next) {
+      break;
+    }
+
+    const char *reply = mrb_hiredis_mock_ok;
+    size_t reply_len = sizeof(mrb_hiredis_mock_ok) - 1;
+    size_t i;
+    for (i = 0; i < mock->replies_len; i++) {
+      if (mock->replies[i].len == name_len && strncasecmp(mock->replies[i].name, name, name_len) == 0) {
+        reply = mock->replies[i].reply;
+        reply_len = mock->replies[i].reply_len;
+        break;
+      }
+    }
+    if (mrb_hiredis_mock_push(client, reply, reply_len) == -1) {
+      return -1;
+    }
+    mock->commands++;
+    p = next;
+  }
+
+  client->in_len = end - p;
+  memmove(client->in, p, client->in_len);
+  return 0;
+}
+
+static int
+mrb_hiredis_mock_read(mrb_hiredis_mock *mock, mrb_hiredis_mock_client *client)
+{
+  if (client->in_capa - client->in_len < 16 * 1024) {
+    size_t capa = client->in_capa ? client->in_capa * 2 : 64 * 1024;
+    char *in = (char *) realloc(client->in, capa);
+    if (!in) {
+      return -1;
+    }
+    client->in = in;
+    client->in_capa = capa;
+  }
+  ssize_t nread = read(client->fd, client->in + client->in_len, client->in_capa - client->in_len);
+  if (nread == -1) {
+    return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+  }
+  if (nread == 0) {
+    return -1;
+  }
+  client->in_len += (size_t) nread;
+
+  pthread_mutex_lock(&mock->lock);
+  int rc = mrb_hiredis_mock_parse(mock, client);
+  pthread_mutex_unlock(&mock->lock);
+  return rc;
+}
+
+static int
+mrb_hiredis_mock_write(mrb_hiredis_mock_client *client)
+{
+  while (client->out_len > 0) {
+    struct iovec iov[MRB_HIREDIS_MOCK_IOV];
+    int iovcnt = 0;
+    while (iovcnt < MRB_HIREDIS_MOCK_IOV && (size_t) iovcnt < client->out_len) {
+      mrb_hiredis_mock_chunk *chunk = &client->out[client->out_head + iovcnt];
+      iov[iovcnt].iov_base = (void *) chunk->data;
+      iov[iovcnt].iov_len = chunk->len;
+      iovcnt++;
+    }
+    ssize_t nwritten = writev(client->fd, iov, iovcnt);
+    if (nwritten == -1) {
+      return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    size_t left = (size_t) nwritten;
+    while (left > 0) {
+      mrb_hiredis_mock_chunk *chunk = &client->out[client->out_head];
+      if (left >= chunk->len) {
+        left -= chunk->len;
+        client->out_head++;
+        client->out_len--;
+      } else {
+        chunk->data += left;
+        chunk->len -= left;
+        left = 0;
+      }
+    }
+  }
+  client->out_head = 0;
+  return 0;
+}
+
+static void
+mrb_hiredis_mock_accept(mrb_hiredis_mock *mock)
+{
+  int fd = accept(mock->listen_fd, NULL, NULL);
+  if (fd == -1) {
+    return;
+  }
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  mrb_hiredis_mock_client *clients = (mrb_hiredis_mock_client *) realloc(mock->clients, (mock->clients_len + 1) * sizeof(mrb_hiredis_mock_client));
+  if (!clients) {
+    close(fd);
+    return;
+  }
+  mock->clients = clients;
+  memset(&mock->clients[mock->clients_len], 0, sizeof(mrb_hiredis_mock_client));
+  mock->clients[mock->clients_len].fd = fd;
+  mock->clients_len++;
+}
+
+static void *
+mrb_hiredis_mock_run(void *arg)
+{
+  mrb_hiredis_mock *mock = (mrb_hiredis_mock *) arg;
+  struct pollfd *fds = NULL;
+
+  for (;;) {
+    size_t nfds = mock->clients_len + 2;
+    struct pollfd *grown = (struct pollfd *) realloc(fds, nfds * sizeof(struct pollfd));
+    if (!grown) {
+      break;
+    }
+    fds = grown;
+    fds[0].fd = mock->wake[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = mock->listen_fd;
+    fds[1].events = POLLIN;
+    size_t i;
+    for (i = 0; i < mock->clients_len; i++) {
+      fds[i + 2].fd = mock->clients[i].fd;
+      fds[i + 2].events = mock->clients[i].out_len > 0 ? POLLOUT : POLLIN;
+    }
+
+    if (poll(fds, nfds, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    if (fds[0].revents) {
+      break;
+    }
+
+    /* walk backwards so closed clients can be swapped out with the last one */
+    for (i = mock->clients_len; i > 0; i--) {
+      mrb_hiredis_mock_client *client = &mock->clients[i - 1];
+      short revents = fds[i + 1].revents;
+      int rc = 0;
+      if (revents & (POLLERR | POLLNVAL)) {
+        rc = -1;
+      } else if (revents & (POLLIN | POLLHUP)) {
+        rc = mrb_hiredis_mock_read(mock, client);
+        if (rc == 0) {
+          rc = mrb_hiredis_mock_write(client);
+        }
+      } else if (revents & POLLOUT) {
+        rc = mrb_hiredis_mock_write(client);
+      }
+      if (rc == -1) {
+        mrb_hiredis_mock_client_close(client);
+        mock->clients[i - 1] = mock->clients[--mock->clients_len];
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      mrb_hiredis_mock_accept(mock);
+    }
+  }
+
+  free(fds);
+  return NULL;
+}
+
+static void
+mrb_hiredis_mock_stop(mrb_hiredis_mock *mock)
+{
+  if (mock->wake[1] != -1) {
+    char byte = 0;
+    while (write(mock->wake[1], &byte, 1) == -1 && errno == EINTR);
+    pthread_join(mock->thread, NULL);
+    close(mock->wake[1]);
+    mock->wake[1] = -1;
+  }
+}
+
+static void
+mrb_hiredis_mock_free(mrb_state *mrb, void *p)
+{
+  mrb_hiredis_mock *mock = (mrb_hiredis_mock *) p;
+  mrb_hiredis_mock_stop(mock);
+  size_t i;
+  for (i = 0; i < mock->clients_len; i++) {
+    mrb_hiredis_mock_client_close(&mock->clients[i]);
+  }
+  free(mock->clients);
+  for (i = 0; i < mock->replies_len; i++) {
+    free(mock->replies[i].reply);
+  }
+  free(mock->replies);
+  for (i = 0; i < mock->retired_len; i++) {
+    free(mock->retired[i]);
+  }
+  free(mock->retired);
+  if (mock->wake[0] != -1) {
+    close(mock->wake[0]);
+  }
+  if (mock->listen_fd != -1) {
+    close(mock->listen_fd);
+  }
+  pthread_mutex_destroy(&mock->lock);
+  free(mock);
+}
+
+static const struct mrb_data_type mrb_hiredis_mock_type = {
+  "$i_mrb_hiredis_mock_type", mrb_hiredis_mock_free
+};
+
+static mrb_value
+mrb_hiredis_mock_initialize(mrb_state *mrb, mrb_value self)
+{
+  mrb_int port = 0;
+  mrb_get_args(mrb, "|i", &port);
+
+  mrb_hiredis_mock *mock = (mrb_hiredis_mock *) calloc(1, sizeof(mrb_hiredis_mock));
+  if (!mock) {
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->nomem_err));
+  }
+  mock->listen_fd = mock->wake[0] = mock->wake[1] = -1;
+  pthread_mutex_init(&mock->lock, NULL);
+  mrb_data_init(self, mock, &mrb_hiredis_mock_type);
+
+  mock->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (mock->listen_fd == -1) {
+    mrb_sys_fail(mrb, "socket");
+  }
+  int on = 1;
+  setsockopt(mock->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t) port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(mock->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+    mrb_sys_fail(mrb, "bind");
+  }
+  if (listen(mock->listen_fd, 128) == -1) {
+    mrb_sys_fail(mrb, "listen");
+  }
+  socklen_t addrlen = sizeof(addr);
+  if (getsockname(mock->listen_fd, (struct sockaddr *) &addr, &addrlen) == -1) {
+    mrb_sys_fail(mrb, "getsockname");
+  }
+  mock->port = ntohs(addr.sin_port);
+
+  if (pipe(mock->wake) == -1) {
+    mock->wake[0] = mock->wake[1] = -1;
+    mrb_sys_fail(mrb, "pipe");
+  }
+  int rc = pthread_create(&mock->thread, NULL, mrb_hiredis_mock_run, mock);
+  if (rc != 0) {
+    errno = rc;
+    close(mock->wake[1]);
+    mock->wake[1] = -1;
+    mrb_sys_fail(mrb, "pthread_create");
+  }
+
+  return self;
+}
+
+static void
+mrb_hiredis_mock_encode(mrb_state *mrb, mrb_value buf, mrb_value value)
+{
+  char head[32];
+  switch (mrb_type(value)) {
+    case MRB_TT_FALSE:
+      if (mrb_nil_p(value)) {
+        mrb_str_cat_lit(mrb, buf, "$-1\r\n");
+      } else {
+        mrb_str_cat_lit(mrb, buf, "#f\r\n");
+      }
+      break;
+    case MRB_TT_TRUE:
+      mrb_str_cat_lit(mrb, buf, "#t\r\n");
+      break;
+    case MRB_TT_INTEGER:
+      mrb_str_cat(mrb, buf, head, snprintf(head, sizeof(head), ":%" MRB_PRId "\r\n", mrb_integer(value)));
+      break;
+#ifndef MRB_NO_FLOAT
+    case MRB_TT_FLOAT:
+      mrb_str_cat(mrb, buf, head, snprintf(head, sizeof(head), ",%.17g\r\n", mrb_float(value)));
+      break;
+#endif
+    case MRB_TT_SYMBOL: {
+      mrb_int len;
+      const char *name = mrb_sym2name_len(mrb, mrb_symbol(value), &len);
+      mrb_str_cat_lit(mrb, buf, "+");
+      mrb_str_cat(mrb, buf, name, len);
+      mrb_str_cat_lit(mrb, buf, "\r\n");
+    } break;
+    case MRB_TT_STRING:
+      mrb_str_cat(mrb, buf, head, snprintf(head, sizeof(head), "$%" MRB_PRId "\r\n", RSTRING_LEN(value)));
+      mrb_str_cat_str(mrb, buf, value);
+      mrb_str_cat_lit(mrb, buf, "\r\n");
+      break;
+    case MRB_TT_ARRAY: {
+      mrb_int len = RARRAY_LEN(value);
+      mrb_str_cat(mrb, buf, head, snprintf(head, sizeof(head), "*%" MRB_PRId "\r\n", len));
+      mrb_int i;
+      for (i = 0; i < len; i++) {
+        mrb_hiredis_mock_encode(mrb, buf, mrb_ary_ref(mrb, value, i));
+      }
+    } break;
+    case MRB_TT_HASH: {
+      mrb_value keys = mrb_hash_keys(mrb, value);
+      mrb_int len = RARRAY_LEN(keys);
+      mrb_str_cat(mrb, buf, head, snprintf(head, sizeof(head), "%%%" MRB_PRId "\r\n", len));
+      mrb_int i;
+      for (i = 0; i < len; i++) {
+        mrb_value key = mrb_ary_ref(mrb, keys, i);
+        mrb_hiredis_mock_encode(mrb, buf, key);
+        mrb_hiredis_mock_encode(mrb, buf, mrb_hash_get(mrb, value, key));
+      }
+    } break;
+    case MRB_TT_EXCEPTION: {
+      mrb_value message = mrb_funcall(mrb, value, "message", 0);
+      mrb_str_cat_lit(mrb, buf, "-");
+      mrb_str_cat_str(mrb, buf, mrb_str_to_str(mrb, message));
+      mrb_str_cat_lit(mrb, buf, "\r\n");
+    } break;
+    default:
+      mrb_raisef(mrb, E_TYPE_ERROR, "cannot encode %T as a reply", value);
+  }
+}
+
+static mrb_hiredis_mock *
+mrb_hiredis_mock_get(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_mock *mock = (mrb_hiredis_mock *) mrb_data_get_ptr(mrb, self, &mrb_hiredis_mock_type);
+  if (!mock) {
+    mrb_raise(mrb, E_IO_ERROR, "closed server");
+  }
+  return mock;
+}
+
+static mrb_value
+mrb_hiredis_mock_set_reply(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_mock *mock = mrb_hiredis_mock_get(mrb, self);
+  mrb_sym command;
+  mrb_value value;
+  mrb_get_args(mrb, "no", &command, &value);
+
+  mrb_int name_len;
+  const char *name = mrb_sym2name_len(mrb, command, &name_len);
+  if (name_len >= MRB_HIREDIS_MOCK_NAME_SIZE) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "command name too long");
+  }
+  mrb_value buf = mrb_str_new_capa(mrb, 64);
+  mrb_hiredis_mock_encode(mrb, buf, value);
+  char *reply = (char *) malloc(RSTRING_LEN(buf));
+  char **retired = (char **) realloc(mock->retired, (mock->retired_len + 1) * sizeof(char *));
+  if (!reply || !retired) {
+    free(reply);
+    if (retired) {
+      mock->retired = retired;
+    }
+    mrb_exc_raise(mrb, mrb_obj_value(mrb->nomem_err));
+  }
+  mock->retired = retired;
+  memcpy(reply, RSTRING_PTR(buf), RSTRING_LEN(buf));
+
+  pthread_mutex_lock(&mock->lock);
+  size_t i;
+  for (i = 0; i < mock->replies_len; i++) {
+    if (mock->replies[i].len == (size_t) name_len && strncasecmp(mock->replies[i].name, name, name_len) == 0) {
+      break;
+    }
+  }
+  if (i == mock->replies_len) {
+    mrb_hiredis_mock_reply *replies = (mrb_hiredis_mock_reply *) realloc(mock->replies, (mock->replies_len + 1) * sizeof(mrb_hiredis_mock_reply));
+    if (!replies) {
+      pthread_mutex_unlock(&mock->lock);
+      free(reply);
+      mrb_exc_raise(mrb, mrb_obj_value(mrb->nomem_err));
+    }
+    mock->replies = replies;
+    memcpy(mock->replies[i].name, name, name_len);
+    mock->replies[i].len = (size_t) name_len;
+    mock->replies_len++;
+  } else {
+    mock->retired[mock->retired_len++] = mock->replies[i].reply;
+  }
+  mock->replies[i].reply = reply;
+  mock->replies[i].reply_len = RSTRING_LEN(buf);
+  pthread_mutex_unlock(&mock->lock);
+
+  return self;
+}
+
+static mrb_value
+mrb_hiredis_mock_port(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_mock *mock = mrb_hiredis_mock_get(mrb, self);
+  return mrb_int_value(mrb, mock->port);
+}
+
+static mrb_value
+mrb_hiredis_mock_commands(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_mock *mock = mrb_hiredis_mock_get(mrb, self);
+  pthread_mutex_lock(&mock->lock);
+  uint64_t commands = mock->commands;
+  pthread_mutex_unlock(&mock->lock);
+  return mrb_int_value(mrb, (mrb_int) commands);
+}
+
+static mrb_value
+mrb_hiredis_mock_close(mrb_state *mrb, mrb_value self)
+{
+  mrb_hiredis_mock *mock = (mrb_hiredis_mock *) DATA_PTR(self);
+  if (mock) {
+    mrb_hiredis_mock_free(mrb, mock);
+    mrb_data_init(self, NULL, NULL);
+  }
+  return mrb_nil_value();
+}
+
+void
+mrb_hiredis_mock_init(mrb_state *mrb, struct RClass *hiredis_class)
+{
+  struct RClass *mock_class = mrb_define_class_under(mrb, hiredis_class, "MockServer", mrb->object_class);
+  MRB_SET_INSTANCE_TT(mock_class, MRB_TT_DATA);
+  mrb_define_method(mrb, mock_class, "initialize", mrb_hiredis_mock_initialize, MRB_ARGS_OPT(1));
+  mrb_define_method(mrb, mock_class, "reply",      mrb_hiredis_mock_set_reply,  MRB_ARGS_REQ(2));
+  mrb_define_method(mrb, mock_class, "port",       mrb_hiredis_mock_port,       MRB_ARGS_NONE());
+  mrb_define_method(mrb, mock_class, "commands",   mrb_hiredis_mock_commands,   MRB_ARGS_NONE());
+  mrb_define_method(mrb, mock_class, "close",      mrb_hiredis_mock_close,      MRB_ARGS_NONE());
+}
+
+#endif
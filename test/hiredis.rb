@@ -26,6 +26,26 @@ assert("Pipelined commands") do
   hiredis.call(:del, "mruby-hiredis-test:foo")
 end
 
+assert("Hiredis#pipelined") do
+  hiredis = Hiredis.new
+  ret = hiredis.pipelined do |pipeline|
+    pipeline.queue(:set, "mruby-hiredis-test:foo", "bar")
+    pipeline.queue(:nonexistant)
+    pipeline.get("mruby-hiredis-test:foo")
+  end
+  assert_equal("OK", ret[0])
+  assert_kind_of(Hiredis::ReplyError, ret[1])
+  assert_equal("bar", ret[2])
+  assert_equal(0, hiredis.pending)
+
+  pipeline = Hiredis::Pipeline.new(hiredis)
+  assert_equal([], pipeline.flush)
+  pipeline.queue(:get, "mruby-hiredis-test:foo")
+  assert_equal(["bar"], pipeline.flush)
+  pipeline.queue(:del, "mruby-hiredis-test:foo")
+  assert_equal([1], pipeline.flush)
+end
+
 assert("Hiredis#transaction") do
   hiredis = Hiredis.new
   ret = hiredis.transaction([:set, "mruby-hiredis-test:foo", "bar"], [:get, "mruby-hiredis-test:foo"])
@@ -48,6 +68,554 @@ assert("Hiredis#incr") do
   hiredis.call(:del, "mruby-hiredis-test:foo")
 end
 
+assert("Hiredis command methods") do
+  hiredis = Hiredis.new
+  assert_equal("OK", hiredis.set("mruby-hiredis-test:foo", "bar"))
+  assert_equal("bar", hiredis.get("mruby-hiredis-test:foo"))
+  assert_kind_of(Hiredis::ReplyError, hiredis.nonexistant)
+  assert_raise(NoMethodError) { hiredis.nonexistant? }
+  pipeline = Hiredis::Pipeline.new(hiredis)
+  pipeline.get("mruby-hiredis-test:foo").nonexistant
+  replies = pipeline.flush
+  assert_equal("bar", replies[0])
+  assert_kind_of(Hiredis::ReplyError, replies[1])
+  hiredis.del("mruby-hiredis-test:foo")
+end
+
+assert("Hiredis#call nested replies") do
+  hiredis = Hiredis.new
+  hiredis.call(:del, "mruby-hiredis-test:hash")
+  hiredis.call(:hset, "mruby-hiredis-test:hash", "foo", "bar")
+  hiredis.call(:hset, "mruby-hiredis-test:hash", "baz", "1")
+  assert_equal({"foo" => "bar", "baz" => "1"}, hiredis.call(:hgetall, "mruby-hiredis-test:hash"))
+  assert_equal(["0", ["foo", "bar"]], hiredis.call(:hscan, "mruby-hiredis-test:hash", "0", "match", "foo"))
+  hiredis.call(:del, "mruby-hiredis-test:hash")
+end
+
+assert("Hiredis#call argument encoding") do
+  hiredis = Hiredis.new
+  hiredis.call(:del, "mruby-hiredis-test:hash", "mruby-hiredis-test:foo", "mruby-hiredis-test:bar")
+  assert_equal(2, hiredis.call(:hset, "mruby-hiredis-test:hash", {"foo" => 1, :bar => 1.5}))
+  assert_equal({"foo" => "1", "bar" => "1.5"}, hiredis.call(:hgetall, "mruby-hiredis-test:hash"))
+  assert_equal("OK", hiredis.call(:mset, [["mruby-hiredis-test:foo", 1], ["mruby-hiredis-test:bar", 2.0]]))
+  assert_equal(["1", "2.0"], hiredis.call(:mget, "mruby-hiredis-test:foo", "mruby-hiredis-test:bar"))
+  hiredis.call(:del, "mruby-hiredis-test:hash", "mruby-hiredis-test:foo", "mruby-hiredis-test:bar")
+end
+
+assert("Hiredis writes large arguments without copying them") do
+  hiredis = Hiredis.new
+  value = "x" * (256 * 1024)
+  assert_equal("OK", hiredis.call(:set, "mruby-hiredis-test:large", value))
+  assert_equal(value, hiredis.call(:get, "mruby-hiredis-test:large"))
+  hiredis.queue(:del, "mruby-hiredis-test:large")
+  hiredis.queue(:rpush, "mruby-hiredis-test:large", ["a", value, {"b" => value}])
+  hiredis.queue(:lrange, "mruby-hiredis-test:large", 0, -1)
+  assert_equal([1, 4, ["a", value, "b", value]], hiredis.bulk_reply)
+  assert_false(value.frozen?)
+
+  async = Hiredis::Async.new
+  replies = []
+  async.queue(:ping) { |reply| replies << reply }
+  async.evloop.run_once while replies.empty?
+  async.queue(:del, "mruby-hiredis-test:large") { |reply| replies << reply }
+  async.queue(:set, "mruby-hiredis-test:large", value) { |reply| replies << reply }
+  assert_true(value.frozen?)
+  async.queue(:strlen, "mruby-hiredis-test:large") { |reply| replies << reply }
+  async.queue(:del, "mruby-hiredis-test:large") do |reply|
+    replies << reply
+    async.disconnect
+  end
+  async.evloop.run
+  assert_equal(["PONG", 1, "OK", value.bytesize, 1], replies)
+  assert_false(value.frozen?)
+end
+
+assert("Hiredis#call_lazy") do
+  hiredis = Hiredis.new
+  hiredis.call(:del, "mruby-hiredis-test:list", "mruby-hiredis-test:hash")
+  hiredis.call(:rpush, "mruby-hiredis-test:list", "a", "b", "c")
+  hiredis.call(:hset, "mruby-hiredis-test:hash", "foo", "bar")
+
+  reply = hiredis.call_lazy(:lrange, "mruby-hiredis-test:list", 0, -1)
+  assert_kind_of(Hiredis::Reply, reply)
+  assert_equal(3, reply.size)
+  assert_equal("b", reply[1])
+  assert_equal("c", reply[-1])
+  assert_nil(reply[3])
+  assert_equal(["a", "b", "c"], reply.to_a)
+  assert_equal(["A", "B", "C"], reply.map(&:upcase))
+  assert_equal(3, reply.count)
+  assert_false(reply.consumed?)
+  assert_equal("a", reply[0])
+  reply.free
+  assert_true(reply.consumed?)
+  assert_raise(Hiredis::Error) { reply[0] }
+  assert_raise(Hiredis::Error) { reply.size }
+
+  elements = []
+  hiredis.call_lazy(:hgetall, "mruby-hiredis-test:hash").each { |key, value| elements << [key, value] }
+  assert_equal([["foo", "bar"]], elements)
+
+  assert_equal(3, hiredis.call_lazy(:llen, "mruby-hiredis-test:list"))
+  assert_equal(["a"], hiredis.call(:lrange, "mruby-hiredis-test:list", 0, 0))
+  hiredis.call(:del, "mruby-hiredis-test:list", "mruby-hiredis-test:hash")
+end
+
+assert("Hiredis#call_each") do
+  hiredis = Hiredis.new
+  hiredis.call(:del, "mruby-hiredis-test:list", "mruby-hiredis-test:hash")
+  hiredis.call(:rpush, "mruby-hiredis-test:list", (1..1000).to_a)
+  hiredis.call(:hset, "mruby-hiredis-test:hash", "foo", "bar")
+
+  elements = []
+  assert_equal(1000, hiredis.call_each(:lrange, "mruby-hiredis-test:list", 0, -1) { |element| elements << element })
+  assert_equal((1..1000).map { |i| i.to_s }, elements)
+
+  pairs = []
+  hiredis.call_each(:hgetall, "mruby-hiredis-test:hash") { |key, value| pairs << [key, value] }
+  assert_equal([["foo", "bar"]], pairs)
+
+  hiredis.call_each(:lrange, "mruby-hiredis-test:list", 0, -1) { |element| break }
+  assert_equal(1000, hiredis.call(:llen, "mruby-hiredis-test:list"))
+  assert_equal(1000, hiredis.call_each(:llen, "mruby-hiredis-test:list") {})
+  hiredis.call(:del, "mruby-hiredis-test:list", "mruby-hiredis-test:hash")
+end
+
+assert("Hiredis#get_to and Hiredis#set_from") do
+  source = Class.new do
+    attr_reader :reads
+    def initialize(data)
+      @data = data
+      @reads = []
+    end
+
+    def read(n)
+      @reads << n
+      chunk = @data[0, n]
+      @data = @data[n..-1]
+      chunk
+    end
+  end
+  sink = Class.new do
+    attr_reader :data, :writes
+    def initialize
+      @data = ""
+      @writes = 0
+    end
+
+    def write(chunk)
+      @writes += 1
+      @data << chunk
+    end
+  end
+
+  hiredis = Hiredis.new
+  value = "0123456789" * 10_000
+  io = source.new(value)
+  assert_equal("OK", hiredis.set_from("mruby-hiredis-test:blob", io, value.bytesize, buffer: 4096))
+  assert_true(io.reads.all? { |n| n <= 4096 })
+  assert_equal(value, hiredis.call(:get, "mruby-hiredis-test:blob"))
+
+  out = sink.new
+  assert_equal(value.bytesize, hiredis.get_to("mruby-hiredis-test:blob", out, buffer: 4096))
+  assert_equal(value, out.data)
+  assert_true(out.writes >= value.bytesize / 4096)
+
+  chunks = []
+  hiredis.get_to("mruby-hiredis-test:blob", buffer: 1000) { |chunk| chunks << chunk.bytesize }
+  assert_true(chunks.all? { |size| size <= 1000 })
+  assert_equal(value.bytesize, chunks.inject(0) { |sum, size| sum + size })
+
+  hiredis.get_to("mruby-hiredis-test:blob") { |chunk| break }
+  assert_equal("PONG", hiredis.ping)
+
+  assert_equal("OK", hiredis.set_from(:"mruby-hiredis-test:symbol", source.new("abc"), 3))
+  out = sink.new
+  assert_equal(3, hiredis.get_to(:"mruby-hiredis-test:symbol", out))
+  assert_equal("abc", out.data)
+  assert_raise(TypeError) { hiredis.get_to(["a", "b"]) { |chunk| } }
+  hiredis.call(:del, "mruby-hiredis-test:symbol")
+
+  assert_nil(hiredis.get_to("mruby-hiredis-test:missing") { |chunk| })
+  hiredis.call(:rpush, "mruby-hiredis-test:list", "a")
+  assert_raise(Hiredis::ReplyError) { hiredis.get_to("mruby-hiredis-test:list") { |chunk| } }
+
+  assert_raise(ArgumentError) { hiredis.set_from("mruby-hiredis-test:blob", source.new("short"), 100) }
+  assert_raise(EOFError) { hiredis.ping }
+  hiredis.reconnect
+  assert_equal(value.bytesize, hiredis.call(:strlen, "mruby-hiredis-test:blob"))
+  hiredis.call(:del, "mruby-hiredis-test:blob", "mruby-hiredis-test:list")
+end
+
+assert("Hiredis#scan_each") do
+  hiredis = Hiredis.new
+  hiredis.call(:del, "mruby-hiredis-test:set", "mruby-hiredis-test:hash")
+  hiredis.call(:sadd, "mruby-hiredis-test:set", (1..500).to_a)
+  hiredis.call(:hset, "mruby-hiredis-test:hash", {"foo" => "bar", "baz" => "qux"})
+
+  members = []
+  hiredis.sscan_each("mruby-hiredis-test:set", :count, 10) { |member| members << member.to_i }
+  assert_equal((1..500).to_a, members.sort)
+
+  fields = {}
+  hiredis.hscan_each("mruby-hiredis-test:hash") { |field, value| fields[field] = value }
+  assert_equal({"foo" => "bar", "baz" => "qux"}, fields)
+
+  keys = []
+  hiredis.scan_each(:match, "mruby-hiredis-test:*") { |key| keys << key }
+  assert_equal(["mruby-hiredis-test:hash", "mruby-hiredis-test:set"], keys.sort.uniq)
+  assert_equal(0, hiredis.pending)
+  assert_raise(Hiredis::Error) do
+    hiredis.sscan_each("mruby-hiredis-test:set", :count, 10) { |member| hiredis.call(:get, member) }
+  end
+  assert_equal(0, hiredis.pending)
+  assert_equal("PONG", hiredis.ping)
+  hiredis.call(:del, "mruby-hiredis-test:set", "mruby-hiredis-test:hash")
+end
+
+assert("Hiredis::Pool") do
+  pool = Hiredis::Pool.new("localhost", 6379, size: 2)
+  first = nil
+  pool.with do |hiredis|
+    first = hiredis
+    assert_equal("PONG", hiredis.call(:ping))
+    pool.with do |other|
+      assert_not_equal(first, other)
+      assert_raise(Hiredis::Pool::TimeoutError) { pool.checkout }
+    end
+  end
+  pool.with { |hiredis| assert_equal(first, hiredis) }
+  assert_equal(2, pool.available)
+
+  stats = pool.stats
+  assert_equal(3, stats[:checkouts])
+  assert_equal(2, stats[:connects])
+  assert_equal(1, stats[:waits])
+
+  pool.with { |hiredis| hiredis.close }
+  assert_equal(2, pool.available)
+  pool.with { |hiredis| assert_false(hiredis.closed?) }
+
+  assert_raise(IOError) { pool.with { |hiredis| raise IOError, "broken" } }
+  assert_equal(1, pool.stats[:reconnects])
+  pool.with { |hiredis| assert_equal("PONG", hiredis.ping) }
+  pool.close
+
+  held = nil
+  waits = []
+  pool = Hiredis::Pool.new("localhost", 6379, size: 1, timeout: 1, wait: lambda { |remaining|
+    waits << remaining
+    pool.checkin(held)
+  })
+  held = pool.checkout
+  assert_equal(held, pool.checkout)
+  assert_equal(1, waits.size)
+  assert_true(waits[0] > 0 && waits[0] <= 1)
+  pool.checkin(held)
+  pool.close
+
+  pool = Hiredis::Pool.new("localhost", 6379, size: 1, timeout: 0.05, wait: lambda { |remaining| })
+  held = pool.checkout
+  assert_raise(Hiredis::Pool::TimeoutError) { pool.checkout }
+  pool.checkin(held)
+  pool.close
+end
+
+assert("Hiredis::Cluster.key_slot") do
+  assert_equal(12739, Hiredis::Cluster.key_slot("123456789"))
+  assert_equal(12182, Hiredis::Cluster.key_slot("foo"))
+  assert_equal(12182, Hiredis::Cluster.key_slot(:foo))
+  assert_equal(Hiredis::Cluster.key_slot("foo"), Hiredis::Cluster.key_slot("{foo}.bar"))
+  assert_not_equal(Hiredis::Cluster.key_slot("foo"), Hiredis::Cluster.key_slot("{}foo"))
+end
+
+# needs a cluster on 127.0.0.1:7000, `rake cluster` starts one
+assert("Hiredis::Cluster") do
+  cluster = begin
+    Hiredis::Cluster.new([["127.0.0.1", 7000]])
+  rescue IOError, SystemCallError, Hiredis::Error
+    skip "no redis cluster on 127.0.0.1:7000"
+  end
+  keys = (0...16).map { |i| "mruby-hiredis-test:cluster:#{i}" }
+  keys.each { |key| assert_equal("OK", cluster.set(key, key)) }
+  assert_true(cluster.nodes.size > 1)
+  assert_equal("PONG", cluster.ping)
+  slots = cluster.instance_variable_get(:@slots)
+  assert_equal(slots[0], cluster.send(:addr_for, cluster.send(:key_for, :config, [:get, "maxmemory"])))
+
+  replies = cluster.pipelined do |pipeline|
+    keys.each { |key| pipeline.get(key) }
+  end
+  assert_equal(keys, replies)
+
+  # point two slots at the wrong node, the MOVED for one leaves the other alone
+  first, second = Hiredis::Cluster.key_slot(keys[0]), Hiredis::Cluster.key_slot(keys[1])
+  owners = [slots[first], slots[second]]
+  wrong = lambda { |owner| slots.find { |addr| addr && addr != owner } }
+  slots[first], slots[second] = wrong.call(owners[0]), wrong.call(owners[1])
+  assert_equal(keys[0], cluster.get(keys[0]))
+  assert_equal(owners[0], slots[first])
+  assert_not_equal(owners[1], slots[second])
+  assert_equal([keys[1], keys[2]], cluster.pipelined { |pipeline| pipeline.get(keys[1]); pipeline.get(keys[2]) })
+  assert_equal(owners[1], slots[second])
+
+  keys.each { |key| cluster.del(key) }
+  cluster.close
+end
+
+assert("Hiredis#listen") do
+  hiredis = Hiredis.new
+  publisher = Hiredis.new
+  channels = []
+  patterns = []
+  hiredis.listen(:subscribe, "mruby-hiredis-test:a", "mruby-hiredis-test:b") { |message| channels << message }
+  hiredis.listen(:psubscribe, "mruby-hiredis-test:*") { |message| patterns << message }
+  3.times { hiredis.dispatch }
+  assert_equal(["subscribe", "subscribe"], [channels[0][0], channels[1][0]])
+  assert_equal("psubscribe", patterns[0][0])
+
+  publisher.publish("mruby-hiredis-test:b", "hello")
+  2.times { hiredis.dispatch }
+  assert_equal(["message", "mruby-hiredis-test:b", "hello"], channels.last)
+  assert_equal(["pmessage", "mruby-hiredis-test:*", "mruby-hiredis-test:b", "hello"], patterns.last)
+
+  # messages read by a command on the subscribed connection wait for dispatch
+  publisher.publish("mruby-hiredis-test:a", "queued")
+  assert_equal("PONG", hiredis.ping)
+  2.times { hiredis.dispatch }
+  assert_equal(["message", "mruby-hiredis-test:a", "queued"], channels.last)
+  assert_equal(["pmessage", "mruby-hiredis-test:*", "mruby-hiredis-test:a", "queued"], patterns.last)
+
+  hiredis.listen(:unsubscribe, "mruby-hiredis-test:a", "mruby-hiredis-test:b")
+  2.times { hiredis.dispatch }
+  assert_equal("unsubscribe", channels.last[0])
+  assert_raise(ArgumentError) { hiredis.listen(:get, "mruby-hiredis-test:a") }
+end
+
+assert("Hiredis.new with options") do
+  hiredis = Hiredis.new("localhost", 6379, connect_timeout: 1, timeout: 0.5, keepalive: 15, nodelay: true, rcvbuf: 65536, maxbuf: 0)
+  assert_equal("PONG", hiredis.ping)
+  hiredis.reconnect
+  assert_equal("PONG", hiredis.ping)
+  hiredis = Hiredis.new("localhost", 6379, nonblock: true, connect_timeout: 1, timeout: 0.5)
+  assert_equal("PONG", hiredis.ping)
+  assert_equal("OK", hiredis.set("mruby-hiredis-test:nonblock", "bar"))
+  assert_equal("bar", hiredis.get("mruby-hiredis-test:nonblock"))
+  hiredis.del("mruby-hiredis-test:nonblock")
+  threaded = Hiredis::Threaded.new("localhost", 6379, nonblock: true)
+  assert_equal("PONG", threaded.call(:ping))
+  threaded.close
+  assert_raise(ArgumentError) { Hiredis.new("localhost", 6379, bogus: 1) }
+  assert_raise(ArgumentError) { Hiredis.new("localhost", 6379, rcvbuf: -1) }
+  assert_raise(TypeError) { Hiredis.new("localhost", 6379, timeout: "1") }
+end
+
+assert("Hiredis command timeout") do
+  hiredis = Hiredis.new("localhost", 6379, timeout: 0.1)
+  started = Time.now
+  assert_raise(SystemCallError) { hiredis.blpop("mruby-hiredis-test:empty", 0) }
+  assert_true(Time.now - started < 5)
+end
+
+assert("Hiredis#enable_cache") do
+  hiredis = Hiredis.new
+  writer = Hiredis.new
+  writer.set("mruby-hiredis-test:cache", "one")
+  hiredis.enable_cache(1024 * 1024, max_staleness: 0)
+  miss = hiredis.get("mruby-hiredis-test:cache")
+  assert_equal("one", miss)
+  assert_false(miss.frozen?)
+  miss << "changed"
+  hit = hiredis.get("mruby-hiredis-test:cache")
+  assert_equal("one", hit)
+  assert_equal(1, hiredis.cache_stats[:hits])
+  assert_equal(1, hiredis.cache_stats[:misses])
+  assert_true(hit.frozen?)
+  assert_same(hit, hiredis.get("mruby-hiredis-test:cache"))
+
+  writer.set("mruby-hiredis-test:cache", "two")
+  # the invalidation is queued ahead of the PONG, so it has been read afterwards
+  hiredis.ping
+  assert_equal("two", hiredis.get("mruby-hiredis-test:cache"))
+  assert_equal(1, hiredis.cache_stats[:invalidations])
+
+  hiredis.disable_cache
+  writer.del("mruby-hiredis-test:cache")
+  assert_nil(hiredis.get("mruby-hiredis-test:cache"))
+  assert_false(hiredis.cache_stats[:enabled])
+end
+
+assert("Hiredis#stats") do
+  hiredis = Hiredis.new
+  hiredis.reset_stats
+  hiredis.set("mruby-hiredis-test:stats", "1")
+  hiredis.get("mruby-hiredis-test:stats")
+  hiredis.queue(:get, "mruby-hiredis-test:stats")
+  hiredis.queue(:get, "mruby-hiredis-test:stats")
+  hiredis.reply
+  hiredis.reply
+  stats = hiredis.stats
+  assert_equal(4, stats[:commands])
+  assert_equal(4, stats[:replies])
+  assert_equal(2, stats[:max_pending])
+  assert_true(stats[:bytes_written] > 0)
+  assert_true(stats[:bytes_read] > 0)
+  assert_equal(3, stats[:latency]["get"][:count])
+  assert_true(stats[:latency]["get"][:min] <= stats[:latency]["get"][:p99])
+  assert_true(stats[:latency]["get"][:p99] <= stats[:latency]["get"][:max])
+
+  hiredis.reset_stats
+  assert_equal(0, hiredis.stats[:commands])
+  assert_equal({}, hiredis.stats[:latency])
+
+  assert_kind_of(Hiredis::ReplyError, hiredis.call(:nonexistant))
+  assert_equal(1, hiredis.stats[:errors])
+  assert_equal(0, hiredis.stats[:io_errors])
+  hiredis.del("mruby-hiredis-test:stats")
+end
+
+assert("Hiredis interns status replies and map keys") do
+  hiredis = Hiredis.new
+  first = hiredis.set("mruby-hiredis-test:intern", "1")
+  second = hiredis.set("mruby-hiredis-test:intern", "2")
+  assert_equal("OK", first)
+  assert_true(first.frozen?)
+  assert_same(first, second)
+
+  hiredis.del("mruby-hiredis-test:intern")
+  hiredis.hset("mruby-hiredis-test:intern", "field", "value")
+  first = hiredis.hgetall("mruby-hiredis-test:intern")
+  second = hiredis.hgetall("mruby-hiredis-test:intern")
+  assert_same(first.keys.first, second.keys.first)
+  assert_false(first.values.first.frozen?)
+
+  symbols = Hiredis.new("localhost", 6379, symbol_keys: true)
+  assert_equal({:field => "value"}, symbols.hgetall("mruby-hiredis-test:intern"))
+  hiredis.del("mruby-hiredis-test:intern")
+
+  reader = Hiredis::Reader.new(symbol_keys: true)
+  reader.feed("%1\r\n+a\r\n+b\r\n")
+  assert_equal({:a => "b"}, reader.gets)
+  assert_raise(ArgumentError) { Hiredis::Reader.new(timeout: 1) }
+end
+
+assert("Hiredis#prepare") do
+  assert_equal("*2\r\n$3\r\nget\r\n$3\r\nfoo\r\n", Hiredis.format_command(:get, "foo"))
+  assert_true(Hiredis.format_command(:get, "foo").frozen?)
+
+  hiredis = Hiredis.new
+  hset = hiredis.prepare(:hset, "mruby-hiredis-test:prepared", :_, :_)
+  hget = hiredis.prepare(:hget, "mruby-hiredis-test:prepared", :_)
+  assert_equal(2, hset.command.arity)
+  assert_equal("*3\r\n$4\r\nhget\r\n$27\r\nmruby-hiredis-test:prepared\r\n$1\r\na\r\n", hget.command.format("a"))
+  hset.call("a", 1)
+  hset.call("b", 2.5)
+  assert_equal("1", hget.call("a"))
+  hget.queue("b")
+  hiredis.queue_formatted(Hiredis.format_command(:hlen, "mruby-hiredis-test:prepared"))
+  assert_equal(["2.5", 2], hiredis.bulk_reply)
+  assert_raise(ArgumentError) { hget.call }
+  assert_raise(ArgumentError) { Hiredis.format_command(:_, "foo") }
+  assert_equal("*3\r\n$4\r\nmget\r\n$1\r\na\r\n$1\r\nb\r\n", Hiredis.format_command(:mget, ["a", "b"]))
+  assert_equal("*4\r\n$4\r\nhset\r\n$1\r\nh\r\n$1\r\nf\r\n$1\r\nv\r\n", Hiredis.format_command(:hset, "h", {"f" => "v"}))
+  hiredis.del("mruby-hiredis-test:prepared-set")
+  sadd = hiredis.prepare(:sadd, "mruby-hiredis-test:prepared-set", [1, 2, 3], :_)
+  assert_equal(4, sadd.call(4))
+  assert_equal(0, hiredis.call(:sadd, "mruby-hiredis-test:prepared-set", [1, 2, 3, 4]))
+  assert_raise(TypeError) { sadd.call([5, 6]) }
+  hiredis.del("mruby-hiredis-test:prepared", "mruby-hiredis-test:prepared-set")
+end
+
+assert("Hiredis#script") do
+  hiredis = Hiredis.new
+  hiredis.call(:del, "mruby-hiredis-test:script")
+  source = "return redis.call('incrby', KEYS[1], ARGV[1])"
+  incrby = hiredis.script(source)
+  assert_equal("e0e1f9fabfc9d4800c877a703b823ac0578ff8db", Hiredis::Script.digest("return 1"))
+  hiredis.call(:script, :flush)
+  assert_equal(2, incrby.call(["mruby-hiredis-test:script"], [2]))
+  assert_equal([1], hiredis.call(:script, :exists, incrby.sha))
+
+  hiredis.call(:script, :flush)
+  incrby.queue(["mruby-hiredis-test:script"], [1])
+  hiredis.queue(:get, "mruby-hiredis-test:script")
+  assert_equal([3, "2"], hiredis.bulk_reply)
+
+  hiredis.call(:script, :flush)
+  replies = hiredis.transaction([incrby, ["mruby-hiredis-test:script"], [1]], [incrby, ["mruby-hiredis-test:script"], [1]])
+  assert_equal([4, 5], replies.last)
+  replies = hiredis.transaction([:evalsha, Hiredis::Script.digest("return 2"), 0], [incrby, ["mruby-hiredis-test:script"], [1]])
+  assert_true(Hiredis::Script.noscript?(replies.last.first))
+  assert_equal(6, replies.last.last)
+
+  hiredis.call(:script, :flush)
+  assert_equal([incrby.sha, Hiredis::Script.digest("return 1")], hiredis.load_scripts(source, "return 1").map(&:sha))
+  assert_equal([1, 1], hiredis.call(:script, :exists, incrby.sha, Hiredis::Script.digest("return 1")))
+  hiredis.call(:del, "mruby-hiredis-test:script")
+end
+
+assert("Hiredis::Reader") do
+  reader = Hiredis::Reader.new
+  assert_false(reader.gets)
+
+  reader.feed("*3\r\n$3\r\nfoo\r\n:4")
+  assert_false(reader.gets)
+  GC.start
+  reader.feed("2\r\n_\r\n+OK\r\n%1\r\n$1\r\na\r\n,1.5\r\n")
+  assert_equal(["foo", 42, nil], reader.gets)
+  assert_equal("OK", reader.gets)
+  assert_equal({"a" => 1.5}, reader.gets)
+  assert_false(reader.gets)
+
+  reader.feed("-ERR wrong\r\n=7\r\ntxt:hello\r\n#t\r\n")
+  error = reader.gets
+  assert_kind_of(Hiredis::ReplyError, error)
+  assert_equal("ERR wrong", error.message)
+  verb = reader.gets
+  assert_equal("txt", verb.type)
+  assert_equal("hello", verb.to_str)
+  assert_true(reader.gets)
+
+  assert_false(reader.has_reply?)
+  reader.feed("#f\r\n_\r")
+  assert_true(reader.has_reply?)
+  assert_true(reader.has_reply?)
+  assert_false(reader.gets)
+  assert_false(reader.has_reply?)
+  reader.feed("\n")
+  assert_true(reader.has_reply?)
+  assert_nil(reader.gets)
+  assert_false(reader.has_reply?)
+  assert_false(reader.gets)
+
+  reader.feed("?bogus\r\n")
+  assert_raise(Hiredis::ProtocolError) { reader.gets }
+  reader.close
+  assert_raise(IOError) { reader.gets }
+end
+
+assert("Hiredis::Threaded") do
+  threaded = Hiredis::Threaded.new("localhost", 6379, timeout: 1)
+  assert_equal("OK", threaded.set("mruby-hiredis-test:threaded", "bar"))
+  assert_equal("bar", threaded.call(:get, "mruby-hiredis-test:threaded"))
+  2_000.times { |i| threaded.queue(:incr, "mruby-hiredis-test:threaded-counter") }
+  assert_equal(2_000, threaded.pending)
+  replies = threaded.bulk_reply
+  assert_equal((1..2_000).to_a, replies)
+  assert_equal(0, threaded.pending)
+  threaded.queue(:nonexistant)
+  assert_kind_of(Hiredis::ReplyError, threaded.reply)
+  assert_raise(RuntimeError) { threaded.reply }
+  threaded.del("mruby-hiredis-test:threaded", "mruby-hiredis-test:threaded-counter")
+  threaded.close
+  assert_raise(IOError) { threaded.call(:ping) }
+
+  threaded = Hiredis::Threaded.new("localhost", 6379, timeout: 1)
+  assert_raise(Hiredis::Error) { threaded.call(:blpop, "mruby-hiredis-test:threaded-empty", 3) }
+  assert_raise(Hiredis::Error) { threaded.call(:ping) }
+  threaded.close
+end
+
 assert("Hiredis::Async") do
   async = Hiredis::Async.new
   async.queue(:del, "mruby-hiredis-test:foo")
@@ -58,6 +626,141 @@ assert("Hiredis::Async") do
   async.evloop.run
 end
 
+assert("Hiredis::Async with Ruby Callbacks") do
+  async = Hiredis::Async.new(Hiredis::Async::Callbacks.new)
+  async.queue(:del, "mruby-hiredis-test:foo")
+  async.queue(:incr, "mruby-hiredis-test:foo") do |reply|
+    assert_equal(1, reply)
+    async.disconnect
+  end
+  async.evloop.run
+end
+
+assert("Hiredis::Async#prepare") do
+  async = Hiredis::Async.new
+  incr = async.prepare(:incrby, "mruby-hiredis-test:prepared", :_)
+  async.queue(:del, "mruby-hiredis-test:prepared")
+  incr.queue(2)
+  incr.queue(3) do |reply|
+    assert_equal(5, reply)
+    async.queue_formatted(Hiredis.format_command(:del, "mruby-hiredis-test:prepared")) { |reply| async.disconnect }
+  end
+  async.evloop.run
+end
+
+assert("Hiredis::Async runs reply blocks in order") do
+  async = Hiredis::Async.new
+  replies = []
+  async.queue(:del, "mruby-hiredis-test:foo")
+  [100, 200].each do |expected|
+    100.times do
+      async.queue(:incr, "mruby-hiredis-test:foo") { |reply| replies << reply }
+    end
+    async.evloop.run_once while replies.length < expected
+  end
+  async.queue(:ping) { |reply| async.disconnect }
+  async.evloop.run
+  assert_equal((1..200).to_a, replies)
+end
+
+assert("Hiredis::Async reuses reply nodes") do
+  async = Hiredis::Async.new
+  replies = []
+  async.queue(:del, "mruby-hiredis-test:list")
+  async.queue(:rpush, "mruby-hiredis-test:list", ["short", "x" * 100])
+  2.times do
+    async.queue(:lrange, "mruby-hiredis-test:list", 0, -1) { |reply| replies << reply }
+  end
+  async.queue(:del, "mruby-hiredis-test:list") { |reply| async.disconnect }
+  async.evloop.run_once while replies.size < 2
+  stats = async.stats
+  async.evloop.run
+  assert_equal([["short", "x" * 100]] * 2, replies)
+  assert_equal(0, stats[:reply_memory])
+  assert_true(stats[:max_reply_memory] > 100)
+  assert_true(stats[:pooled_replies] >= 3)
+end
+
+assert("Hiredis::Async#cork") do
+  async = Hiredis::Async.new
+  replies = []
+  async.queue(:del, "mruby-hiredis-test:corked") { |reply| replies << reply }
+  async.evloop.run_once while replies.empty?
+
+  writes = async.stats[:writes]
+  async.cork do
+    100.times { async.queue(:incr, "mruby-hiredis-test:corked") { |reply| replies << reply } }
+    assert_true(async.corked?)
+    assert_equal(writes, async.stats[:writes])
+  end
+  assert_false(async.corked?)
+  assert_equal(writes + 1, async.stats[:writes])
+  async.evloop.run_once while replies.size < 101
+  assert_equal((1..100).to_a, replies[1..-1])
+
+  async.cork(max_bytes: 1)
+  async.queue(:incr, "mruby-hiredis-test:corked") { |reply| replies << reply }
+  async.evloop.run_once while replies.size < 102
+  assert_equal(101, replies.last)
+  async.queue(:incr, "mruby-hiredis-test:corked") { |reply| replies << reply }
+  async.flush
+  assert_true(async.corked?)
+  async.evloop.run_once while replies.size < 103
+  assert_equal(102, replies.last)
+
+  # nothing else is queued, the timer has to send it
+  async.cork(max_delay: 0.01)
+  async.queue(:incr, "mruby-hiredis-test:corked") { |reply| replies << reply }
+  async.evloop.run_once while replies.size < 104
+  assert_equal(103, replies.last)
+  async.uncork
+
+  async.queue(:del, "mruby-hiredis-test:corked") { |reply| replies << reply }
+  async.disconnect
+  async.evloop.run
+  assert_equal(1, replies.last)
+end
+
+assert("Hiredis::Async subscribes to many channels at once") do
+  async = Hiredis::Async.new
+  publisher = Hiredis.new
+  messages = []
+  async.queue(:subscribe, "mruby-hiredis-test:a", "mruby-hiredis-test:b") do |message|
+    messages << message
+    if message[0] == "subscribe" && message[2] == 2
+      publisher.publish("mruby-hiredis-test:a", "one")
+      publisher.publish("mruby-hiredis-test:b", "two")
+    elsif message[0] == "message" && message[1] == "mruby-hiredis-test:b"
+      async.queue(:unsubscribe)
+    elsif message[0] == "unsubscribe" && message[2] == 0
+      async.disconnect
+    end
+  end
+  async.evloop.run
+  assert_equal(["message", "mruby-hiredis-test:a", "one"], messages[2])
+  assert_equal(["message", "mruby-hiredis-test:b", "two"], messages[3])
+end
+
+assert("Hiredis::FiberClient") do
+  client = Hiredis::FiberClient.new
+  client.del("mruby-hiredis-test:fibers")
+  replies = []
+  10.times do |i|
+    client.spawn do |redis|
+      replies << redis.incr("mruby-hiredis-test:fibers")
+      replies << redis.call(:nonexistant).class
+    end
+  end
+  assert_equal(10, client.running)
+  client.run
+  assert_equal(0, client.running)
+  assert_equal((1..10).to_a, replies.select { |reply| reply.is_a?(Integer) })
+  assert_equal(10, replies.count(Hiredis::ReplyError))
+  assert_equal("10", client.get("mruby-hiredis-test:fibers"))
+  client.del("mruby-hiredis-test:fibers")
+  client.close
+end
+
 assert("Defines IOError when missing") do
   assert_equal(StandardError, IOError.superclass)
 end